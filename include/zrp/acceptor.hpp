@@ -0,0 +1,98 @@
+// SPDX-License-Identifier: BSL-1.0
+// copyleft 2021 youcai <omegacoleman@gmail.com>
+// Distributed under the Boost Software License, Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include "zrp/bindings.hpp"
+
+#ifdef __linux__
+#include <sys/socket.h>
+#endif
+
+namespace zrp {
+
+	const size_t accept_batch_max = 1024;
+
+	/**
+	 * An acceptor that, once woken, takes up to batch connections off the
+	 * backlog without going back to the reactor, until it would block. The
+	 * rest of a batch is handed out by later calls.
+	 *
+	 * With reuse_port, several of them may listen on the same endpoint, one
+	 * per lane, and the kernel spreads connections across them. incoming_cpu
+	 * asks the kernel to prefer this one for connections handled on that
+	 * cpu, -1 leaves it alone.
+	 */
+	struct batch_acceptor : enable_shared_from_this<batch_acceptor> {
+		asio::io_context &ioc_;
+		tcp::acceptor ac_;
+		size_t batch_;
+		deque<tuple<tcp::socket, tcp::endpoint>> ready_;
+
+		batch_acceptor(asio::io_context &ioc, const tcp::endpoint &ep, size_t batch, bool reuse_port = false, int incoming_cpu = -1)
+			: ioc_(ioc), ac_(ioc), batch_(batch)
+		{
+			ac_.open(ep.protocol());
+			ac_.set_option(tcp::acceptor::reuse_address(true));
+			if (reuse_port) {
+#ifdef SO_REUSEPORT
+				ac_.set_option(asio::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true));
+#endif
+			}
+			if (incoming_cpu >= 0) {
+#ifdef SO_INCOMING_CPU
+				ac_.set_option(asio::detail::socket_option::integer<SOL_SOCKET, SO_INCOMING_CPU>(incoming_cpu));
+#endif
+			}
+			ac_.bind(ep);
+			ac_.listen();
+			ac_.non_blocking(true);
+		}
+
+		static shared_ptr<batch_acceptor> create(asio::io_context &ioc, const tcp::endpoint &ep, size_t batch, bool reuse_port = false, int incoming_cpu = -1) {
+			return make_shared<batch_acceptor>(ioc, ep, batch, reuse_port, incoming_cpu);
+		}
+
+		// from the acceptor's own io_context only
+		void close() noexcept {
+			ready_.clear();
+			error_code ec;
+			ac_.close(ec);
+		}
+
+		awaitable<tcp::socket> accept(tcp::endpoint &ep) {
+			while (ready_.empty()) {
+				co_await ac_.async_wait(tcp::acceptor::wait_read, asio::use_awaitable);
+				drain();
+			}
+			auto [s, peer] = move(ready_.front());
+			ready_.pop_front();
+			ep = peer;
+			co_return move(s);
+		}
+
+	private:
+		void drain() {
+			while (ready_.size() < batch_) {
+				error_code ec;
+				tcp::endpoint peer;
+				tcp::socket s = ac_.accept(peer, ec);
+				if (ec == asio::error::would_block || ec == asio::error::try_again) {
+					return; // another lane took it, or the backlog is empty
+				}
+				if (ec == asio::error::connection_aborted) {
+					continue;
+				}
+				if (ec) {
+					if (!ready_.empty()) {
+						return; // hand out what we have, the error shows up again next time
+					}
+					throw system_error{ec};
+				}
+				ready_.emplace_back(move(s), peer);
+			}
+		}
+	};
+
+}
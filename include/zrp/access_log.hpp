@@ -0,0 +1,278 @@
+// SPDX-License-Identifier: BSL-1.0
+// copyleft 2021 youcai <omegacoleman@gmail.com>
+// Distributed under the Boost Software License, Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include "zrp/bindings.hpp"
+
+#include "zrp/exceptions.hpp"
+#include "zrp/file.hpp"
+#include "zrp/log.hpp"
+#include "zrp/msg.hpp"
+
+namespace zrp {
+
+namespace access_log {
+
+	enum class close_reason : uint8_t {
+		closed,  // by either side, with a fin
+		reset,   // by either side, with a rst
+		stopped, // by us, the share or the server stopping
+		error,
+	};
+
+	inline string to_string(const close_reason r) {
+		switch (r) {
+			case close_reason::closed:
+				return "closed";
+			case close_reason::reset:
+				return "reset";
+			case close_reason::stopped:
+				return "stopped";
+			case close_reason::error:
+				return "error";
+		}
+		return "invalid";
+	}
+
+	/**
+	 * One visit, from the visitor's connect to its close. In the file it is
+	 * record_size bytes, integers big endian :
+	 *
+	 *     8  start, microseconds since the unix epoch
+	 *     4  duration, milliseconds
+	 *     8  bytes in, from the visitor
+	 *     8  bytes out, to the visitor
+	 *    16  visitor ip, ipv4 ones mapped to ipv6
+	 *     2  visitor port
+	 *     1  close reason
+	 *     1  length of the share id
+	 *    32  share id, cut at 32 bytes
+	 *
+	 * Each file starts with the 8 bytes of file_magic.
+	 */
+	struct record {
+		uint64_t start_us = 0;
+		uint32_t duration_ms = 0;
+		uint64_t bytes_in = 0;
+		uint64_t bytes_out = 0;
+		asio::ip::address_v6::bytes_type ip{};
+		uint16_t port = 0;
+		close_reason reason = close_reason::closed;
+		string share_id;
+	};
+
+	const size_t record_size = 80;
+	const size_t share_id_max = 32;
+	const string_view file_magic{"zrpacl1\n", 8};
+
+	inline void encode(const record &r, char *out) noexcept {
+		put_uint64<endian::big>(span<char, 8>{out, 8}, r.start_us);
+		put_uint32<endian::big>(span<char, 4>{out + 8, 4}, r.duration_ms);
+		put_uint64<endian::big>(span<char, 8>{out + 12, 8}, r.bytes_in);
+		put_uint64<endian::big>(span<char, 8>{out + 20, 8}, r.bytes_out);
+		std::memcpy(out + 28, r.ip.data(), 16);
+		out[44] = static_cast<char>(r.port >> 8);
+		out[45] = static_cast<char>(r.port & 0xff);
+		out[46] = static_cast<char>(r.reason);
+		size_t len = std::min(r.share_id.size(), share_id_max);
+		out[47] = static_cast<char>(len);
+		std::memset(out + 48, 0, share_id_max);
+		std::memcpy(out + 48, r.share_id.data(), len);
+	}
+
+	inline record decode(const char *in) {
+		record r;
+		r.start_us = extract_uint64<endian::big>(span<const char, 8>{in, 8});
+		r.duration_ms = extract_uint32<endian::big>(span<const char, 4>{in + 8, 4});
+		r.bytes_in = extract_uint64<endian::big>(span<const char, 8>{in + 12, 8});
+		r.bytes_out = extract_uint64<endian::big>(span<const char, 8>{in + 20, 8});
+		std::memcpy(r.ip.data(), in + 28, 16);
+		r.port = static_cast<uint16_t>((static_cast<uint8_t>(in[44]) << 8) | static_cast<uint8_t>(in[45]));
+		r.reason = static_cast<close_reason>(in[46]);
+		size_t len = std::min<size_t>(static_cast<uint8_t>(in[47]), share_id_max);
+		r.share_id.assign(in + 48, len);
+		return r;
+	}
+
+	inline string to_text(const record &r) {
+		auto ip = asio::ip::make_address_v6(r.ip);
+		string ip_text = ip.is_v4_mapped() ? asio::ip::make_address_v4(asio::ip::v4_mapped, ip).to_string() : ip.to_string();
+		chrono::system_clock::time_point start{chrono::duration_cast<chrono::system_clock::duration>(chrono::microseconds{r.start_us})};
+		return fmt::format(FMT_COMPILE("[{}] {} from ip {} port {}, {} bytes in, {} bytes out, {} ms, {}"),
+			log::time_text(start), r.share_id, ip_text, r.port, r.bytes_in, r.bytes_out, r.duration_ms, to_string(r.reason));
+	}
+
+	struct options {
+		string path;
+		uint64_t max_size = 64 * 1024 * 1024;
+		chrono::seconds max_age{86400};
+	};
+
+	inline options load_options(string path, int64_t max_size, int max_age) {
+		if (max_size < static_cast<int64_t>(record_size)) {
+			throw exceptions::bad_config_value{"access_log_max_size", fmt::format(FMT_COMPILE("{}"), max_size)};
+		}
+		if (max_age <= 0) {
+			throw exceptions::bad_config_value{"access_log_max_age", fmt::format(FMT_COMPILE("{}"), max_age)};
+		}
+		options ret;
+		ret.path = move(path);
+		ret.max_size = static_cast<uint64_t>(max_size);
+		ret.max_age = chrono::seconds{max_age};
+		return ret;
+	}
+
+	const chrono::seconds sink_tick{1};
+	const size_t sink_batch_max = 1024; // records, more than that wakes the sink early
+
+	/**
+	 * Appends records to a file from a thread of its own, a batch at a
+	 * time. append() may be called from any thread and takes the lock only
+	 * for copying the record. The file is rotated, renamed with the time
+	 * it is rotated at appended in microseconds, once it grows past
+	 * max_size or has been open for max_age.
+	 */
+	struct sink {
+		options opts_;
+		mutex mtx_;
+		condition_variable cv_;
+		string pending_; // encoded records, guarded by mtx_
+		string writing_;
+		bool stopping_ = false; // guarded by mtx_
+		file f_;
+		chrono::steady_clock::time_point opened_at_;
+		thread thread_;
+		log::logger logger_;
+
+		sink(options opts)
+			: opts_(move(opts)), logger_(log::tag_access_log{}) {}
+
+		static shared_ptr<sink> create(options opts) {
+			return make_shared<sink>(move(opts));
+		}
+
+		void run() {
+			open();
+			thread_ = thread([this]() {
+				write_actor();
+			});
+		}
+
+		// writes out every record appended before it
+		void stop() {
+			{
+				lock_guard lk{mtx_};
+				stopping_ = true;
+			}
+			cv_.notify_one();
+			if (thread_.joinable()) {
+				thread_.join();
+			}
+		}
+
+		void append(const record &r) {
+			char buf[record_size];
+			encode(r, buf);
+			bool wake;
+			{
+				lock_guard lk{mtx_};
+				pending_.append(buf, record_size);
+				wake = pending_.size() == sink_batch_max * record_size;
+			}
+			if (wake) {
+				cv_.notify_one();
+			}
+		}
+
+	private:
+		void open() {
+			error_code ec;
+			f_.open(opts_.path.c_str(), "ab", ec);
+			if (ec) {
+				throw system_error{ec};
+			}
+			if (f_.size() == 0) {
+				f_.write(file_magic.data(), file_magic.size(), ec);
+			}
+			opened_at_ = chrono::steady_clock::now();
+		}
+
+		void rotate() {
+			f_.close();
+			auto now = chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+			string rotated = fmt::format(FMT_COMPILE("{}.{}"), opts_.path, now);
+			// rename() would replace a file rotated at the same time, or before a clock step
+			while (exists(rotated)) {
+				rotated = fmt::format(FMT_COMPILE("{}.{}"), opts_.path, ++now);
+			}
+			if (std::rename(opts_.path.c_str(), rotated.c_str()) != 0) {
+				logger_.warning(FMT_COMPILE("could not rotate access log to {}"), rotated);
+			}
+			open();
+		}
+
+		static bool exists(const string &path) {
+			if (std::FILE *f = std::fopen(path.c_str(), "rb")) {
+				std::fclose(f);
+				return true;
+			}
+			return false;
+		}
+
+		void write_actor() {
+			log::thread_role::as(log::thread_role::access_log_writer{});
+			for (;;) {
+				bool stopping;
+				{
+					unique_lock lk{mtx_};
+					cv_.wait_for(lk, sink_tick, [this]() {
+						return stopping_ || pending_.size() >= sink_batch_max * record_size;
+					});
+					std::swap(pending_, writing_);
+					stopping = stopping_;
+				}
+				try {
+					if (!f_.is_open()) {
+						open(); // rotate() failed to reopen it
+					}
+					if (!writing_.empty()) {
+						error_code ec;
+						f_.write(writing_.data(), writing_.size(), ec);
+						if (ec) {
+							logger_.error("failed to write access log : ").with_exception(system_error{ec});
+						}
+					}
+					if (static_cast<uint64_t>(f_.size()) >= opts_.max_size || chrono::steady_clock::now() - opened_at_ >= opts_.max_age) {
+						rotate();
+					}
+				} catch (const exception& e) {
+					logger_.error("failed to open access log : ").with_exception(e);
+				}
+				writing_.clear();
+				if (stopping) {
+					return;
+				}
+			}
+		}
+	};
+
+	/**
+	 * For zserver dump_access_log, prints the records of a file one per line.
+	 */
+	inline void dump(const string_view path) {
+		file f{string{path}.c_str(), "rb"};
+		char magic[8];
+		if (f.read(magic, sizeof(magic)) != sizeof(magic) || string_view{magic, sizeof(magic)} != file_magic) {
+			throw exceptions::bad_access_log{string{path}};
+		}
+		char buf[record_size];
+		while (f.read(buf, record_size) == record_size) {
+			fmt::print("{}\n", to_text(decode(buf)));
+		}
+	}
+
+}
+
+}
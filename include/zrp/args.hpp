@@ -23,6 +23,7 @@ namespace exceptions {
 enum class program_action_t {
 	run,
 	dump_config,
+	dump_access_log,
 	help
 };
 
@@ -30,6 +31,8 @@ static inline program_action_t program_action = program_action_t::help;
 static inline string program_name = "";
 static inline string config_file_path = "config.json";
 static inline bool dump_full = false;
+static inline string access_log_path = "";
+static inline bool with_access_log = false; // set by programs that write one, before parse_args()
 #ifdef _MSC_VER
 static inline bool with_color = false; // avoid writing garbage to windows cmd
 #else
@@ -75,6 +78,13 @@ void parse_dump_config_args(span<const std::string> args) {
 	}
 }
 
+inline void parse_dump_access_log_args(span<const std::string> args) {
+	if (args.size() != 1) {
+		throw exceptions::bad_args();
+	}
+	access_log_path = args[0];
+}
+
 inline void parse_args(span<const std::string> args)
 {
 	if (args.size() < 1) {
@@ -90,6 +100,9 @@ inline void parse_args(span<const std::string> args)
 	} else if (args[1] == "dump_config") {
 		program_action = program_action_t::dump_config;
 		parse_dump_config_args(args.subspan(2));
+	} else if (with_access_log && args[1] == "dump_access_log") {
+		program_action = program_action_t::dump_access_log;
+		parse_dump_access_log_args(args.subspan(2));
 	} else if (args[1] == "help") {
 		program_action = program_action_t::help;
 	} else {
@@ -99,10 +112,11 @@ inline void parse_args(span<const std::string> args)
 
 inline void print_usage() noexcept {
 	fmt::print(
-			"usage : {} run/dump_config/help [...]\n"
+			"usage : {} run/dump_config/{}help [...]\n"
 			"\n"
 			"    run [path/to/config.json]    run the program\n"
 			"    dump_config [--full]         dump the example config\n"
+			"{}"
 			"    help                         show this message\n"
 			"\n"
 			"supported envs:\n"
@@ -114,7 +128,9 @@ inline void print_usage() noexcept {
 			"    ZRP_TRACE                    show logs at level TRAC\n"
 			"    ZRP_DEBUG                    show logs at level DEBG and TRAC\n"
 			"\n",
-			program_name);
+			program_name,
+			with_access_log ? "dump_access_log/" : "",
+			with_access_log ? "    dump_access_log path/to/log  print an access_log_file as text\n" : "");
 }
 
 };
@@ -7,6 +7,7 @@
 // #define BOOST_ASIO_ENABLE_HANDLER_TRACKING
 
 #include <cstdio>
+#include <cstring>
 #include <atomic>
 #include <deque>
 #include <chrono>
@@ -24,6 +25,11 @@
 #include <bit>
 #include <stack>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <ctime>
+#include <algorithm>
+#include <cmath>
 
 #include "boost/asio.hpp"
 #include "boost/json.hpp"
@@ -51,6 +57,10 @@ using std::make_shared;
 using std::enable_shared_from_this;
 using std::make_unique;
 using std::thread;
+using std::mutex;
+using std::lock_guard;
+using std::unique_lock;
+using std::condition_variable;
 using boost::asio::buffer;
 using boost::asio::async_read;
 using boost::asio::async_write;
@@ -84,6 +94,9 @@ using std::exception_ptr;
 namespace chrono = std::chrono;
 namespace asio = boost::asio;
 namespace this_coro = boost::asio::this_coro;
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+using local_stream = boost::asio::local::stream_protocol;
+#endif
 
 }
 
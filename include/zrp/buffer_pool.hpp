@@ -0,0 +1,129 @@
+// SPDX-License-Identifier: BSL-1.0
+// copyleft 2021 youcai <omegacoleman@gmail.com>
+// Distributed under the Boost Software License, Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include "zrp/bindings.hpp"
+
+#include "zrp/stats.hpp"
+
+namespace zrp {
+
+	const size_t buffer_pool_min_size = 4096;
+	const size_t buffer_pool_classes = 8; // 4 KiB .. 512 KiB
+	const size_t buffer_pool_cache_bytes = 4 * 1024 * 1024;
+
+	struct buffer_pool;
+
+	/**
+	 * A buffer leased from the buffer pool of the current thread, goes back to
+	 * the pool of whichever thread drops it.
+	 */
+	struct pooled_buffer {
+		unique_ptr<char[]> data_;
+		size_t size_ = 0;
+
+		pooled_buffer() = default;
+		pooled_buffer(unique_ptr<char[]> data, size_t size) noexcept
+			: data_(move(data)), size_(size) {}
+		pooled_buffer(pooled_buffer&&) = default;
+		pooled_buffer& operator=(pooled_buffer&& o) noexcept;
+		~pooled_buffer();
+
+		char* data() const noexcept {
+			return data_.get();
+		}
+
+		size_t size() const noexcept {
+			return size_;
+		}
+
+		void release() noexcept;
+	};
+
+	/**
+	 * Per-thread cache of power-of-two sized buffers, so that a pipe only
+	 * holds one while data is moving.
+	 */
+	struct buffer_pool {
+		array<vector<unique_ptr<char[]>>, buffer_pool_classes> free_;
+		size_t cached_bytes_ = 0;
+
+		// buffers dropped while the thread is exiting are simply freed
+		static inline thread_local bool destroyed_ = false;
+
+		static buffer_pool& local() noexcept {
+			thread_local buffer_pool pool;
+			return pool;
+		}
+
+		~buffer_pool() {
+			destroyed_ = true;
+			stats::buffers_cached_bytes.sub(cached_bytes_);
+		}
+
+		static size_t class_of(size_t size) noexcept {
+			size_t cls = 0;
+			while (cls + 1 < buffer_pool_classes && (buffer_pool_min_size << cls) < size) {
+				cls++;
+			}
+			return cls;
+		}
+
+		pooled_buffer acquire(size_t size) {
+			size_t cls = class_of(size);
+			size_t cls_size = buffer_pool_min_size << cls;
+			stats::buffers_in_use_bytes.add(cls_size);
+			auto& fl = free_[cls];
+			if (!fl.empty()) {
+				auto ret = move(fl.back());
+				fl.pop_back();
+				cached_bytes_ -= cls_size;
+				stats::buffers_cached_bytes.sub(cls_size);
+				return {move(ret), cls_size};
+			}
+			return {make_unique<char[]>(cls_size), cls_size};
+		}
+
+		void release(unique_ptr<char[]> data, size_t size) noexcept {
+			stats::buffers_in_use_bytes.sub(size);
+			if (cached_bytes_ + size > buffer_pool_cache_bytes) {
+				return;
+			}
+			try {
+				free_[class_of(size)].emplace_back(move(data));
+			} catch (...) {
+				return;
+			}
+			cached_bytes_ += size;
+			stats::buffers_cached_bytes.add(size);
+		}
+	};
+
+	inline pooled_buffer& pooled_buffer::operator=(pooled_buffer&& o) noexcept {
+		release();
+		data_ = move(o.data_);
+		size_ = o.size_;
+		o.size_ = 0;
+		return *this;
+	}
+
+	inline pooled_buffer::~pooled_buffer() {
+		release();
+	}
+
+	inline void pooled_buffer::release() noexcept {
+		if (!data_) {
+			return;
+		}
+		if (buffer_pool::destroyed_) {
+			stats::buffers_in_use_bytes.sub(size_);
+			data_.reset();
+		} else {
+			buffer_pool::local().release(move(data_), size_);
+		}
+		size_ = 0;
+	}
+
+}
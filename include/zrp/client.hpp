@@ -13,12 +13,22 @@
 #include "zrp/msg.hpp"
 #include "zrp/log.hpp"
 #include "zrp/rlimit.hpp"
+#include "zrp/stats.hpp"
+#include "zrp/worker_pool.hpp"
+#include "zrp/semaphore.hpp"
+#include "zrp/local_pool.hpp"
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+#include "zrp/handoff.hpp"
+#endif
 
 namespace zrp {
 
 namespace client {
 
 static inline config_t cfg;
+static inline pipe_options pipe_opts;
+static inline log::writer_options log_opts;
+static inline size_t tunnel_window = mux_initial_window;
 
 inline void load_config(const string_view filename) {
 	static json::value jv = parse_file(filename);
@@ -28,6 +38,32 @@ inline void load_config(const string_view filename) {
 	pretty_print(json::value_from(cfg));
 
 	try_set_rlimit_nofile(cfg.rlimit_nofile);
+	pipe_opts = with_pipeline_depth(load_pipe_options(cfg.pipe_engine), cfg.pipe_pipeline_depth);
+	tunnel_window = check_tunnel_window(cfg.tunnel_window);
+	log_opts = log::load_writer_options(cfg.log_buffer, cfg.log_overflow);
+	check_worker_pool_bounds(cfg.worker_count_min, cfg.worker_count_max);
+	for (auto& it : cfg.tcp_shares) {
+		if (it.second.local_pool_size < 0) {
+			throw exceptions::bad_config_value{"local_pool_size", fmt::format(FMT_COMPILE("{}"), it.second.local_pool_size)};
+		}
+		if (it.second.local_pool_idle_timeout < 1) {
+			throw exceptions::bad_config_value{"local_pool_idle_timeout", fmt::format(FMT_COMPILE("{}"), it.second.local_pool_idle_timeout)};
+		}
+#ifndef BOOST_ASIO_HAS_LOCAL_SOCKETS
+		if (!it.second.local_path.empty()) {
+			throw exceptions::bad_config_value{"local_path", it.second.local_path};
+		}
+#endif
+		if (it.second.handoff && it.second.local_path.empty()) {
+			throw exceptions::bad_config_value{"handoff", "true (without local_path)"};
+		}
+		if (it.second.handoff && (cfg.tunnel_count > 0 || cfg.reuse_workers)) {
+			throw exceptions::bad_config_value{"handoff", "true (only worker connections can be handed off, not tunnels)"};
+		}
+	}
+	if (cfg.worker_connect_limit < 1) {
+		throw exceptions::bad_config_value{"worker_connect_limit", fmt::format(FMT_COMPILE("{}"), cfg.worker_connect_limit)};
+	}
 }
 
 
@@ -50,11 +86,24 @@ struct tcp_share : enable_shared_from_this<tcp_share> {
 	const string share_id_;
 	const tcp::endpoint ep_;
 	waitqueue<tcp::socket> wq_;
+	waitqueue<mux_socket> streams_;
 	unsigned short port_;
 	ctrl_ptr_t ctrl_;
 	map<int, tcp_share_worker_weak_ptr_t> workers_{};
 	int next_worker_id_ = 0;
 	atomic<int> nr_workers_ = 0;
+	int nr_connecting_ = 0;
+	chrono::steady_clock::time_point started_at_;
+	bool ready_ = false;
+	worker_pool_sizer sizer_;
+	steady_timer pool_timer_;
+	int exported_idle_ = 0;
+	int exported_target_ = 0;
+	pipe_options popts_;
+	bool on_demand_; // no idle workers, only those the server asks for
+	shared_ptr<local_pool> local_pool_; // null unless local_pool_size is set
+	string local_path_; // a unix domain socket to connect to instead of ep_, if set
+	bool handoff_ = false; // visits are passed to local_path_ as the worker socket itself
 	bool closing_ = false;
 	log::logger logger_;
 
@@ -72,13 +121,47 @@ struct tcp_share : enable_shared_from_this<tcp_share> {
 		awaitable<tcp::socket> get_socket(tcp::endpoint &ep);
 	};
 
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+	struct unix_upstream {
+		shared_ptr<tcp_share> sh_;
+
+		unix_upstream(shared_ptr<tcp_share> sh) noexcept;
+		awaitable<local_stream::socket> get_socket(const tcp::endpoint ep);
+	};
+#endif
+
+	// streams opened by the server on any of the tunnels
+	struct mux_downstream {
+		shared_ptr<tcp_share> sh_;
+
+		mux_downstream(shared_ptr<tcp_share> sh) noexcept;
+		awaitable<mux_socket> get_socket(tcp::endpoint &ep);
+	};
+
 	using forwarder_t = forwarder<upstream, downstream>;
 	using forwarder_ptr_t = shared_ptr<forwarder_t>;
 	using forwarder_weak_ptr_t = weak_ptr<forwarder_t>;
 	forwarder_weak_ptr_t fwd_;
 
-	tcp_share(asio::io_context &ioc, asio::io_context &fwd_ioc, ctrl_ptr_t ctrl, string share_id, tcp::endpoint ep, unsigned short port);
-	static shared_ptr<tcp_share> create(asio::io_context &ioc, asio::io_context &fwd_ioc, ctrl_ptr_t ctrl, string share_id, tcp::endpoint ep, unsigned short port);
+	using mux_forwarder_t = forwarder<upstream, mux_downstream>;
+	using mux_forwarder_ptr_t = shared_ptr<mux_forwarder_t>;
+	using mux_forwarder_weak_ptr_t = weak_ptr<mux_forwarder_t>;
+	mux_forwarder_weak_ptr_t mux_fwd_;
+
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+	using unix_forwarder_t = forwarder<unix_upstream, downstream>;
+	using unix_forwarder_ptr_t = shared_ptr<unix_forwarder_t>;
+	using unix_forwarder_weak_ptr_t = weak_ptr<unix_forwarder_t>;
+	unix_forwarder_weak_ptr_t unix_fwd_;
+
+	using unix_mux_forwarder_t = forwarder<unix_upstream, mux_downstream>;
+	using unix_mux_forwarder_ptr_t = shared_ptr<unix_mux_forwarder_t>;
+	using unix_mux_forwarder_weak_ptr_t = weak_ptr<unix_mux_forwarder_t>;
+	unix_mux_forwarder_weak_ptr_t unix_mux_fwd_;
+#endif
+
+	tcp_share(asio::io_context &ioc, asio::io_context &fwd_ioc, ctrl_ptr_t ctrl, string share_id, tcp::endpoint ep, unsigned short port, pipe_options popts, bool on_demand);
+	static shared_ptr<tcp_share> create(asio::io_context &ioc, asio::io_context &fwd_ioc, ctrl_ptr_t ctrl, string share_id, tcp::endpoint ep, unsigned short port, pipe_options popts, bool on_demand);
 
 	void try_stop() noexcept;
 	void handle_error(const exception& e) noexcept;
@@ -86,16 +169,29 @@ struct tcp_share : enable_shared_from_this<tcp_share> {
 	int next_worker_id();
 
 	upstream make_upstream() noexcept;
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+	unix_upstream make_unix_upstream() noexcept;
+#endif
 	downstream make_downstream() noexcept;
+	mux_downstream make_mux_downstream() noexcept;
 
-	void run();
-	awaitable<void> run_forwarder();
+	void run(bool tunnels, bool reuse);
+	awaitable<void> run_forwarder(bool streams);
 
 	awaitable<void> add_worker();
 	void cleanup_workers();
+	int idle_workers();
 	void chk_need_workers();
-	awaitable<void> chk_need_workers_coro();
-	awaitable<void> add_workers(size_t count);
+	void top_up_workers();
+	void add_workers(size_t count);
+	void chk_ready();
+	void on_worker_demand(int idle, int waiting);
+	void retire_workers(int count);
+	awaitable<void> pool_actor();
+	void export_pool_stats(int idle, int target) noexcept;
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+	awaitable<void> hand_off(tcp::socket s, const msg::visit_tcp_share& v);
+#endif
 };
 
 struct controller : enable_shared_from_this<controller> {
@@ -103,43 +199,64 @@ struct controller : enable_shared_from_this<controller> {
 	asio::io_context &fwd_ioc_;
 	tcp::endpoint ep_;
 	tcp::socket s_;
+	msg_codec codec_;
 	string client_uuid_;
 	map<string, tcp_share_weak_ptr_t> tcp_shares_;
 	msg::client_hello hello_;
+	int server_version_ = 0;
+	msg_format fmt_ = msg_format::json;
+	bool tunnels_enabled_ = false;
+	bool reuse_workers_ = false;
+	vector<weak_ptr<mux_tunnel>> tunnels_;
+	semaphore connect_slots_;
+	waitqueue<msg_t> to_send_;
 	bool stopping_ = false;
 	log::logger logger_;
 	steady_timer ping_timer_;
+	steady_timer stats_timer_;
 
 	controller(asio::io_context &ioc, asio::io_context &fwd_ioc);
 	static shared_ptr<controller> create(asio::io_context &ioc, asio::io_context &fwd_ioc);
 	void init();
 
-	void add_tcp_share(string share_id, tcp::endpoint ep, unsigned short port);
+	tcp_share_ptr_t add_tcp_share(string share_id, tcp::endpoint ep, unsigned short port, pipe_options popts, bool on_demand);
 
 	void try_stop() noexcept;
 	void handle_error(const exception& e) noexcept;
 
 	void run();
 	awaitable<void> controller_socket_send_recv_msgs();
+	awaitable<void> send_msgs();
 	void set_ping_timer(chrono::seconds after);
 	awaitable<void> ping_actor();
+	awaitable<void> stats_actor();
 
 	awaitable<tcp::socket> get_socket();
+	awaitable<void> keep_tunnel(int tunnel_id);
+	void on_stream_open(mux_socket s, string payload);
+	void retire_worker(const string& share_id, int worker_id);
 
 	awaitable<void> handle_msg(msg::server_hello m);
 	awaitable<void> handle_msg(msg::pong);
+	awaitable<void> handle_msg(msg::worker_demand m);
 };
 
 struct tcp_share_worker : enable_shared_from_this<tcp_share_worker> {
 	asio::io_context &ioc_;
 	tcp::socket s_;
+	msg_codec codec_;
 	tcp_share_ptr_t share_;
 	string share_id_;
 	int worker_id_;
 	bool visited_ = false;
+	bool retiring_ = false;
 	bool stopping_ = false;
+	bool confirms_; // visits are answered with visit_confirmed, before version 5
+	shared_ptr<mux_tunnel> tunnel_; // when reused, the connection is a tunnel after the hello
 	log::logger logger_;
 	steady_timer ping_timer_;
+	bool sending_ = false; // ping_actor has a send in flight, the codec takes one at a time
+	steady_timer send_idle_;
 
 	tcp_share_worker(asio::io_context &ioc, tcp_share_ptr_t share, tcp::socket s, string share_id, int worker_id);
 	~tcp_share_worker();
@@ -147,24 +264,44 @@ struct tcp_share_worker : enable_shared_from_this<tcp_share_worker> {
 
 	void try_stop();
 	void handle_error(const exception& e);
+	bool is_idle();
+	void retire();
 
 	void run();
 	awaitable<void> send_and_recv_msgs();
+	awaitable<void> serve_streams();
 	void set_ping_timer(chrono::seconds after);
 	awaitable<void> ping_actor();
+	void sent();
 
 	awaitable<void> handle_msg(msg::visit_tcp_share);
 	awaitable<void> handle_msg(msg::pong);
+	awaitable<void> handle_msg(msg::ping);
 };
 
 inline tcp_share::upstream::upstream(shared_ptr<tcp_share> sh) noexcept : sh_(sh) {}
 
 inline awaitable<tcp::socket> tcp_share::upstream::get_socket(const tcp::endpoint ep) {
+	if (sh_->local_pool_) {
+		if (auto warm = co_await sh_->local_pool_->take()) {
+			co_return move(*warm);
+		}
+	}
 	tcp::socket ret{sh_->ioc_};
 	co_await ret.async_connect(sh_->ep_, asio::use_awaitable);
 	co_return move(ret);
 }
 
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+inline tcp_share::unix_upstream::unix_upstream(shared_ptr<tcp_share> sh) noexcept : sh_(sh) {}
+
+inline awaitable<local_stream::socket> tcp_share::unix_upstream::get_socket(const tcp::endpoint ep) {
+	local_stream::socket ret{sh_->ioc_};
+	co_await ret.async_connect(local_stream::endpoint{sh_->local_path_}, asio::use_awaitable);
+	co_return move(ret);
+}
+#endif
+
 inline tcp_share::downstream::downstream(shared_ptr<tcp_share> sh) noexcept : sh_(sh) {}
 
 inline awaitable<tcp::socket> tcp_share::downstream::get_socket(tcp::endpoint& ep) {
@@ -174,12 +311,19 @@ inline awaitable<tcp::socket> tcp_share::downstream::get_socket(tcp::endpoint& e
     co_return move(ret);
 }
 
-inline tcp_share::tcp_share(asio::io_context &ioc, asio::io_context &fwd_ioc, ctrl_ptr_t ctrl, string share_id, tcp::endpoint ep, unsigned short port)
-	: ioc_(ioc), fwd_ioc_(fwd_ioc), ctrl_(ctrl), share_id_(share_id), ep_(move(ep)), port_(port), wq_(ioc.get_executor()), logger_(log::tag_tcp_share{share_id})
+inline tcp_share::mux_downstream::mux_downstream(shared_ptr<tcp_share> sh) noexcept : sh_(sh) {}
+
+inline awaitable<mux_socket> tcp_share::mux_downstream::get_socket(tcp::endpoint& ep) {
+	co_return co_await sh_->streams_.wait();
+}
+
+inline tcp_share::tcp_share(asio::io_context &ioc, asio::io_context &fwd_ioc, ctrl_ptr_t ctrl, string share_id, tcp::endpoint ep, unsigned short port, pipe_options popts, bool on_demand)
+	: ioc_(ioc), fwd_ioc_(fwd_ioc), share_id_(share_id), ep_(move(ep)), wq_(ioc.get_executor()), streams_(ioc.get_executor()), port_(port), ctrl_(ctrl),
+	  sizer_(cfg.worker_count_min, cfg.worker_count_max, cfg.worker_count_initial), pool_timer_(ioc), popts_(popts), on_demand_(on_demand), logger_(log::tag_tcp_share{share_id})
 {}
 
-inline shared_ptr<tcp_share> tcp_share::create(asio::io_context &ioc, asio::io_context &fwd_ioc, ctrl_ptr_t ctrl, string share_id, tcp::endpoint ep, unsigned short port) {
-	return make_shared<tcp_share>(ioc, fwd_ioc, ctrl, move(share_id), move(ep), port);
+inline shared_ptr<tcp_share> tcp_share::create(asio::io_context &ioc, asio::io_context &fwd_ioc, ctrl_ptr_t ctrl, string share_id, tcp::endpoint ep, unsigned short port, pipe_options popts, bool on_demand) {
+	return make_shared<tcp_share>(ioc, fwd_ioc, ctrl, move(share_id), move(ep), port, popts, on_demand);
 }
 
 inline void tcp_share::try_stop() noexcept {
@@ -187,7 +331,26 @@ inline void tcp_share::try_stop() noexcept {
 	if (forwarder_ptr_t ptr = fwd_.lock()) {
 		ptr->post_try_stop();
 	}
+	if (mux_forwarder_ptr_t ptr = mux_fwd_.lock()) {
+		ptr->post_try_stop();
+	}
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+	if (unix_forwarder_ptr_t ptr = unix_fwd_.lock()) {
+		ptr->post_try_stop();
+	}
+	if (unix_mux_forwarder_ptr_t ptr = unix_mux_fwd_.lock()) {
+		ptr->post_try_stop();
+	}
+#endif
 	wq_.close();
+	streams_.close();
+	try {
+		pool_timer_.cancel();
+	} catch (...) {}
+	if (local_pool_) {
+		local_pool_->try_stop();
+	}
+	export_pool_stats(0, 0);
 	for (auto& it : workers_) {
 		if (tcp_share_worker_ptr_t w = it.second.lock()) { // if not already stopped
 			w->try_stop();
@@ -213,29 +376,74 @@ inline tcp_share::upstream tcp_share::make_upstream() noexcept {
 	return {this->shared_from_this()};
 }
 
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+inline tcp_share::unix_upstream tcp_share::make_unix_upstream() noexcept {
+	return {this->shared_from_this()};
+}
+#endif
+
 inline tcp_share::downstream tcp_share::make_downstream() noexcept {
 	return {this->shared_from_this()};
 }
 
-inline void tcp_share::run() {
+inline tcp_share::mux_downstream tcp_share::make_mux_downstream() noexcept {
+	return {this->shared_from_this()};
+}
+
+// visits come as tunnel streams with tunnels, and with reusable workers as well
+inline void tcp_share::run(bool tunnels, bool reuse) {
+	started_at_ = chrono::steady_clock::now();
 	auto sg = this->shared_from_this();
-	co_spawn(fwd_ioc_, [this, sg]() mutable -> awaitable<void> {
-		co_await run_forwarder();
-	}, asio::detached);
+	bool streams = tunnels || reuse;
+	if (local_pool_) {
+		local_pool_->run();
+	}
+	if (!handoff_) {
+		co_spawn(fwd_ioc_, [this, sg, streams]() mutable -> awaitable<void> {
+			co_await run_forwarder(streams);
+		}, asio::detached);
+	}
+	if (!tunnels && !on_demand_) {
+		co_spawn(ioc_, [this, sg]() mutable -> awaitable<void> {
+			co_await pool_actor();
+		}, asio::detached);
+	}
 }
 
-inline awaitable<void> tcp_share::run_forwarder() {
+inline awaitable<void> tcp_share::run_forwarder(bool streams) {
 	try {
-		forwarder_ptr_t fwd = forwarder_t::create(fwd_ioc_, share_id_, make_upstream(), make_downstream());
-		fwd_ = fwd;
-		co_await fwd->forward();
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+		if (!local_path_.empty()) {
+			if (streams) {
+				unix_mux_forwarder_ptr_t fwd = unix_mux_forwarder_t::create(fwd_ioc_, share_id_, make_unix_upstream(), make_mux_downstream(), popts_);
+				unix_mux_fwd_ = fwd;
+				co_await fwd->forward();
+			} else {
+				unix_forwarder_ptr_t fwd = unix_forwarder_t::create(fwd_ioc_, share_id_, make_unix_upstream(), make_downstream(), popts_);
+				unix_fwd_ = fwd;
+				co_await fwd->forward();
+			}
+			co_return;
+		}
+#endif
+		if (streams) {
+			mux_forwarder_ptr_t fwd = mux_forwarder_t::create(fwd_ioc_, share_id_, make_upstream(), make_mux_downstream(), popts_);
+			mux_fwd_ = fwd;
+			co_await fwd->forward();
+		} else {
+			forwarder_ptr_t fwd = forwarder_t::create(fwd_ioc_, share_id_, make_upstream(), make_downstream(), popts_);
+			fwd_ = fwd;
+			co_await fwd->forward();
+		}
 	} catch (const exception& e) {
 		handle_error(e);
 	}
 }
 
 inline awaitable<void> tcp_share::add_worker() {
+	auto start = chrono::steady_clock::now();
 	tcp::socket s = co_await ctrl_->get_socket(); // establish a new connection to server ctrl port
+	sizer_.on_connected(chrono::steady_clock::now() - start);
 	int worker_id = next_worker_id();
 	tcp_share_worker_ptr_t w = tcp_share_worker::create(ioc_, this->shared_from_this(), move(s), share_id_, worker_id);
 	w->run();
@@ -252,43 +460,203 @@ inline void tcp_share::cleanup_workers() {
 	}
 }
 
+inline int tcp_share::idle_workers() {
+	cleanup_workers();
+	int ret = 0;
+	for (auto& it : workers_) {
+		if (tcp_share_worker_ptr_t w = it.second.lock()) {
+			if (w->is_idle()) {
+				ret++;
+			}
+		}
+	}
+	return ret;
+}
+
+// may be called from the forwarder threads
 inline void tcp_share::chk_need_workers() {
-	if (nr_workers_ < cfg.worker_count_low) {
-        auto sg = this->shared_from_this();
+	auto sg = this->shared_from_this();
+	asio::post(ioc_, [this, sg]() {
+		top_up_workers();
+	});
+}
+
+inline void tcp_share::top_up_workers() {
+	if (closing_ || on_demand_)
+		return;
+	int idle = idle_workers();
+	int want = sizer_.target() - idle - nr_connecting_;
+	if (want > 0) {
+		logger_.trace(FMT_COMPILE("got {} idle workers, getting {} more .."), idle, want);
+		add_workers(want);
+	}
+}
+
+/**
+ * Connects count more workers in the background. Connects of all shares run
+ * concurrently, at most worker_connect_limit at a time.
+ */
+inline void tcp_share::add_workers(size_t count) {
+	cleanup_workers();
+	nr_connecting_ += count;
+	auto sg = this->shared_from_this();
+	for (size_t i = 0; i < count; ++i) {
 		co_spawn(ioc_, [this, sg]() mutable -> awaitable<void> {
-			co_await chk_need_workers_coro();
+			try {
+				auto permit = co_await ctrl_->connect_slots_.acquire();
+				if (!closing_) {
+					co_await add_worker();
+				}
+			} catch (const exception& e) {
+				if (!closing_) {
+					logger_.warning("could not add a worker : ").with_exception(e);
+				}
+			}
+			nr_connecting_--;
+			chk_ready();
 		}, asio::detached);
 	}
 }
 
-inline awaitable<void> tcp_share::chk_need_workers_coro() {
+/**
+ * The server found no idle worker for waiting visitors, connect one for each
+ * visitor not already covered by a connect in flight.
+ */
+inline void tcp_share::on_worker_demand(int idle, int waiting) {
 	if (closing_)
-		co_return;
-	if (nr_workers_ < cfg.worker_count_low) {
-		logger_.trace(fmt::format(FMT_COMPILE("got {} workers, getting more .."), nr_workers_));
-		co_await add_workers(cfg.worker_count_more);
+		return;
+	int want = waiting - idle - nr_connecting_;
+	if (want > 0) {
+		logger_.trace(FMT_COMPILE("server asks for workers, {} visitors waiting, getting {} more .."), waiting, want);
+		add_workers(want);
 	}
+	top_up_workers();
 }
 
-inline awaitable<void> tcp_share::add_workers(size_t count) {
-	cleanup_workers();
-	for (int i = 0; i < count; ++i) {
-		co_await add_worker();
+inline void tcp_share::chk_ready() {
+	if (ready_ || closing_ || on_demand_ || idle_workers() < std::min(sizer_.target(), cfg.worker_count_initial)) {
+		return;
 	}
-	logger_.trace(fmt::format(FMT_COMPILE("got {} more workers"), count));
+	ready_ = true;
+	auto took = chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - started_at_);
+	logger_.info(FMT_COMPILE("ready with {} workers after {} ms"), idle_workers(), took.count());
 }
 
+// oldest workers go first
+inline void tcp_share::retire_workers(int count) {
+	for (auto& it : workers_) {
+		if (count <= 0) {
+			break;
+		}
+		if (tcp_share_worker_ptr_t w = it.second.lock()) {
+			if (w->is_idle()) {
+				w->retire();
+				count--;
+			}
+		}
+	}
+}
+
+/**
+ * Resizes the idle worker pool once per tick, see worker_pool_sizer. Missing
+ * workers are connected right away, spare ones are retired half at a time.
+ */
+inline awaitable<void> tcp_share::pool_actor() {
+	try {
+		while (!closing_) {
+			pool_timer_.expires_after(worker_pool_tick);
+			co_await pool_timer_.async_wait(asio::use_awaitable);
+			if (closing_) {
+				co_return;
+			}
+			int prev = sizer_.target();
+			int target = sizer_.tick();
+			int idle = idle_workers();
+			if (target != prev) {
+				logger_.info(FMT_COMPILE("worker pool target {} -> {} (visits {:.2f}/s, rtt {:.1f} ms, idle {})"),
+					prev, target, sizer_.rate(), sizer_.rtt() * 1000, idle);
+			}
+			if (idle > target) {
+				int n = (idle - target + 1) / 2;
+				logger_.trace(FMT_COMPILE("retiring {} of {} idle workers"), n, idle);
+				retire_workers(n);
+				idle -= n;
+			} else if (idle + nr_connecting_ < target) {
+				top_up_workers();
+			}
+			export_pool_stats(idle, target);
+		}
+	} catch (const system_error & se) {
+		if (se.code() != asio::error::operation_aborted) {
+			handle_error(se);
+		}
+	}
+}
+
+inline void tcp_share::export_pool_stats(int idle, int target) noexcept {
+	stats::workers_idle.add(idle - exported_idle_);
+	stats::workers_target.add(target - exported_target_);
+	exported_idle_ = idle;
+	exported_target_ = target;
+}
+
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+/**
+ * Passes the visited worker socket to the local service, which talks to the
+ * server over it from then on, see handoff.hpp. Our copy of the fd is closed
+ * once sent.
+ */
+inline awaitable<void> tcp_share::hand_off(tcp::socket s, const msg::visit_tcp_share& v) {
+	string m = handoff::encode(string{v.peer.ip}, v.peer.port, v.epoch);
+	chk_need_workers();
+	try {
+		local_stream::socket us{ioc_};
+		co_await us.async_connect(local_stream::endpoint{local_path_}, asio::use_awaitable);
+		size_t off = 0;
+		while (off < m.size()) {
+			co_await us.async_wait(local_stream::socket::wait_write, asio::use_awaitable);
+			std::error_code ec;
+			size_t n = handoff::send(us.native_handle(), off == 0 ? s.native_handle() : -1, m.data() + off, m.size() - off, ec);
+			if (ec == std::errc::operation_would_block || ec == std::errc::resource_unavailable_try_again) {
+				continue;
+			}
+			if (ec) {
+				throw std::system_error{ec};
+			}
+			off += n;
+		}
+		logger_.trace("handed a visit off");
+	} catch (const exception& e) {
+		logger_.warning("could not hand a visit off to the local service : ").with_exception(e);
+	}
+}
+#endif
+
 inline controller::controller(asio::io_context &ioc, asio::io_context &fwd_ioc)
-	: ioc_(ioc), fwd_ioc_(fwd_ioc), s_(ioc), ep_(asio::ip::address::from_string(cfg.server_host), cfg.server_port), client_uuid_(uuids::to_string(uuids::random_generator()())), logger_(log::tag_controller{client_uuid_}), ping_timer_(ioc)
+	: ioc_(ioc), fwd_ioc_(fwd_ioc), s_(ioc), ep_(asio::ip::address::from_string(cfg.server_host), cfg.server_port), client_uuid_(uuids::to_string(uuids::random_generator()())), connect_slots_(ioc.get_executor(), cfg.worker_connect_limit), to_send_(ioc.get_executor(), msg_batch_max), logger_(log::tag_controller{client_uuid_}), ping_timer_(ioc), stats_timer_(ioc)
 {
-	hello_.version = 0; // TODO
+	hello_.version = protocol_version;
 	hello_.client_uuid = client_uuid_;
-	logger_.info(fmt::format(FMT_COMPILE("client uuid : {}"), client_uuid_));
+	hello_.tunnels = cfg.tunnel_count;
+	hello_.reuse_workers = cfg.reuse_workers;
+	logger_.info(FMT_COMPILE("client uuid : {}"), client_uuid_);
 }
 
 inline void controller::init() {
 	for (auto& it : cfg.tcp_shares) {
-		add_tcp_share(it.first, {asio::ip::address::from_string(it.second.local_host), it.second.local_port}, it.second.remote_port);
+		tcp_share_ptr_t sh = add_tcp_share(it.first, {asio::ip::address::from_string(it.second.local_host), it.second.local_port}, it.second.remote_port,
+			with_buffer_limits(pipe_opts, it.second.pipe_buffer_min, it.second.pipe_buffer_max), it.second.on_demand);
+		sh->local_path_ = it.second.local_path;
+		sh->handoff_ = it.second.handoff;
+		if (!sh->local_path_.empty()) {
+			if (it.second.local_pool_size > 0) {
+				sh->logger_.warning("local_pool_size is ignored with local_path, a unix socket connects at once");
+			}
+			continue;
+		}
+		if (it.second.local_pool_size > 0) {
+			sh->local_pool_ = local_pool::create(ioc_, sh->ep_, it.second.local_pool_size, chrono::seconds{it.second.local_pool_idle_timeout}, log::tag_tcp_share{it.first});
+		}
 	}
 }
 
@@ -296,24 +664,32 @@ inline shared_ptr<controller> controller::create(asio::io_context &ioc, asio::io
 	return make_shared<controller>(ioc, fwd_ioc);
 }
 
-inline void controller::add_tcp_share(string share_id, tcp::endpoint ep, unsigned short port) {
-	tcp_share_ptr_t sh = tcp_share::create(ioc_, fwd_ioc_, this->shared_from_this(), share_id, move(ep), port);
-	sh->run();
+inline tcp_share_ptr_t controller::add_tcp_share(string share_id, tcp::endpoint ep, unsigned short port, pipe_options popts, bool on_demand) {
+	tcp_share_ptr_t sh = tcp_share::create(ioc_, fwd_ioc_, this->shared_from_this(), share_id, move(ep), port, popts, on_demand);
 	tcp_shares_.emplace(share_id, sh);
 
 	msg::tcp_share sh_msg;
 	sh_msg.id = sh->share_id_;
 	sh_msg.port = port;
+	sh_msg.buffer_min = static_cast<int>(popts.buffer_min);
+	sh_msg.buffer_max = static_cast<int>(popts.buffer_max);
 	hello_.tcp_shares.emplace_back(move(sh_msg));
 
-	logger_.info(fmt::format(FMT_COMPILE("add tcp share : {}"), share_id));
+	logger_.info(FMT_COMPILE("add tcp share : {}"), share_id);
+	return sh;
 }
 
 inline void controller::try_stop() noexcept {
 	stopping_ = true;
+	to_send_.close();
 	try {
 		s_.close();
 	} catch(...) {}
+	for (auto& it : tunnels_) {
+		if (auto t = it.lock()) {
+			t->try_stop();
+		}
+	}
 	for (auto& it : tcp_shares_) {
 		if (tcp_share_ptr_t sh = it.second.lock()) {
 			sh->try_stop();
@@ -322,6 +698,9 @@ inline void controller::try_stop() noexcept {
 	try {
 		ping_timer_.cancel();
 	} catch (...) {}
+	try {
+		stats_timer_.cancel();
+	} catch (...) {}
 }
 
 inline void controller::handle_error(const exception& e) noexcept {
@@ -343,6 +722,11 @@ inline void controller::run() {
 	co_spawn(ioc_, [this, sg]() mutable -> awaitable<void> {
 		co_await ping_actor();
 	}, asio::detached);
+	if (cfg.stats_interval > 0) {
+		co_spawn(ioc_, [this, sg]() mutable -> awaitable<void> {
+			co_await stats_actor();
+		}, asio::detached);
+	}
 }
 
 inline awaitable<tcp::socket> controller::get_socket() {
@@ -355,31 +739,145 @@ inline awaitable<void> controller::controller_socket_send_recv_msgs() {
 	try {
 		co_await s_.async_connect(ep_, asio::use_awaitable);
 
-		co_await send_msg(s_, marshal_msg(hello_));
+		co_await codec_.send(s_, marshal_msg(hello_));
 
-		auto f_in = co_await recv_msg(s_);
+		auto f_in = co_await codec_.recv(s_);
 		co_await visit([this](auto&& m) mutable -> auto {
 			return handle_msg(forward<decltype(m)>(m));
 		}, unmarshal_msg<msg::server_hello>(f_in));
 
+		auto sg = this->shared_from_this();
+		co_spawn(ioc_, [this, sg]() mutable -> awaitable<void> {
+			co_await send_msgs();
+		}, asio::detached);
+
 		for (auto& it : tcp_shares_) {
 			if (tcp_share_ptr_t ptr = it.second.lock()) {
-				co_await ptr->add_workers(cfg.worker_count_initial);
+				ptr->run(tunnels_enabled_, reuse_workers_);
+			}
+		}
+
+		if (tunnels_enabled_) {
+			for (int i = 0; i < cfg.tunnel_count; i++) {
+				co_spawn(ioc_, [this, sg, i]() mutable -> awaitable<void> {
+					co_await keep_tunnel(i);
+				}, asio::detached);
+			}
+		} else {
+			for (auto& it : tcp_shares_) {
+				if (tcp_share_ptr_t ptr = it.second.lock()) {
+					if (!ptr->on_demand_) {
+						ptr->add_workers(cfg.worker_count_initial);
+					}
+				}
 			}
 		}
 
 		for(;;) {
 			set_ping_timer(chrono::seconds{20});
-			auto in = co_await recv_msg(s_);
+			auto in = co_await codec_.recv(s_);
 			co_await visit([this](auto&& m) mutable -> auto {
 				return handle_msg(forward<decltype(m)>(m));
-			}, unmarshal_msg<msg::pong>(in));
+			}, unmarshal_msg<msg::pong, msg::worker_demand>(in));
 		}
 	} catch (const exception& e) {
 		handle_error(e);
 	}
 }
 
+/**
+ * Keeps one tunnel connection up, reconnecting a second after it is lost.
+ */
+inline awaitable<void> controller::keep_tunnel(int tunnel_id) {
+	auto sg = this->shared_from_this();
+	steady_timer backoff{ioc_};
+	while (!stopping_) {
+		try {
+			tcp::socket s = co_await get_socket();
+			msg::tunnel_hello hello;
+			hello.client_uuid = client_uuid_;
+			hello.tunnel_id = tunnel_id;
+			co_await send_msg(s, marshal_msg(hello));
+
+			asio::io_context &shard = pick_shard(fwd_ioc_);
+			auto t = mux_tunnel::create(shard, rebind_ioc(shard, move(s)), log::tag_tunnel{client_uuid_, tunnel_id}, tunnel_window, true,
+				[this, sg](mux_socket s, string payload) {
+					on_stream_open(move(s), move(payload));
+				});
+			std::erase_if(tunnels_, [](auto& it) {
+				return it.expired();
+			});
+			tunnels_.emplace_back(t);
+			if (stopping_) {
+				t->try_stop();
+			}
+			t->run();
+			t->logger_.info("connected");
+			co_await t->wait_closed();
+		} catch (const exception& e) {
+			if (stopping_) {
+				co_return;
+			}
+			logger_.warning(FMT_COMPILE("tunnel #{} lost : "), tunnel_id).with_exception(e);
+		}
+		if (stopping_) {
+			co_return;
+		}
+		backoff.expires_after(chrono::seconds{1});
+		co_await backoff.async_wait(asio::use_awaitable);
+	}
+}
+
+// called on the tunnel strand
+inline void controller::on_stream_open(mux_socket s, string payload) {
+	json::value jv;
+	msg::stream_open so;
+	try {
+		jv = json::parse(payload);
+		so = json::value_to<msg::stream_open>(jv);
+	} catch (const exception& e) {
+		logger_.warning("bad stream open : ").with_exception(e);
+		return;
+	}
+	auto it = tcp_shares_.find(string{so.tcp_share_id});
+	tcp_share_ptr_t sh;
+	if (it != tcp_shares_.end()) {
+		sh = it->second.lock();
+	}
+	if (!sh) {
+		logger_.warning(FMT_COMPILE("stream opened for unknown tcp share : {}"), so.tcp_share_id);
+		return; // dropping s resets the stream
+	}
+	if (cfg.access_log)
+		sh->logger_.access(FMT_COMPILE("accessed from ip {} port {}"), so.peer.ip, so.peer.port);
+	co_spawn(ioc_, [sh, s = move(s)]() mutable -> awaitable<void> {
+		try {
+			co_await sh->streams_.provide(move(s));
+		} catch (...) {}
+	}, asio::detached);
+}
+
+inline awaitable<void> controller::send_msgs() {
+	try {
+		for (;;) {
+			msg_t m = co_await to_send_.wait();
+			co_await codec_.send_batch(s_, move(m), [this]() {
+				return to_send_.try_take();
+			});
+		}
+	} catch (const exception& e) {
+		handle_error(e);
+	}
+}
+
+// since version 5, a worker itself writes nothing but its hello and pongs
+inline void controller::retire_worker(const string& share_id, int worker_id) {
+	msg::worker_retire m;
+	m.tcp_share_id = share_id;
+	m.worker_id = worker_id;
+	to_send_.push(marshal_msg(m, fmt_), this->shared_from_this());
+}
+
 inline void controller::set_ping_timer(chrono::seconds after) {
 	ping_timer_.expires_after(after);
 }
@@ -400,7 +898,7 @@ inline awaitable<void> controller::ping_actor() {
 			if (ping_timer_.expiry() <= steady_timer::clock_type::now()) {
 				ping_timer_.expires_at(steady_timer::time_point::max());
 				msg::ping ping;
-				co_await send_msg(s_, marshal_msg(ping));
+				co_await to_send_.provide(marshal_msg(ping, fmt_));
 				logger_.trace("sent a ping");
 			}
 		}
@@ -409,9 +907,46 @@ inline awaitable<void> controller::ping_actor() {
 	}
 }
 
+inline awaitable<void> controller::stats_actor() {
+	try {
+		while (!stopping_) {
+			stats_timer_.expires_after(chrono::seconds{cfg.stats_interval});
+			co_await stats_timer_.async_wait(asio::use_awaitable);
+			log::as(log::tag_stats{}).info(stats::report());
+		}
+	} catch (const system_error & se) {
+		if (se.code() != asio::error::operation_aborted) {
+			handle_error(se);
+		}
+	}
+}
+
 inline awaitable<void> controller::handle_msg(msg::server_hello m) {
-	logger_.info(fmt::format(FMT_COMPILE("server version : {}"), m.version));
-	logger_.info(fmt::format(FMT_COMPILE("server welcome message: {}"), m.welcome));
+	logger_.info(FMT_COMPILE("server version : {}"), m.version);
+	logger_.info(FMT_COMPILE("server welcome message: {}"), m.welcome);
+	server_version_ = m.version;
+	fmt_ = m.version >= 6 && !cfg.json_msgs ? msg_format::binary : msg_format::json;
+	tunnels_enabled_ = cfg.tunnel_count > 0 && m.version >= 1 && m.tunnels;
+	if (cfg.tunnel_count > 0) {
+		if (tunnels_enabled_) {
+			logger_.info(FMT_COMPILE("using {} tunnel connections"), cfg.tunnel_count);
+		} else {
+			logger_.warning("server does not take tunnels, using workers instead");
+		}
+	}
+	reuse_workers_ = cfg.reuse_workers && m.version >= 4 && m.reuse_workers && !tunnels_enabled_;
+	if (cfg.reuse_workers && !tunnels_enabled_ && !reuse_workers_) {
+		logger_.warning("server does not reuse workers, using one per visit");
+	}
+	if (m.version < 3) {
+		for (auto& it : tcp_shares_) {
+			tcp_share_ptr_t sh = it.second.lock();
+			if (sh && sh->on_demand_) {
+				sh->logger_.warning("server does not ask for workers, keeping a pool instead");
+				sh->on_demand_ = false;
+			}
+		}
+	}
 	co_return;
 }
 
@@ -420,8 +955,18 @@ inline awaitable<void> controller::handle_msg(msg::pong) {
 	co_return;
 }
 
+inline awaitable<void> controller::handle_msg(msg::worker_demand m) {
+	auto it = tcp_shares_.find(string{m.tcp_share_id});
+	if (it == tcp_shares_.end()) {
+		co_return;
+	}
+	if (tcp_share_ptr_t sh = it->second.lock()) {
+		sh->on_worker_demand(m.idle, m.waiting);
+	}
+}
+
 inline tcp_share_worker::tcp_share_worker(asio::io_context &ioc, tcp_share_ptr_t share, tcp::socket s, string share_id, int worker_id)
-	: ioc_(ioc), share_(share), s_(move(s)), share_id_(share_id), worker_id_(worker_id), logger_(log::tag_tcp_share_worker{share_id, worker_id}), ping_timer_(ioc)
+	: ioc_(ioc), share_(share), s_(move(s)), share_id_(share_id), worker_id_(worker_id), confirms_(share->ctrl_->server_version_ < 5), logger_(log::tag_tcp_share_worker{share_id, worker_id}), ping_timer_(ioc), send_idle_(ioc)
 {
 	share_->nr_workers_++;
 }
@@ -436,6 +981,9 @@ inline shared_ptr<tcp_share_worker> tcp_share_worker::create(asio::io_context &i
 
 inline void tcp_share_worker::try_stop() {
 	stopping_ = true;
+	if (tunnel_) {
+		tunnel_->try_stop();
+	}
 	try {
 		s_.close();
 	} catch (...) {}
@@ -445,7 +993,7 @@ inline void tcp_share_worker::try_stop() {
 }
 
 inline void tcp_share_worker::handle_error(const exception& e) {
-	if (!stopping_) {
+	if (!stopping_ && !retiring_) {
 		logger_.error("got an exception, stopping : ").with_exception(e);
 		try_stop();
 	} else {
@@ -453,6 +1001,39 @@ inline void tcp_share_worker::handle_error(const exception& e) {
 	}
 }
 
+/**
+ * Asks the server to let go of this worker, the server either closes it or,
+ * if a visit crossed the retire, visits it as usual.
+ */
+inline bool tcp_share_worker::is_idle() {
+	if (visited_ || retiring_ || stopping_) {
+		return false;
+	}
+	return !tunnel_ || tunnel_->nr_streams() == 0;
+}
+
+inline void tcp_share_worker::retire() {
+	if (visited_ || retiring_ || stopping_) {
+		return;
+	}
+	retiring_ = true;
+	if (share_->ctrl_->reuse_workers_) {
+		if (tunnel_) {
+			tunnel_->goaway(); // the server closes it once the stream in flight, if any, is done
+		}
+		return; // else serve_streams() sends it
+	}
+	if (share_->ctrl_->server_version_ < 2) {
+		try_stop(); // older servers do not know worker_retire
+		return;
+	}
+	if (!confirms_) {
+		share_->ctrl_->retire_worker(share_id_, worker_id_);
+		return;
+	}
+	ping_timer_.expires_at(steady_timer::time_point::min()); // ping_actor sends the retire, so that writes do not interleave
+}
+
 inline void tcp_share_worker::run() {
 	ping_timer_.expires_at(steady_timer::time_point::max());
 	auto sg = this->shared_from_this();
@@ -469,19 +1050,50 @@ inline awaitable<void> tcp_share_worker::send_and_recv_msgs() {
 		msg::tcp_share_worker_hello hello;
 		hello.tcp_share_id = share_id_;
 		hello.worker_id = worker_id_;
+		hello.reuse = share_->ctrl_->reuse_workers_;
 		co_await send_msg(s_, marshal_msg(hello));
+		if (hello.reuse) {
+			co_await serve_streams();
+			co_return;
+		}
 		while (!visited_) {
-			set_ping_timer(chrono::seconds{20});
-			auto in = co_await recv_msg(s_);
+			set_ping_timer(chrono::seconds{confirms_ ? 20 : 60});
+			auto in = co_await codec_.recv(s_);
 			co_await visit([this](auto&& m) mutable -> auto {
 				return this->handle_msg(forward<decltype(m)>(m));
-			}, unmarshal_msg<msg::visit_tcp_share, msg::pong>(in));
+			}, unmarshal_msg<msg::visit_tcp_share, msg::pong, msg::ping>(in));
 		}
 	} catch (const exception& e) {
 		handle_error(e);
 	}
 }
 
+/**
+ * Serves visits as tunnel streams, one after another, until the server
+ * closes the tunnel or the worker is retired.
+ */
+inline awaitable<void> tcp_share_worker::serve_streams() {
+	auto sh = share_;
+	auto ctrl = share_->ctrl_;
+	asio::io_context &shard = pick_shard(sh->fwd_ioc_);
+	tunnel_ = mux_tunnel::create(shard, rebind_ioc(shard, move(s_)), log::tag_tunnel{share_id_, worker_id_}, tunnel_window, true,
+		[sh, ctrl](mux_socket s, string payload) {
+			asio::post(sh->ioc_, [sh]() {
+				sh->sizer_.on_visit();
+			});
+			ctrl->on_stream_open(move(s), move(payload));
+		});
+	tunnel_->run();
+	if (stopping_) {
+		tunnel_->try_stop();
+	} else if (retiring_) {
+		tunnel_->goaway();
+	}
+	co_await tunnel_->wait_closed();
+	logger_.trace("tunnel closed");
+	try_stop(); // lets ping_actor go
+}
+
 inline void tcp_share_worker::set_ping_timer(chrono::seconds after) {
 	ping_timer_.expires_after(after);
 }
@@ -499,31 +1111,78 @@ inline awaitable<void> tcp_share_worker::ping_actor() {
 			if (stopping_ || visited_) {
 				co_return;
 			}
-			if (ping_timer_.expiry() <= steady_timer::clock_type::now()) {
+			if (retiring_) {
 				ping_timer_.expires_at(steady_timer::time_point::max());
-				msg::ping ping;
-				co_await send_msg(s_, marshal_msg(ping));
-				logger_.trace("sent a ping");
+				msg::worker_retire m;
+				sending_ = true;
+				co_await codec_.send(s_, marshal_msg(m, share_->ctrl_->fmt_));
+				sent();
+				logger_.trace("sent retire");
+				co_return;
+			}
+			if (ping_timer_.expiry() > steady_timer::clock_type::now()) {
+				continue;
 			}
+			if (!confirms_) {
+				logger_.warning("timeout exceeded : no ping from server");
+				try_stop();
+				co_return;
+			}
+			ping_timer_.expires_at(steady_timer::time_point::max());
+			msg::ping ping;
+			sending_ = true;
+			co_await codec_.send(s_, marshal_msg(ping, share_->ctrl_->fmt_));
+			sent();
+			logger_.trace("sent a ping");
 		}
 	} catch (const exception& e) {
-		handle_error(e);
+		sent();
+		if (visited_) {
+			logger_.trace("ping_actor exited by exception : ").with_exception(e); // the send cancelled by the visit
+		} else {
+			handle_error(e);
+		}
 	}
 }
 
+// ping_actor's send is out of the codec, lets a confirm waiting for it go
+inline void tcp_share_worker::sent() {
+	sending_ = false;
+	send_idle_.cancel();
+}
+
 inline awaitable<void> tcp_share_worker::handle_msg(msg::visit_tcp_share v) {
 	logger_.trace("was visited");
+	share_->sizer_.on_visit();
 	if (cfg.access_log)
-		share_->logger_.access(fmt::format(FMT_COMPILE("accessed from ip {} port {}"), v.peer.ip, v.peer.port));
+		share_->logger_.access(FMT_COMPILE("accessed from ip {} port {}"), v.peer.ip, v.peer.port);
 	visited_ = true;
 	ping_timer_.expires_at(steady_timer::time_point::max());
 	ping_timer_.cancel();
 	s_.cancel();
 
-	msg::visit_confirmed m;
-	co_await send_msg(s_, marshal_msg(m));
-	logger_.trace("sent confirm");
-
+	if (confirms_) {
+		while (sending_) { // cancelled above, waits for it to get out of the codec
+			send_idle_.expires_at(steady_timer::time_point::max());
+			try {
+				co_await send_idle_.async_wait(asio::use_awaitable);
+			} catch (const system_error & se) {
+				if (se.code() != asio::error::operation_aborted) {
+					throw;
+				}
+			}
+		}
+		msg::visit_confirmed m;
+		co_await codec_.send(s_, marshal_msg(m, share_->ctrl_->fmt_));
+		logger_.trace("sent confirm");
+	} // else the visitor's bytes follow the visit message as is
+
+#ifdef BOOST_ASIO_HAS_LOCAL_SOCKETS
+	if (share_->handoff_) {
+		co_await share_->hand_off(move(s_), v);
+		co_return;
+	}
+#endif
 	co_await share_->wq_.provide(move(s_));
 }
 
@@ -532,6 +1191,14 @@ inline awaitable<void> tcp_share_worker::handle_msg(msg::pong) {
 	co_return;
 }
 
+// from the server since version 5, answered before the next message is read
+inline awaitable<void> tcp_share_worker::handle_msg(msg::ping) {
+	logger_.trace("recv a ping");
+	msg::pong pong;
+	co_await codec_.send(s_, marshal_msg(pong, share_->ctrl_->fmt_));
+	logger_.trace("sent a pong");
+}
+
 }
 
 }
@@ -11,6 +11,8 @@ namespace zrp {
 	template <class ...Args>
 	struct completion_handler_erasure {
 		virtual void operator()(Args... args)=0;
+		virtual void dispatch(Args... args)=0;
+		virtual completion_handler_erasure* move_to(void *dst) noexcept=0;
 		virtual ~completion_handler_erasure(){}
 	};
 
@@ -28,29 +30,106 @@ namespace zrp {
 				h_(forward<Args>(args)...);
 			});
 		}
+
+		void dispatch(Args... args) {
+			auto exec = asio::get_associated_executor(h_);
+			asio::dispatch(exec, [...args = forward<Args>(args), h_(move(h_))]() mutable
+			{
+				h_(forward<Args>(args)...);
+			});
+		}
+
+		completion_handler_erasure<Args...>* move_to(void *dst) noexcept {
+			return new (dst) completion_handler_t(move(h_));
+		}
 	};
 
 	template <class Signature> struct completion_handler;
 
+	/**
+	 * A type erased handler, completed by posting to its associated
+	 * executor. Handlers as small as the ones of use_awaitable are kept
+	 * inline, so that waiting on something costs no allocation.
+	 */
 	template <class ...Args>
 	struct completion_handler<void(Args...)> {
+		using erasure_t = completion_handler_erasure<Args...>;
+		static const size_t inline_size = 96;
 
-		unique_ptr<completion_handler_erasure<Args...>> ptr_;
+		alignas(std::max_align_t) unsigned char buf_[inline_size];
+		erasure_t *ptr_ = nullptr;
+		bool inline_ = false;
 
 		void operator()(Args... args) {
 			(*ptr_)(forward<Args>(args)...);
 		}
 
+		/**
+		 * Completes right away when already on the associated executor. Only
+		 * for callers running as a handler of their own, with nothing on the
+		 * stack that the handler could run into.
+		 */
+		void dispatch(Args... args) {
+			ptr_->dispatch(forward<Args>(args)...);
+		}
+
 		template <class CompletionHandler>
 			// requires CallableWithArgs(CompletionHandler, ...Args)
-		completion_handler(CompletionHandler h)
-		: ptr_(make_unique<completion_handler_t<CompletionHandler, Args...>>(move(h))) {}
+		completion_handler(CompletionHandler h) {
+			using impl_t = completion_handler_t<CompletionHandler, Args...>;
+			if constexpr (sizeof(impl_t) <= inline_size && alignof(impl_t) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible_v<CompletionHandler>) {
+				ptr_ = new (buf_) impl_t(move(h));
+				inline_ = true;
+			} else {
+				ptr_ = new impl_t(move(h));
+			}
+		}
 
 		completion_handler() {}
-		completion_handler(completion_handler&&)=default;
-		completion_handler& operator=(completion_handler&&)=default;
 
+		completion_handler(completion_handler&& o) noexcept {
+			take(o);
+		}
+
+		completion_handler& operator=(completion_handler&& o) noexcept {
+			if (this != &o) {
+				reset();
+				take(o);
+			}
+			return *this;
+		}
+
+		~completion_handler() {
+			reset();
+		}
+
+		explicit operator bool() const noexcept {
+			return ptr_ != nullptr;
+		}
+
+	private:
+		void take(completion_handler& o) noexcept {
+			if (o.inline_) {
+				ptr_ = o.ptr_->move_to(buf_);
+				inline_ = true;
+				o.reset();
+			} else {
+				ptr_ = std::exchange(o.ptr_, nullptr);
+			}
+		}
+
+		void reset() noexcept {
+			if (!ptr_) {
+				return;
+			}
+			if (inline_) {
+				ptr_->~erasure_t();
+			} else {
+				delete ptr_;
+			}
+			ptr_ = nullptr;
+			inline_ = false;
+		}
 	};
 
 }
-
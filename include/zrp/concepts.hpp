@@ -16,16 +16,47 @@ template <class T, class U> concept SameHelper = std::is_same_v<T, U>;
 template <class T, class U>
 concept same_as = detail::SameHelper<T, U> &&detail::SameHelper<U, T>;
 
+namespace detail {
+template <class T> struct awaitable_value {};
+template <class T, class Executor> struct awaitable_value<awaitable<T, Executor>> { using type = T; };
+}
+
+namespace detail {
+template <class T> struct is_stream_socket : std::false_type {};
+template <class Protocol, class Executor> struct is_stream_socket<asio::basic_stream_socket<Protocol, Executor>> : std::true_type {};
+}
+
+// a kernel stream socket of any protocol, tcp or unix domain
+template <class T>
+	concept IsStreamSocket = detail::is_stream_socket<T>::value;
+
+// a socket, or anything pipe knows how to move data through
+template <class T>
+	concept IsSocketAwaitable = requires {
+		typename detail::awaitable_value<T>::type;
+	};
+
 template <class T>
 	concept IsUpstream = requires(T a, const tcp::endpoint ep) {
-		{ a.get_socket(ep) } -> same_as<awaitable<tcp::socket>>;
+		{ a.get_socket(ep) } -> IsSocketAwaitable;
 	};
 
 template <class T>
 	concept IsDownstream = requires(T a, tcp::endpoint& ep) {
-		{ a.get_socket(ep) } -> same_as<awaitable<tcp::socket>>;
+		{ a.get_socket(ep) } -> IsSocketAwaitable;
+	};
+
+// a downstream accepting on several lanes, each on its own io_context
+template <class T>
+	concept IsMultiLaneDownstream = requires(T a, size_t lane, tcp::endpoint& ep) {
+		{ a.lanes() } -> same_as<size_t>;
+		{ a.lane_context(lane) } -> same_as<asio::io_context&>;
+		{ a.get_socket(lane, ep) } -> IsSocketAwaitable;
 	};
 
+template <class T>
+	using socket_of_t = typename detail::awaitable_value<decltype(std::declval<T&>().get_socket(std::declval<tcp::endpoint&>()))>::type;
+
 template <class T>
 	concept IsTryStoppable = requires(T a) {
 		{ a.try_stop() };
@@ -20,17 +20,40 @@ struct config_t {
 	struct tcp_share_t {
 		string local_host;
 		unsigned short local_port;
+		string local_path; // a unix domain socket, instead of local_host and local_port
+		bool handoff; // pass worker sockets to local_path instead of piping, see handoff.hpp
 		unsigned short remote_port;
+		int pipe_buffer_min;
+		int pipe_buffer_max;
+		bool on_demand;
+		int local_pool_size;
+		int local_pool_idle_timeout;
 	};
 	map<string, tcp_share_t> tcp_shares;
 
 	int forwarder_threads;
+	bool forwarder_sharding; // an io_context per forwarder thread instead of a shared one
+	bool forwarder_pin_threads;
+	string pipe_engine;
+	int pipe_pipeline_depth;
+	int io_uring_buffers;
+	bool io_uring_sqpoll;
 
 	int worker_count_initial;
-	int worker_count_low;
-	int worker_count_more;
+	int worker_count_min;
+	int worker_count_max;
+	int worker_connect_limit;
+
+	int tunnel_count;
+	int tunnel_window;
+	bool reuse_workers;
+	bool json_msgs; // keep sending control messages as json, for debugging
 
 	bool access_log;
+	bool log_async; // write logs from a thread of their own
+	int log_buffer; // bytes of pending log lines per thread
+	string log_overflow; // drop or block when log_buffer is full
+	int stats_interval;
 
 	int rlimit_nofile;
 };
@@ -40,7 +63,14 @@ void tag_invoke(json::value_from_tag, json::value& jv, const config_t::tcp_share
 	jv = {
 		{"local_host", c.local_host},
 		{"local_port", c.local_port},
+		{"local_path", c.local_path},
+		{"handoff", c.handoff},
 		{"remote_port", c.remote_port},
+		{"pipe_buffer_min", c.pipe_buffer_min},
+		{"pipe_buffer_max", c.pipe_buffer_max},
+		{"on_demand", c.on_demand},
+		{"local_pool_size", c.local_pool_size},
+		{"local_pool_idle_timeout", c.local_pool_idle_timeout},
 	};
 }
 
@@ -49,8 +79,19 @@ config_t::tcp_share_t tag_invoke(json::value_to_tag<config_t::tcp_share_t>, cons
 	config_t::tcp_share_t ret;
 	json::object const& obj = jv.as_object();
 	extract_with_default(obj, ret.local_host, "local_host", "127.0.0.1");
-	extract(obj, ret.local_port, "local_port");
+	extract_with_default(obj, ret.local_path, "local_path", "");
+	extract_with_default(obj, ret.handoff, "handoff", false);
+	if (ret.local_path.empty()) {
+		extract(obj, ret.local_port, "local_port");
+	} else {
+		extract_with_default(obj, ret.local_port, "local_port", 0);
+	}
 	extract(obj, ret.remote_port, "remote_port");
+	extract_with_default(obj, ret.pipe_buffer_min, "pipe_buffer_min", 8192);
+	extract_with_default(obj, ret.pipe_buffer_max, "pipe_buffer_max", 262144);
+	extract_with_default(obj, ret.on_demand, "on_demand", false);
+	extract_with_default(obj, ret.local_pool_size, "local_pool_size", 0);
+	extract_with_default(obj, ret.local_pool_idle_timeout, "local_pool_idle_timeout", 30);
 	return ret;
 }
 
@@ -61,10 +102,25 @@ void tag_invoke(json::value_from_tag, json::value& jv, const config_t& c)
 		{"server_port", c.server_port},
 		{"tcp_shares", c.tcp_shares},
 		{"forwarder_threads", c.forwarder_threads},
+		{"forwarder_sharding", c.forwarder_sharding},
+		{"forwarder_pin_threads", c.forwarder_pin_threads},
+		{"pipe_engine", c.pipe_engine},
+		{"pipe_pipeline_depth", c.pipe_pipeline_depth},
+		{"io_uring_buffers", c.io_uring_buffers},
+		{"io_uring_sqpoll", c.io_uring_sqpoll},
 		{"worker_count_initial", c.worker_count_initial},
-		{"worker_count_low", c.worker_count_low},
-		{"worker_count_more", c.worker_count_more},
+		{"worker_count_min", c.worker_count_min},
+		{"worker_count_max", c.worker_count_max},
+		{"worker_connect_limit", c.worker_connect_limit},
+		{"tunnel_count", c.tunnel_count},
+		{"tunnel_window", c.tunnel_window},
+		{"reuse_workers", c.reuse_workers},
+		{"json_msgs", c.json_msgs},
 		{"access_log", c.access_log},
+		{"log_async", c.log_async},
+		{"log_buffer", c.log_buffer},
+		{"log_overflow", c.log_overflow},
+		{"stats_interval", c.stats_interval},
 		{"rlimit_nofile", c.rlimit_nofile},
 	};
 }
@@ -77,10 +133,25 @@ config_t tag_invoke(json::value_to_tag<config_t>, const json::value& jv)
 	extract_with_default(obj, ret.server_port, "server_port", 11433);
 	extract_with_default(obj, ret.tcp_shares, "tcp_shares", map<string, config_t::tcp_share_t>{});
 	extract_with_default(obj, ret.forwarder_threads, "forwarder_threads", -1);
-	extract_with_default(obj, ret.worker_count_initial, "worker_count_initial", 16);
-	extract_with_default(obj, ret.worker_count_low, "worker_count_low", 8);
-	extract_with_default(obj, ret.worker_count_more, "worker_count_more", 16);
+	extract_with_default(obj, ret.forwarder_sharding, "forwarder_sharding", false);
+	extract_with_default(obj, ret.forwarder_pin_threads, "forwarder_pin_threads", false);
+	extract_with_default(obj, ret.pipe_engine, "pipe_engine", "copy");
+	extract_with_default(obj, ret.pipe_pipeline_depth, "pipe_pipeline_depth", 1);
+	extract_with_default(obj, ret.io_uring_buffers, "io_uring_buffers", 1024);
+	extract_with_default(obj, ret.io_uring_sqpoll, "io_uring_sqpoll", false);
+	extract_with_default(obj, ret.worker_count_initial, "worker_count_initial", 4);
+	extract_with_default(obj, ret.worker_count_min, "worker_count_min", 2);
+	extract_with_default(obj, ret.worker_count_max, "worker_count_max", 64);
+	extract_with_default(obj, ret.worker_connect_limit, "worker_connect_limit", 16);
+	extract_with_default(obj, ret.tunnel_count, "tunnel_count", 0);
+	extract_with_default(obj, ret.tunnel_window, "tunnel_window", 262144);
+	extract_with_default(obj, ret.reuse_workers, "reuse_workers", false);
+	extract_with_default(obj, ret.json_msgs, "json_msgs", false);
 	extract_with_default(obj, ret.access_log, "access_log", true);
+	extract_with_default(obj, ret.log_async, "log_async", true);
+	extract_with_default(obj, ret.log_buffer, "log_buffer", 65536);
+	extract_with_default(obj, ret.log_overflow, "log_overflow", "drop");
+	extract_with_default(obj, ret.stats_interval, "stats_interval", 0);
 	extract_with_default(obj, ret.rlimit_nofile, "rlimit_nofile", 65533);
 	return ret;
 }
@@ -115,9 +186,33 @@ struct config_t {
 	string sharing_host;
 	string welcome;
 
+	int control_threads; // hellos, controllers and idle workers, sharded like forwarder_sharding
 	int forwarder_threads;
+	bool forwarder_sharding; // an io_context per forwarder thread instead of a shared one
+	bool forwarder_pin_threads;
+	bool listen_reuseport; // a listening socket per forwarder shard for each share
+	bool listen_incoming_cpu;
+	int accept_batch;
+	string pipe_engine;
+	int pipe_buffer_min;
+	int pipe_buffer_max;
+	int pipe_pipeline_depth;
+	int io_uring_buffers;
+	bool io_uring_sqpoll;
+
+	bool allow_tunnels;
+	int tunnel_window;
+	bool allow_worker_reuse;
+	bool json_msgs; // keep sending control messages as json, for debugging
 
 	bool access_log;
+	string access_log_file; // binary records instead of access lines, see dump_access_log
+	int access_log_max_size;
+	int access_log_max_age; // seconds
+	bool log_async; // write logs from a thread of their own
+	int log_buffer; // bytes of pending log lines per thread
+	string log_overflow; // drop or block when log_buffer is full
+	int stats_interval;
 
 	int rlimit_nofile;
 };
@@ -129,8 +224,31 @@ void tag_invoke(json::value_from_tag, json::value& jv, const config_t& c)
 		{"server_port", c.server_port},
 		{"sharing_host", c.sharing_host},
 		{"welcome", c.welcome},
+		{"control_threads", c.control_threads},
 		{"forwarder_threads", c.forwarder_threads},
+		{"forwarder_sharding", c.forwarder_sharding},
+		{"forwarder_pin_threads", c.forwarder_pin_threads},
+		{"listen_reuseport", c.listen_reuseport},
+		{"listen_incoming_cpu", c.listen_incoming_cpu},
+		{"accept_batch", c.accept_batch},
+		{"pipe_engine", c.pipe_engine},
+		{"pipe_buffer_min", c.pipe_buffer_min},
+		{"pipe_buffer_max", c.pipe_buffer_max},
+		{"pipe_pipeline_depth", c.pipe_pipeline_depth},
+		{"io_uring_buffers", c.io_uring_buffers},
+		{"io_uring_sqpoll", c.io_uring_sqpoll},
+		{"allow_tunnels", c.allow_tunnels},
+		{"tunnel_window", c.tunnel_window},
+		{"allow_worker_reuse", c.allow_worker_reuse},
+		{"json_msgs", c.json_msgs},
 		{"access_log", c.access_log},
+		{"access_log_file", c.access_log_file},
+		{"access_log_max_size", c.access_log_max_size},
+		{"access_log_max_age", c.access_log_max_age},
+		{"log_async", c.log_async},
+		{"log_buffer", c.log_buffer},
+		{"log_overflow", c.log_overflow},
+		{"stats_interval", c.stats_interval},
 		{"rlimit_nofile", c.rlimit_nofile},
 	};
 }
@@ -143,8 +261,31 @@ config_t tag_invoke(json::value_to_tag<config_t>, const json::value& jv)
 	extract_with_default(obj, ret.server_port, "server_port", 11433);
 	extract_with_default(obj, ret.sharing_host, "sharing_host", "0.0.0.0");
 	extract_with_default(obj, ret.welcome, "welcome", "welcome to zrp server");
+	extract_with_default(obj, ret.control_threads, "control_threads", 1);
 	extract_with_default(obj, ret.forwarder_threads, "forwarder_threads", -1);
+	extract_with_default(obj, ret.forwarder_sharding, "forwarder_sharding", false);
+	extract_with_default(obj, ret.forwarder_pin_threads, "forwarder_pin_threads", false);
+	extract_with_default(obj, ret.listen_reuseport, "listen_reuseport", false);
+	extract_with_default(obj, ret.listen_incoming_cpu, "listen_incoming_cpu", false);
+	extract_with_default(obj, ret.accept_batch, "accept_batch", 64);
+	extract_with_default(obj, ret.pipe_engine, "pipe_engine", "copy");
+	extract_with_default(obj, ret.pipe_buffer_min, "pipe_buffer_min", 8192);
+	extract_with_default(obj, ret.pipe_buffer_max, "pipe_buffer_max", 262144);
+	extract_with_default(obj, ret.pipe_pipeline_depth, "pipe_pipeline_depth", 1);
+	extract_with_default(obj, ret.io_uring_buffers, "io_uring_buffers", 1024);
+	extract_with_default(obj, ret.io_uring_sqpoll, "io_uring_sqpoll", false);
+	extract_with_default(obj, ret.allow_tunnels, "allow_tunnels", true);
+	extract_with_default(obj, ret.tunnel_window, "tunnel_window", 262144);
+	extract_with_default(obj, ret.allow_worker_reuse, "allow_worker_reuse", true);
+	extract_with_default(obj, ret.json_msgs, "json_msgs", false);
 	extract_with_default(obj, ret.access_log, "access_log", true);
+	extract_with_default(obj, ret.access_log_file, "access_log_file", "");
+	extract_with_default(obj, ret.access_log_max_size, "access_log_max_size", 67108864);
+	extract_with_default(obj, ret.access_log_max_age, "access_log_max_age", 86400);
+	extract_with_default(obj, ret.log_async, "log_async", true);
+	extract_with_default(obj, ret.log_buffer, "log_buffer", 65536);
+	extract_with_default(obj, ret.log_overflow, "log_overflow", "drop");
+	extract_with_default(obj, ret.stats_interval, "stats_interval", 0);
 	extract_with_default(obj, ret.rlimit_nofile, "rlimit_nofile", 65533);
 	return ret;
 }
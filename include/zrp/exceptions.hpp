@@ -50,6 +50,38 @@ namespace exceptions {
 		}
 	};
 
+	struct bad_config_value : public exception {
+		std::string msg_;
+
+		bad_config_value(string key, string value)
+			: msg_(fmt::format(FMT_COMPILE("bad config value for {} : {}"), key, value))
+			{}
+
+		const char * what() const noexcept {
+			return msg_.c_str();
+		}
+	};
+
+	struct tunnel_protocol_error : public exception {
+		std::string msg_;
+
+		tunnel_protocol_error(string s)
+			: msg_(fmt::format(FMT_COMPILE("tunnel protocol error : {}"), s))
+			{}
+
+		const char * what() const noexcept {
+			return msg_.c_str();
+		}
+	};
+
+	struct no_tunnel : public exception {
+		no_tunnel() {}
+
+		const char * what() const noexcept {
+			return "no tunnel connected";
+		}
+	};
+
 	struct msg_too_big: public exception {
 		std::string msg_;
 
@@ -62,6 +94,30 @@ namespace exceptions {
 		}
 	};
 
+	struct msg_truncated: public exception {
+		std::string msg_;
+
+		msg_truncated(size_t sz)
+			: msg_(fmt::format(FMT_COMPILE("binary message truncated : {} bytes"), sz))
+			{}
+
+		const char * what() const noexcept {
+			return msg_.c_str();
+		}
+	};
+
+	struct bad_access_log : public exception {
+		std::string msg_;
+
+		bad_access_log(string path)
+			: msg_(fmt::format(FMT_COMPILE("not an access log file : {}"), path))
+			{}
+
+		const char * what() const noexcept {
+			return msg_.c_str();
+		}
+	};
+
 }
 
 }
@@ -83,6 +83,10 @@ class file {
 		return size_;
 	}
 
+	bool is_open() const noexcept {
+		return f_ != nullptr;
+	}
+
 	bool eof() const noexcept {
 		return std::feof(f_) != 0;
 	}
@@ -103,6 +107,15 @@ class file {
 		}
 		return nread;
 	}
+
+	// size() grows with what is written, for files opened to append
+	void write(const char* data, size_t size, error_code& ec) {
+		auto const nwritten = std::fwrite(data, 1, size, f_);
+		size_ += static_cast<long>(nwritten);
+		if (nwritten < size || std::fflush(f_) != 0) {
+			fail(ec);
+		}
+	}
 };
 
 }
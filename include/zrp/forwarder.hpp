@@ -9,17 +9,25 @@
 #include "zrp/concepts.hpp"
 #include "zrp/pipe.hpp"
 #include "zrp/log.hpp"
+#include "zrp/io_threadpool.hpp"
+#include "zrp/registry.hpp"
 
 namespace zrp
 {
 
-	inline tcp::socket rebind_ioc(asio::io_context& ioc, tcp::socket&& s) {
-		tcp::socket ret{ioc};
+	template <class Protocol, class Executor>
+	inline asio::basic_stream_socket<Protocol, Executor> rebind_ioc(asio::io_context& ioc, asio::basic_stream_socket<Protocol, Executor>&& s) {
+		asio::basic_stream_socket<Protocol, Executor> ret{ioc};
 		auto proto = s.local_endpoint().protocol();
 		ret.assign(proto, s.release());
 		return move(ret);
 	}
 
+	// a tunnel stream is bound to its tunnel, it stays where it is
+	inline mux_socket rebind_ioc(asio::io_context&, mux_socket&& s) {
+		return move(s);
+	}
+
 	/**
 	 * Pipes sockets between upstream & downstream, but sockets are
 	 * initially created by downstream only.
@@ -28,31 +36,34 @@ namespace zrp
 		requires IsUpstream<Upstream> && IsDownstream<Downstream>
 	struct forwarder : enable_shared_from_this<forwarder<Upstream, Downstream>> {
 			asio::io_context & ioc_;
+			io_shards_service *shards_; // each pipe goes to one shard, if ioc_ is sharded
 
 			string name_;
 			Upstream ups_;
 			Downstream dow_;
+			pipe_options popts_;
 
 			using pipe_t = pipe<Upstream, Downstream>;
+			using downstream_socket_t = socket_of_t<Downstream>;
 			using pipe_ptr_t = shared_ptr<pipe_t>;
 			using pipe_weak_ptr_t = weak_ptr<pipe_t>;
 
-			asio::strand<asio::io_context::executor_type> str_pipes_;
-			map<int, pipe_weak_ptr_t> pipes_;
-			int next_pipe_id_ = 0;
+			sharded_registry<pipe_t> pipes_; // pipes take themselves out when destroyed
+			atomic<int> next_pipe_id_ = 0;
 
 			bool stopping_ = false;
 			log::logger logger_;
+			shared_ptr<access_log::sink> access_log_; // each pipe appends a record when done, if set
 
 			int next_pipe_id() noexcept {
-				return next_pipe_id_++;
+				return next_pipe_id_.fetch_add(1, std::memory_order_relaxed);
 			}
 
-			forwarder(asio::io_context &ioc, string name, Upstream ups, Downstream dow)
-				: ioc_(ioc), name_(name), ups_(move(ups)), dow_(move(dow)), logger_(log::tag_forwarder(name)), str_pipes_(asio::make_strand(ioc)) {}
+			forwarder(asio::io_context &ioc, string name, Upstream ups, Downstream dow, pipe_options popts)
+				: ioc_(ioc), shards_(find_shards(ioc)), name_(name), ups_(move(ups)), dow_(move(dow)), popts_(popts), logger_(log::tag_forwarder(name)) {}
 
-			static shared_ptr<forwarder<Upstream, Downstream>> create(asio::io_context &ioc, string name, Upstream ups, Downstream dow) {
-				return make_shared<forwarder<Upstream, Downstream>>(ioc, move(name), move(ups), move(dow));
+			static shared_ptr<forwarder<Upstream, Downstream>> create(asio::io_context &ioc, string name, Upstream ups, Downstream dow, pipe_options popts = {}) {
+				return make_shared<forwarder<Upstream, Downstream>>(ioc, move(name), move(ups), move(dow), popts);
 			}
 
 			void post_try_stop() noexcept {
@@ -73,14 +84,10 @@ namespace zrp
 					ups_.try_stop();
 				}
 
-				auto exec = co_await this_coro::executor;
-				co_await asio::post(str_pipes_, asio::use_awaitable);
-				for (auto& it : pipes_) {
-					if (pipe_ptr_t p = it.second.lock()) {
-						p->try_stop();
-					}
-				}
-				co_await asio::post(exec, asio::use_awaitable);
+				pipes_.for_each([](const pipe_ptr_t& p) {
+					p->try_stop();
+				});
+				co_return;
 			}
 
 			awaitable<void> handle_error(const exception_ptr eptr) noexcept {
@@ -100,6 +107,10 @@ namespace zrp
 				}
 			}
 
+			asio::io_context& next_shard() noexcept {
+				return shards_ ? shards_->next() : ioc_;
+			}
+
 			void run() {
 				auto sg = this->shared_from_this();
 				co_spawn(ioc_, [this, sg]() mutable -> awaitable<void> {
@@ -111,16 +122,56 @@ namespace zrp
 
 			awaitable<void> forward() {
 				auto sg = this->shared_from_this();
+				// a single lane accepts on one io_context, its sockets are spread below
+				if constexpr (IsMultiLaneDownstream<Downstream>) {
+					if (dow_.lanes() > 1) {
+						for (size_t i = 1; i < dow_.lanes(); i++) {
+							co_spawn(dow_.lane_context(i), [this, sg, i]() mutable -> awaitable<void> {
+								try {
+									co_await forward_lane(i);
+								} catch(...) {};
+							}, asio::detached);
+						}
+						co_await forward_lane(0);
+						co_return;
+					}
+				}
+				exception_ptr eptr;
+				try {
+					for(;;) {
+						tcp::endpoint ep;
+						asio::io_context &shard = next_shard();
+						downstream_socket_t d_s = rebind_ioc(shard, co_await dow_.get_socket(ep));
+						co_spawn(shard, [this, sg, &shard, d_s = move(d_s), ep]() mutable -> awaitable<void> {
+							co_await handle_socket(shard, move(d_s), ep);
+						}, asio::detached);
+					}
+				} catch (const exception&) { // clang prohibits co_await inside catch block
+					eptr = std::current_exception();
+				}
+				if (eptr) {
+					co_await handle_error(eptr);
+					std::rethrow_exception(eptr);
+				}
+			}
+
+			/**
+			 * Accepts on one lane of a multi-lane downstream. Sockets come bound
+			 * to the lane's io_context already, and their pipes stay there.
+			 */
+			awaitable<void> forward_lane(size_t lane) requires IsMultiLaneDownstream<Downstream> {
+				auto sg = this->shared_from_this();
+				asio::io_context &shard = dow_.lane_context(lane);
 				exception_ptr eptr;
 				try {
 					for(;;) {
 						tcp::endpoint ep;
-						tcp::socket d_s = rebind_ioc(ioc_, co_await dow_.get_socket(ep));
-						co_spawn(ioc_, [this, sg, d_s = move(d_s), ep]() mutable -> awaitable<void> {
-							co_await handle_socket(move(d_s), ep);
+						downstream_socket_t d_s = co_await dow_.get_socket(lane, ep);
+						co_spawn(shard, [this, sg, &shard, d_s = move(d_s), ep]() mutable -> awaitable<void> {
+							co_await handle_socket(shard, move(d_s), ep);
 						}, asio::detached);
 					}
-				} catch (const exception e) { // clang prohibits co_await inside catch block
+				} catch (const exception&) { // clang prohibits co_await inside catch block
 					eptr = std::current_exception();
 				}
 				if (eptr) {
@@ -129,16 +180,13 @@ namespace zrp
 				}
 			}
 
-			awaitable<void> handle_socket(tcp::socket s, const tcp::endpoint ep) {
+			awaitable<void> handle_socket(asio::io_context &shard, downstream_socket_t s, const tcp::endpoint ep) {
 				try {
-					auto u_s = rebind_ioc(ioc_, co_await ups_.get_socket(ep));
-
-					auto exec = co_await this_coro::executor;
-					co_await asio::post(str_pipes_, asio::use_awaitable);
-					int id = next_pipe_id();
-					pipe_ptr_t p = pipe_t::create(ioc_, this->shared_from_this(), id, move(s), move(u_s));
-					pipes_.emplace(id, p);
-					co_await asio::post(exec, asio::use_awaitable);
+					auto u_s = rebind_ioc(shard, co_await ups_.get_socket(ep));
+
+					pipe_ptr_t p = pipe_t::create(shard, this->shared_from_this(), next_pipe_id(), move(s), move(u_s));
+					p->registered_ = pipes_.add(p);
+					p->peer_ = ep;
 
 					p->run();
 				} catch (const exception& e) {
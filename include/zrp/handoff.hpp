@@ -0,0 +1,183 @@
+// SPDX-License-Identifier: BSL-1.0
+// copyleft 2021 youcai <omegacoleman@gmail.com>
+// Distributed under the Boost Software License, Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+// Needs nothing but POSIX and the standard library, so that local services
+// can include it without the rest of zrp.
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <optional>
+#include <string>
+#include <system_error>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+namespace zrp::handoff {
+
+	/**
+	 * A visit handed over by zclient to a share with handoff set. zclient
+	 * connects to the share's local_path once per visit, writes a single
+	 * message and closes. The message is a 2 byte big endian length followed
+	 * by "<ip> <port> <epoch>", with the tunnel socket attached to it as
+	 * SCM_RIGHTS. The visitor's bytes are read from, and the replies written
+	 * to, that socket directly.
+	 */
+	struct visit {
+		int fd = -1;
+		std::string ip;
+		unsigned short port = 0;
+		uint64_t epoch = 0; // microseconds since the unix epoch, when the server saw the visitor
+	};
+
+	const size_t max_payload = 255;
+
+	inline std::string encode(const std::string& ip, unsigned short port, uint64_t epoch) {
+		char buf[max_payload + 1];
+		int len = std::snprintf(buf, sizeof(buf), "%s %u %llu", ip.c_str(), static_cast<unsigned>(port), static_cast<unsigned long long>(epoch));
+		if (len < 0 || static_cast<size_t>(len) > max_payload) {
+			len = 0;
+		}
+		std::string ret;
+		ret.push_back(static_cast<char>((len >> 8) & 0xff));
+		ret.push_back(static_cast<char>(len & 0xff));
+		ret.append(buf, static_cast<size_t>(len));
+		return ret;
+	}
+
+	/**
+	 * Sends part of an encoded message, attaching fd unless it is -1. Returns
+	 * the bytes sent, or 0 with ec set, would_block included on non-blocking
+	 * sockets.
+	 */
+	inline size_t send(int sock, int fd, const char* data, size_t len, std::error_code& ec) noexcept {
+		iovec iov;
+		iov.iov_base = const_cast<char*>(data);
+		iov.iov_len = len;
+		msghdr mh{};
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		alignas(cmsghdr) char ctl[CMSG_SPACE(sizeof(int))];
+		if (fd >= 0) {
+			std::memset(ctl, 0, sizeof(ctl));
+			mh.msg_control = ctl;
+			mh.msg_controllen = sizeof(ctl);
+			cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+			cm->cmsg_level = SOL_SOCKET;
+			cm->cmsg_type = SCM_RIGHTS;
+			cm->cmsg_len = CMSG_LEN(sizeof(int));
+			std::memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+		}
+		int flags = 0;
+#ifdef MSG_NOSIGNAL
+		flags |= MSG_NOSIGNAL;
+#endif
+		ssize_t n = ::sendmsg(sock, &mh, flags);
+		if (n < 0) {
+			ec = std::error_code(errno, std::generic_category());
+			return 0;
+		}
+		ec = {};
+		return static_cast<size_t>(n);
+	}
+
+	/**
+	 * For the local service : reads the one message of a connection accepted
+	 * on local_path, blocking. The caller owns visit::fd afterwards. A message
+	 * longer than max_payload, or with its fds cut off or more than one
+	 * attached, fails with EPROTO and leaves no fd open.
+	 */
+	inline std::optional<visit> recv(int sock, std::error_code& ec) noexcept {
+		char buf[2 + max_payload];
+		size_t got = 0;
+		int fd = -1;
+		bool extra_fds = false;
+		auto fail = [&](int err) -> std::optional<visit> {
+			if (fd >= 0) {
+				::close(fd);
+			}
+			ec = std::error_code(err, std::generic_category());
+			return std::nullopt;
+		};
+		size_t want = sizeof(buf);
+		for (;;) {
+			if (got >= 2) {
+				size_t len = (static_cast<unsigned char>(buf[0]) << 8) | static_cast<unsigned char>(buf[1]);
+				if (len > max_payload) {
+					return fail(EPROTO);
+				}
+				want = 2 + len;
+				if (got >= want) {
+					break;
+				}
+			}
+			iovec iov;
+			iov.iov_base = buf + got;
+			iov.iov_len = want - got;
+			msghdr mh{};
+			mh.msg_iov = &iov;
+			mh.msg_iovlen = 1;
+			alignas(cmsghdr) char ctl[CMSG_SPACE(sizeof(int))];
+			mh.msg_control = ctl;
+			mh.msg_controllen = sizeof(ctl);
+			int flags = 0;
+#ifdef MSG_CMSG_CLOEXEC
+			flags |= MSG_CMSG_CLOEXEC;
+#endif
+			ssize_t n = ::recvmsg(sock, &mh, flags);
+			if (n < 0) {
+				if (errno == EINTR) {
+					continue;
+				}
+				return fail(errno);
+			}
+			for (cmsghdr* cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+				if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) {
+					continue;
+				}
+				size_t nfds = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+				for (size_t i = 0; i < nfds; i++) {
+					int got_fd;
+					std::memcpy(&got_fd, CMSG_DATA(cm) + i * sizeof(int), sizeof(int));
+					if (fd < 0) {
+						fd = got_fd;
+					} else {
+						::close(got_fd);
+						extra_fds = true;
+					}
+				}
+			}
+			if (mh.msg_flags & MSG_CTRUNC) {
+				return fail(EPROTO); // the kernel dropped fds that did not fit
+			}
+			if (n == 0) {
+				return fail(ECONNRESET); // closed before a whole message
+			}
+			got += static_cast<size_t>(n);
+		}
+		if (fd < 0 || extra_fds) {
+			return fail(EPROTO);
+		}
+		visit ret;
+		ret.fd = fd;
+		std::string payload{buf + 2, want - 2};
+		size_t sp1 = payload.find(' ');
+		size_t sp2 = sp1 == std::string::npos ? sp1 : payload.find(' ', sp1 + 1);
+		if (sp2 == std::string::npos) {
+			return fail(EPROTO);
+		}
+		ret.ip = payload.substr(0, sp1);
+		ret.port = static_cast<unsigned short>(std::strtoul(payload.c_str() + sp1 + 1, nullptr, 10));
+		ret.epoch = std::strtoull(payload.c_str() + sp2 + 1, nullptr, 10);
+		ec = {};
+		return ret;
+	}
+
+}
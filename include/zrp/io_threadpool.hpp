@@ -6,16 +6,126 @@
 
 #include "zrp/bindings.hpp"
 
+#include "zrp/log.hpp"
+#include "zrp/uring.hpp"
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 namespace zrp {
 
+	/**
+	 * Registered on a sharded io_threadpool, so that code holding only the
+	 * pool's io_context can spread new work over the shards.
+	 */
+	struct io_shards_service : asio::execution_context::service {
+		static inline asio::execution_context::id id;
+
+		vector<asio::io_context*> shards_;
+		atomic<size_t> next_ = 0;
+
+		io_shards_service(asio::execution_context &ctx)
+			: asio::execution_context::service(ctx)
+		{}
+
+		void shutdown() override {}
+
+		asio::io_context& next() noexcept {
+			return *shards_[next_.fetch_add(1, std::memory_order_relaxed) % shards_.size()];
+		}
+
+		size_t size() const noexcept {
+			return shards_.size();
+		}
+
+		asio::io_context& at(size_t i) noexcept {
+			return *shards_[i];
+		}
+	};
+
+	// null if ioc is not a sharded pool
+	inline io_shards_service* find_shards(asio::io_context &ioc) {
+		if (!asio::has_service<io_shards_service>(ioc)) {
+			return nullptr;
+		}
+		auto &svc = asio::use_service<io_shards_service>(ioc);
+		return svc.shards_.empty() ? nullptr : &svc;
+	}
+
+	// the shard to put new work on, round robin, or ioc itself if not sharded
+	inline asio::io_context& pick_shard(asio::io_context &ioc) {
+		if (auto svc = find_shards(ioc)) {
+			return svc->next();
+		}
+		return ioc;
+	}
+
+	inline bool pin_thread_to_cpu(int cpu) noexcept {
+#ifdef __linux__
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		return ::pthread_setaffinity_np(::pthread_self(), sizeof(set), &set) == 0;
+#else
+		return false;
+#endif
+	}
+
 	struct io_threadpool : asio::io_context {
+		using shard_guard_t = asio::executor_work_guard<asio::io_context::executor_type>;
+
 		vector<thread> pool_;
+		vector<unique_ptr<asio::io_context>> own_shards_; // all shards but the first, which is the pool itself
+		vector<shard_guard_t> shard_guards_;
+		bool pin_threads_ = false;
+
+		/**
+		 * Splits the pool into count io_contexts with one thread each, instead
+		 * of one io_context run by all threads, so that a pipe stays on one
+		 * thread and one reactor from start to end. Call before anything is
+		 * put on the pool.
+		 */
+		void make_shards(size_t count) {
+			auto &svc = asio::use_service<io_shards_service>(*this);
+			svc.shards_.push_back(this);
+			for (size_t i = 1; i < count; i++) {
+				own_shards_.emplace_back(make_unique<asio::io_context>(1));
+				svc.shards_.push_back(own_shards_.back().get());
+				shard_guards_.emplace_back(own_shards_.back()->get_executor());
+			}
+		}
+
+		size_t shard_count() const noexcept {
+			return own_shards_.size() + 1;
+		}
+
+		asio::io_context& shard(size_t i) noexcept {
+			return i == 0 ? *this : *own_shards_[i - 1];
+		}
+
+		// thread i goes to cpu i, wrapping around
+		void pin_threads(bool pin) noexcept {
+			pin_threads_ = pin;
+		}
 
 		void start_in_parallel(size_t thread_count, function<void(int)> on_started) {
 			for (int i = 0; i < thread_count; i++) {
 				pool_.emplace_back([this, i, on_started]() mutable {
+					if (pin_threads_) {
+						unsigned cpus = std::max(thread::hardware_concurrency(), 1u);
+						int cpu = static_cast<int>(i % cpus);
+						if (!pin_thread_to_cpu(cpu)) {
+							log::as(log::tag_main{}).warning(FMT_COMPILE("could not pin forwarder thread {} to cpu {}"), i, cpu);
+						}
+					}
 					on_started(i);
-					asio::io_context::run();
+					if (own_shards_.empty()) {
+						asio::io_context::run();
+					} else {
+						shard(i % shard_count()).run();
+					}
 				});
 			}
 		}
@@ -24,7 +134,29 @@ namespace zrp {
 			start_in_parallel(thread_count, [](int){});
 		}
 
+		/**
+		 * Runs the first shard on the calling thread and every other shard on
+		 * a thread of its own, for a pool whose owner lives on the first
+		 * shard. Returns once the first shard runs out of work, and the others
+		 * have finished theirs.
+		 */
+		void run_sharded(function<void(int)> on_started) {
+			for (size_t i = 1; i < shard_count(); i++) {
+				pool_.emplace_back([this, i, on_started]() mutable {
+					on_started(static_cast<int>(i));
+					shard(i).run();
+				});
+			}
+			asio::io_context::run();
+			join_all();
+		}
+
+		// shards past the first run out of work like the pool itself would
 		void join_all() {
+			shard_guards_.clear();
+#ifdef ZRP_HAS_IO_URING
+			stop_io_uring(); // reaping completions would keep them busy for good
+#endif
 			for (auto& it : pool_) {
 				it.join();
 			}
@@ -33,9 +165,44 @@ namespace zrp {
 
 		void stop_and_join() {
 			asio::io_context::stop();
+			for (auto& it : own_shards_) {
+				it->stop();
+			}
 			join_all();
 		}
+
+#ifdef ZRP_HAS_IO_URING
+		/**
+		 * Attaches an io_uring instance to the pool, for the io_uring pipe
+		 * engine, one per shard. Fails on kernels without io_uring or older
+		 * than 5.7, or when it is forbidden.
+		 */
+		bool try_enable_io_uring(const uring_options &opts, error_code &ec) {
+			for (size_t i = 0; i < shard_count(); i++) {
+				auto &svc = asio::use_service<uring_service>(shard(i));
+				if (!svc.is_open()) {
+					svc.open(opts, ec);
+				}
+				if (!svc.is_open()) {
+					// nothing runs on the pool yet, the earlier shards close right away
+					for (size_t j = 0; j < i; j++) {
+						asio::use_service<uring_service>(shard(j)).close();
+					}
+					return false;
+				}
+			}
+			return true;
+		}
+
+		// every shard closes its ring once the ops on it have completed
+		void stop_io_uring() {
+			for (size_t i = 0; i < shard_count(); i++) {
+				if (asio::has_service<uring_service>(shard(i))) {
+					asio::use_service<uring_service>(shard(i)).stop();
+				}
+			}
+		}
+#endif
 	};
 
 }
-
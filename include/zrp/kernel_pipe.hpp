@@ -0,0 +1,142 @@
+// SPDX-License-Identifier: BSL-1.0
+// copyleft 2021 youcai <omegacoleman@gmail.com>
+// Distributed under the Boost Software License, Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include "zrp/bindings.hpp"
+
+#if defined (__linux__)
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#define ZRP_HAS_SPLICE 1
+
+namespace zrp {
+
+	const size_t kernel_pipe_size = 65536;
+	const size_t kernel_pipe_pool_max = 64;
+
+	inline error_code last_sys_error() noexcept {
+		return error_code(errno, asio::error::get_system_category());
+	}
+
+	/**
+	 * A pair of kernel pipe fds used as the intermediate buffer of splice(2),
+	 * pending_ tracks bytes spliced in but not yet spliced out.
+	 */
+	struct kernel_pipe {
+		int rd_ = -1;
+		int wr_ = -1;
+		size_t pending_ = 0;
+
+		kernel_pipe() = default;
+		kernel_pipe(const kernel_pipe&) = delete;
+		kernel_pipe& operator=(const kernel_pipe&) = delete;
+
+		kernel_pipe(kernel_pipe&& o) noexcept
+			: rd_(o.rd_), wr_(o.wr_), pending_(o.pending_)
+		{
+			o.rd_ = -1;
+			o.wr_ = -1;
+			o.pending_ = 0;
+		}
+
+		kernel_pipe& operator=(kernel_pipe&& o) noexcept {
+			close();
+			rd_ = o.rd_;
+			wr_ = o.wr_;
+			pending_ = o.pending_;
+			o.rd_ = -1;
+			o.wr_ = -1;
+			o.pending_ = 0;
+			return *this;
+		}
+
+		~kernel_pipe() {
+			close();
+		}
+
+		bool is_open() const noexcept {
+			return rd_ >= 0;
+		}
+
+		void open(error_code& ec) noexcept {
+			int fds[2];
+			if (::pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+				ec = last_sys_error();
+				return;
+			}
+			rd_ = fds[0];
+			wr_ = fds[1];
+			::fcntl(wr_, F_SETPIPE_SZ, static_cast<int>(kernel_pipe_size)); // best effort
+		}
+
+		void close() noexcept {
+			if (rd_ >= 0)
+				::close(rd_);
+			if (wr_ >= 0)
+				::close(wr_);
+			rd_ = -1;
+			wr_ = -1;
+			pending_ = 0;
+		}
+
+		// socket -> pipe, returns 0 on eof
+		size_t splice_from(int fd, size_t len, error_code& ec) noexcept {
+			ssize_t n = ::splice(fd, nullptr, wr_, nullptr, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n < 0) {
+				ec = last_sys_error();
+				return 0;
+			}
+			pending_ += static_cast<size_t>(n);
+			return static_cast<size_t>(n);
+		}
+
+		// pipe -> socket
+		size_t splice_to(int fd, error_code& ec) noexcept {
+			ssize_t n = ::splice(rd_, nullptr, fd, nullptr, pending_, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+			if (n < 0) {
+				ec = last_sys_error();
+				return 0;
+			}
+			pending_ -= static_cast<size_t>(n);
+			return static_cast<size_t>(n);
+		}
+	};
+
+	/**
+	 * Per-thread cache of empty kernel pipes, so that a pipe is only borrowed
+	 * while data is actually being moved.
+	 */
+	struct kernel_pipe_pool {
+		vector<kernel_pipe> free_;
+
+		static kernel_pipe_pool& local() noexcept {
+			thread_local kernel_pipe_pool pool;
+			return pool;
+		}
+
+		kernel_pipe acquire(error_code& ec) noexcept {
+			if (!free_.empty()) {
+				kernel_pipe ret{move(free_.back())};
+				free_.pop_back();
+				return ret;
+			}
+			kernel_pipe ret;
+			ret.open(ec);
+			return ret;
+		}
+
+		void release(kernel_pipe p) noexcept {
+			// a pipe still holding data can not be reused by others
+			if (p.is_open() && p.pending_ == 0 && free_.size() < kernel_pipe_pool_max) {
+				free_.emplace_back(move(p));
+			}
+		}
+	};
+
+}
+
+#endif
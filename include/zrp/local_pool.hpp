@@ -0,0 +1,171 @@
+// SPDX-License-Identifier: BSL-1.0
+// copyleft 2021 youcai <omegacoleman@gmail.com>
+// Distributed under the Boost Software License, Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include "zrp/bindings.hpp"
+
+#include "zrp/completion_handler.hpp"
+#include "zrp/log.hpp"
+
+namespace zrp {
+
+	const chrono::seconds local_pool_tick{1};
+	const chrono::seconds local_pool_retry{1};
+
+	/**
+	 * Sockets connected ahead of time to a local service, so that a visit
+	 * does not wait for the connect. Sockets idle for longer than the idle
+	 * timeout, or closed by the service meanwhile, are dropped and replaced.
+	 * All state is touched on the io_context only, like waitqueue.
+	 */
+	struct local_pool : enable_shared_from_this<local_pool> {
+		using take_completion_handler_t = completion_handler<void(error_code, optional<tcp::socket>)>;
+
+		struct entry {
+			tcp::socket s_;
+			chrono::steady_clock::time_point since_;
+		};
+
+		asio::io_context &ioc_;
+		tcp::endpoint ep_;
+		size_t size_;
+		chrono::seconds idle_timeout_;
+		deque<entry> idle_;
+		size_t connecting_ = 0;
+		chrono::steady_clock::time_point retry_after_{};
+		bool stopping_ = false;
+		steady_timer sweep_timer_;
+		log::logger logger_;
+
+		local_pool(asio::io_context &ioc, tcp::endpoint ep, size_t size, chrono::seconds idle_timeout, log::tag_t tag)
+			: ioc_(ioc), ep_(move(ep)), size_(size), idle_timeout_(idle_timeout), sweep_timer_(ioc), logger_(tag)
+		{}
+
+		static shared_ptr<local_pool> create(asio::io_context &ioc, tcp::endpoint ep, size_t size, chrono::seconds idle_timeout, log::tag_t tag) {
+			return make_shared<local_pool>(ioc, move(ep), size, idle_timeout, move(tag));
+		}
+
+		void run() {
+			auto sg = this->shared_from_this();
+			co_spawn(ioc_, [this, sg]() mutable -> awaitable<void> {
+				co_await sweep_actor();
+			}, asio::detached);
+		}
+
+		// may be called from any thread
+		void try_stop() noexcept {
+			auto sg = this->shared_from_this();
+			asio::post(ioc_, [this, sg]() {
+				stopping_ = true;
+				idle_.clear();
+				try {
+					sweep_timer_.cancel();
+				} catch (...) {}
+			});
+		}
+
+		/**
+		 * A warm socket if there is one, nullopt if the caller should connect
+		 * by itself. Either way the pool is refilled in the background.
+		 */
+		awaitable<optional<tcp::socket>> take() {
+			auto sg = this->shared_from_this();
+			auto initiation = [this, sg](auto&& handler) mutable
+			{
+				take_completion_handler_t curr_handler = forward<decltype(handler)>(handler);
+				asio::post(ioc_, [this, sg, curr_handler = move(curr_handler)]() mutable {
+					optional<tcp::socket> ret;
+					while (!idle_.empty()) {
+						entry e = move(idle_.front());
+						idle_.pop_front();
+						if (usable(e)) {
+							ret.emplace(move(e.s_));
+							break;
+						}
+					}
+					fill();
+					curr_handler({}, move(ret));
+				});
+			};
+			co_return co_await asio::async_initiate<decltype(asio::use_awaitable), void(error_code, optional<tcp::socket>)>(initiation, asio::use_awaitable);
+		}
+
+	private:
+		bool usable(entry &e) noexcept {
+			if (chrono::steady_clock::now() - e.since_ > idle_timeout_) {
+				return false;
+			}
+			return is_alive(e.s_);
+		}
+
+		/**
+		 * Peeks without blocking, a service that closed the connection reads
+		 * as eof. Data already sent by the service, like a banner, is fine
+		 * and is forwarded by the pipe later.
+		 */
+		static bool is_alive(tcp::socket &s) noexcept {
+			error_code ec;
+			s.non_blocking(true, ec);
+			if (ec) {
+				return false;
+			}
+			char c;
+			s.receive(buffer(&c, 1), tcp::socket::message_peek, ec);
+			bool alive = !ec || ec == asio::error::would_block;
+			s.non_blocking(false, ec);
+			return alive && !ec;
+		}
+
+		void fill() {
+			if (stopping_ || chrono::steady_clock::now() < retry_after_) {
+				return;
+			}
+			auto sg = this->shared_from_this();
+			while (idle_.size() + connecting_ < size_) {
+				connecting_++;
+				co_spawn(ioc_, [this, sg]() mutable -> awaitable<void> {
+					co_await connect_one();
+				}, asio::detached);
+			}
+		}
+
+		awaitable<void> connect_one() {
+			tcp::socket s{ioc_};
+			try {
+				co_await s.async_connect(ep_, asio::use_awaitable);
+			} catch (const system_error& se) {
+				connecting_--;
+				if (!stopping_ && chrono::steady_clock::now() >= retry_after_) {
+					logger_.warning("could not pre-connect to local service : ").with_exception(se);
+				}
+				retry_after_ = chrono::steady_clock::now() + local_pool_retry;
+				co_return;
+			}
+			connecting_--;
+			if (stopping_) {
+				co_return;
+			}
+			idle_.emplace_back(entry{move(s), chrono::steady_clock::now()});
+		}
+
+		awaitable<void> sweep_actor() {
+			try {
+				while (!stopping_) {
+					std::erase_if(idle_, [this](entry& e) {
+						return !usable(e);
+					});
+					fill();
+					sweep_timer_.expires_after(local_pool_tick);
+					co_await sweep_timer_.async_wait(asio::use_awaitable);
+				}
+			} catch (const system_error& se) {
+				if (se.code() != asio::error::operation_aborted) {
+					logger_.error("got an exception, local pool stopped : ").with_exception(se);
+				}
+			}
+		}
+	};
+
+}
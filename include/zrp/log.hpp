@@ -8,6 +8,8 @@
 
 #include "zrp/fmt_misc.hpp"
 #include "zrp/args.hpp"
+#include "zrp/exceptions.hpp"
+#include "zrp/stats.hpp"
 
 namespace zrp {
 
@@ -48,6 +50,18 @@ inline string to_string(const tag_tcp_share_worker& t) {
 	return fmt::format("worker:{}#{}", t.share_id, t.id);
 }
 
+struct tag_tunnel {
+	string client_uuid;
+	int id;
+
+	tag_tunnel(string client_uuid, int id)
+		: client_uuid(client_uuid), id(id) {}
+};
+
+inline string to_string(const tag_tunnel& t) {
+	return fmt::format("tunnel:{}#{}", t.client_uuid, t.id);
+}
+
 struct tag_tcp_share {
 	string share_id;
 
@@ -97,13 +111,72 @@ inline string to_string(const tag_timeout& t) {
 	return fmt::format("timeout");
 }
 
-using tag_t = variant<tag_forwarder, tag_pipe, tag_tcp_share_worker, tag_tcp_share, tag_controller, tag_server, tag_client, tag_main, tag_msg, tag_timeout>;
+struct tag_io_uring {};
+
+inline string to_string(const tag_io_uring& t) {
+	return fmt::format("io_uring");
+}
+
+struct tag_stats {};
+
+inline string to_string(const tag_stats& t) {
+	return fmt::format("stats");
+}
+
+struct tag_log {};
+
+inline string to_string(const tag_log& t) {
+	return fmt::format("log");
+}
+
+struct tag_access_log {};
+
+inline string to_string(const tag_access_log& t) {
+	return fmt::format("access_log");
+}
+
+using tag_t = variant<tag_forwarder, tag_pipe, tag_tcp_share_worker, tag_tunnel, tag_tcp_share, tag_controller, tag_server, tag_client, tag_main, tag_msg, tag_timeout, tag_io_uring, tag_stats, tag_log, tag_access_log>;
 
 inline string to_string(const tag_t &t) {
 	return std::visit([](auto && t) -> string {
 		return to_string(t);
 	}, t);
 }
+
+/**
+ * A tag rendered once, when its logger is made, and shared by the messages
+ * it makes. Tags without fields, like tag_main, are rendered once for all.
+ */
+struct tag_handle {
+	shared_ptr<const string> text_;
+
+	tag_handle() = default;
+
+	template <class T>
+		requires std::is_constructible_v<tag_t, T>
+	tag_handle(const T& t)
+		: text_(intern(t)) {}
+
+	string_view str() const noexcept {
+		return text_ ? string_view{*text_} : string_view{};
+	}
+
+private:
+	template <class T>
+	static shared_ptr<const string> intern(const T& t) {
+		if constexpr (std::is_same_v<T, tag_t>) {
+			return std::visit([](auto && t) {
+				return intern(t);
+			}, t);
+		} else if constexpr (std::is_empty_v<T>) {
+			static const shared_ptr<const string> text = make_shared<const string>(to_string(t));
+			return text;
+		} else {
+			return make_shared<const string>(to_string(t));
+		}
+	}
+};
+
 enum class severity_t {
 	debug,
 	trace,
@@ -131,6 +204,36 @@ inline string to_string(const severity_t &s) {
 	return "INVL";
 }
 
+// builds made with ZRP_STRIP_DEBUG_LOGS or ZRP_STRIP_TRACE_LOGS leave those levels out entirely
+#ifdef ZRP_STRIP_DEBUG_LOGS
+const bool debug_logs_built = false;
+#else
+const bool debug_logs_built = true;
+#endif
+#ifdef ZRP_STRIP_TRACE_LOGS
+const bool trace_logs_built = false;
+#else
+const bool trace_logs_built = true;
+#endif
+
+constexpr bool built(severity_t s) noexcept {
+	if (s == severity_t::debug) {
+		return debug_logs_built;
+	} else if (s == severity_t::trace) {
+		return trace_logs_built;
+	}
+	return true;
+}
+
+inline bool enabled(severity_t s) noexcept {
+	if (s == severity_t::debug) {
+		return built(s) && show_debug;
+	} else if (s == severity_t::trace) {
+		return built(s) && show_trace;
+	}
+	return true;
+}
+
 namespace thread_role {
 
 struct main {};
@@ -145,12 +248,30 @@ inline string to_string(const fwd_pool_worker& r) {
 	return fmt::format(FMT_COMPILE("FWD{}"), r.nr);
 }
 
+struct ctrl_pool_worker { int nr; };
+
+inline string to_string(const ctrl_pool_worker& r) {
+	return fmt::format(FMT_COMPILE("CTL{}"), r.nr);
+}
+
 struct sigint_handler {};
 
 inline string to_string(const sigint_handler&) {
 	return "SIGH";
 }
 
+struct log_writer {};
+
+inline string to_string(const log_writer&) {
+	return "LOGW";
+}
+
+struct access_log_writer {};
+
+inline string to_string(const access_log_writer&) {
+	return "ACLW";
+}
+
 struct unknown {};
 
 inline string to_string(const unknown&) {
@@ -159,7 +280,7 @@ inline string to_string(const unknown&) {
 	return oss.str();
 }
 
-using role_t = variant<main, fwd_pool_worker, sigint_handler, unknown>;
+using role_t = variant<main, fwd_pool_worker, ctrl_pool_worker, sigint_handler, log_writer, access_log_writer, unknown>;
 
 thread_local static inline role_t curr_role = unknown{};
 
@@ -175,10 +296,259 @@ inline void as(role_t r) {
 
 }
 
+/**
+ * Lines are rendered on the thread logging them. With a writer started they
+ * are then copied into a ring of that thread and written out in batches by
+ * the writer thread, so that a slow stdout holds up nothing but the writer.
+ * Without one they are written at once, as before the config is loaded.
+ */
+const chrono::milliseconds writer_tick{100};
+
+enum class overflow_t {
+	drop,
+	block,
+};
+
+inline overflow_t overflow_from_string(const string_view s) {
+	if (s == "drop") {
+		return overflow_t::drop;
+	} else if (s == "block") {
+		return overflow_t::block;
+	}
+	throw exceptions::bad_config_value{"log_overflow", string{s}};
+}
+
+struct writer_options {
+	size_t ring_size = 65536;
+	overflow_t overflow = overflow_t::drop;
+};
+
+inline writer_options load_writer_options(int ring_size, const string_view overflow) {
+	if (ring_size < 4096) {
+		throw exceptions::bad_config_value{"log_buffer", fmt::format(FMT_COMPILE("{}"), ring_size)};
+	}
+	writer_options ret;
+	ret.ring_size = std::bit_ceil(static_cast<size_t>(ring_size));
+	ret.overflow = overflow_from_string(overflow);
+	return ret;
+}
+
+/**
+ * Bytes of whole lines, pushed by the thread owning it and drained by the
+ * writer, without locking.
+ */
+struct line_ring {
+	vector<char> buf_;
+	atomic<size_t> head_ = 0; // advanced by the writer
+	atomic<size_t> tail_ = 0; // advanced by the owning thread
+	atomic<bool> abandoned_ = false; // the owning thread has exited
+
+	line_ring(size_t size)
+		: buf_(size) {}
+
+	bool try_push(string_view line) noexcept {
+		size_t t = tail_.load(std::memory_order_relaxed);
+		size_t h = head_.load(std::memory_order_acquire);
+		if (line.size() > buf_.size() - (t - h)) {
+			return false;
+		}
+		size_t at = t & (buf_.size() - 1);
+		size_t first = std::min(line.size(), buf_.size() - at);
+		std::memcpy(buf_.data() + at, line.data(), first);
+		std::memcpy(buf_.data(), line.data() + first, line.size() - first);
+		tail_.store(t + line.size(), std::memory_order_release);
+		return true;
+	}
+
+	void drain_to(string& out) {
+		size_t h = head_.load(std::memory_order_relaxed);
+		size_t t = tail_.load(std::memory_order_acquire);
+		size_t at = h & (buf_.size() - 1);
+		size_t first = std::min(t - h, buf_.size() - at);
+		out.append(buf_.data() + at, first);
+		out.append(buf_.data(), t - h - first);
+		head_.store(t, std::memory_order_release);
+	}
+
+	bool empty() const noexcept {
+		return head_.load(std::memory_order_acquire) == tail_.load(std::memory_order_acquire);
+	}
+};
+
+inline void write_out(string_view s) noexcept {
+	std::fwrite(s.data(), 1, s.size(), stdout);
+	std::fflush(stdout);
+}
+
+struct writer {
+	writer_options opts_;
+	mutex mtx_;
+	condition_variable cv_;
+	vector<shared_ptr<line_ring>> rings_; // guarded by mtx_
+	bool stopping_ = false; // guarded by mtx_
+	atomic<bool> pending_ = false;
+	atomic<bool> running_ = false;
+	int64_t dropped_noted_ = 0;
+	chrono::steady_clock::time_point noted_at_{};
+	string out_;
+	thread thread_;
+
+	writer(writer_options opts)
+		: opts_(opts) {}
+
+	void start() {
+		running_ = true;
+		thread_ = thread([this]() {
+			run();
+		});
+	}
+
+	// writes out every line submitted before it
+	void stop() {
+		{
+			lock_guard lk{mtx_};
+			stopping_ = true;
+		}
+		cv_.notify_one();
+		thread_.join();
+		running_ = false;
+	}
+
+	/**
+	 * False if the caller is to write the line by itself, as with lines
+	 * longer than a ring or once the writer has stopped.
+	 */
+	bool submit(string_view line) {
+		if (line.size() > opts_.ring_size) {
+			return false;
+		}
+		line_ring& r = local_ring();
+		while (!r.try_push(line)) {
+			if (opts_.overflow == overflow_t::drop) {
+				stats::log_lines_dropped.add(1);
+				return true;
+			}
+			if (!running_) {
+				return false;
+			}
+			wake();
+			std::this_thread::sleep_for(chrono::milliseconds{1});
+		}
+		wake();
+		return true;
+	}
+
+private:
+	struct ring_holder {
+		shared_ptr<line_ring> r_;
+
+		~ring_holder() {
+			if (r_) {
+				r_->abandoned_ = true;
+			}
+		}
+	};
+
+	line_ring& local_ring() {
+		thread_local ring_holder holder;
+		if (!holder.r_) {
+			holder.r_ = make_shared<line_ring>(opts_.ring_size);
+			lock_guard lk{mtx_};
+			rings_.push_back(holder.r_);
+		}
+		return *holder.r_;
+	}
+
+	// one notify per batch, the writer clears pending_ before draining
+	void wake() {
+		if (!pending_.exchange(true, std::memory_order_acq_rel)) {
+			lock_guard lk{mtx_};
+			cv_.notify_one();
+		}
+	}
+
+	void note_dropped();
+
+	void run() {
+		thread_role::as(thread_role::log_writer{});
+		for (;;) {
+			note_dropped();
+			bool stopping;
+			{
+				unique_lock lk{mtx_};
+				cv_.wait_for(lk, writer_tick, [this]() {
+					return stopping_ || pending_.load(std::memory_order_acquire);
+				});
+				pending_.store(false, std::memory_order_release);
+				stopping = stopping_;
+				for (auto& it : rings_) {
+					it->drain_to(out_);
+				}
+				std::erase_if(rings_, [](auto& it) {
+					return it->abandoned_ && it->empty();
+				});
+			}
+			if (!out_.empty()) {
+				write_out(out_);
+				out_.clear();
+			}
+			if (stopping) {
+				return;
+			}
+		}
+	}
+};
+
+static inline unique_ptr<writer> the_writer;
+static inline atomic<writer*> active_writer = nullptr;
+
+inline void emit(string_view line) {
+	if (writer* w = active_writer.load(std::memory_order_acquire); w && w->submit(line)) {
+		return;
+	}
+	write_out(line);
+}
+
+inline void start_writer(writer_options opts) {
+	the_writer = make_unique<writer>(opts);
+	the_writer->start();
+	active_writer.store(the_writer.get(), std::memory_order_release);
+}
+
+// the writer is kept, threads still logging may hold on to it
+inline void stop_writer() {
+	if (!active_writer.exchange(nullptr, std::memory_order_acq_rel)) {
+		return;
+	}
+	the_writer->stop();
+}
+
+inline chrono::system_clock::time_point coarse_now() noexcept {
+#ifdef CLOCK_REALTIME_COARSE
+	timespec ts;
+	if (::clock_gettime(CLOCK_REALTIME_COARSE, &ts) == 0) {
+		return chrono::system_clock::time_point{chrono::duration_cast<chrono::system_clock::duration>(chrono::seconds{ts.tv_sec} + chrono::nanoseconds{ts.tv_nsec})};
+	}
+#endif
+	return chrono::system_clock::now();
+}
+
+// the time is shown in seconds, so each thread renders it once a second
+inline string_view time_text(chrono::system_clock::time_point t) {
+	thread_local chrono::seconds rendered{-1};
+	thread_local string text;
+	auto s = chrono::duration_cast<chrono::seconds>(t.time_since_epoch());
+	if (s != rendered) {
+		text = fmt::format("{:%a, %d %b %Y %T %z}", chrono::system_clock::time_point{s});
+		rendered = s;
+	}
+	return text;
+}
+
 struct message {
 	chrono::system_clock::time_point time_;
 	severity_t severity_;
-	tag_t tag_{tag_main{}};
+	tag_handle tag_;
 	string msg_;
 	bool fired_ = false;
 
@@ -216,7 +586,7 @@ struct message {
 		return *this;
 	}
 
-	message &tag(tag_t t) {
+	message &tag(tag_handle t) {
 		tag_ = move(t);
 		return *this;
 	}
@@ -226,7 +596,10 @@ struct message {
 		return *this;
 	}
 
-	message &msg_append(string s) {
+	message &msg_append(string_view s) {
+		if (fired_) {
+			return *this;
+		}
 		msg_ += s;
 		return *this;
 	}
@@ -241,10 +614,9 @@ struct message {
 	}
 
 	void fire() {
-		if ((!show_trace) && severity_ == severity_t::trace)
-			return;
-		if ((!show_debug) && severity_ == severity_t::debug)
+		if (!enabled(severity_)) {
 			return;
+		}
 		fmt::text_style time_style = fmt::fg(fmt::terminal_color::bright_blue),
 			trole_style = fmt::fg(fmt::terminal_color::yellow),
 			tag_style = fmt::fg(fmt::terminal_color::blue),
@@ -260,59 +632,101 @@ struct message {
 		} else if (severity_ == severity_t::access) {
 			severity_style = fg(fmt::terminal_color::green);
 		}
-		fmt::print("[{}][{}][{}]<{}>: {}\n",
-			fmt::format(may(time_style), "{:%a, %d %b %Y %T %z}", time_),
-			fmt::format(may(trole_style), "{}", thread_role::to_string(thread_role::curr_role)),
-			fmt::format(may(severity_style), "{}", to_string(severity_)),
-			fmt::format(may(tag_style), "{}", to_string(tag_)),
-			fmt::format(may(msg_style), "{}", msg_));
-		std::fflush(stdout);
+		thread_local fmt::memory_buffer line;
+		line.clear();
+		auto out = std::back_inserter(line);
+		line.push_back('[');
+		fmt::format_to(out, may(time_style), "{}", time_text(time_));
+		fmt::format_to(out, "][");
+		fmt::format_to(out, may(trole_style), "{}", thread_role::to_string(thread_role::curr_role));
+		fmt::format_to(out, "][");
+		fmt::format_to(out, may(severity_style), "{}", to_string(severity_));
+		fmt::format_to(out, "]<");
+		fmt::format_to(out, may(tag_style), "{}", tag_.str());
+		fmt::format_to(out, ">: ");
+		fmt::format_to(out, may(msg_style), "{}", msg_);
+		line.push_back('\n');
+		emit(string_view{line.data(), line.size()});
 		fired_ = true;
 	}
 };
 
+/**
+ * The message text is formatted only for levels that are shown, a lone
+ * string is taken as it is. Levels stripped from the build cost nothing
+ * but the evaluation of the arguments.
+ */
 struct logger {
-	tag_t tag_;
+	tag_handle tag_;
 
-	logger(tag_t t)
-		:tag_(t) {}
+	logger(tag_handle t)
+		:tag_(move(t)) {}
 
-	template<severity_t Severity>
-	message gen(string s) {
+	template <severity_t Severity, class S, class ...Args>
+	message gen(S&& s, Args&&... args) {
 		message m;
-		m.time(chrono::system_clock::now()).tag(tag_).severity(Severity).msg(move(s));
-		return move(m);
+		if constexpr (built(Severity)) {
+			if (enabled(Severity)) {
+				m.time(coarse_now()).tag(tag_).severity(Severity);
+				if constexpr (!std::is_convertible_v<S, string_view>) {
+					m.msg(fmt::format(forward<S>(s), forward<Args>(args)...)); // FMT_COMPILE
+				} else if constexpr (sizeof...(Args) == 0) {
+					m.msg(string{forward<S>(s)});
+				} else {
+					m.msg(fmt::vformat(string_view{s}, fmt::make_format_args(args...)));
+				}
+				return m;
+			}
+		}
+		m.fired_ = true;
+		return m;
 	}
 
-	message debug(string s) {
-		return gen<severity_t::debug>(s);
+	template <class S, class ...Args>
+	message debug(S&& s, Args&&... args) {
+		return gen<severity_t::debug>(forward<S>(s), forward<Args>(args)...);
 	}
 
-	message trace(string s) {
-		return gen<severity_t::trace>(s);
+	template <class S, class ...Args>
+	message trace(S&& s, Args&&... args) {
+		return gen<severity_t::trace>(forward<S>(s), forward<Args>(args)...);
 	}
 
-	message access(string s) {
-		return gen<severity_t::access>(s);
+	template <class S, class ...Args>
+	message access(S&& s, Args&&... args) {
+		return gen<severity_t::access>(forward<S>(s), forward<Args>(args)...);
 	}
 
-	message info(string s) {
-		return gen<severity_t::info>(s);
+	template <class S, class ...Args>
+	message info(S&& s, Args&&... args) {
+		return gen<severity_t::info>(forward<S>(s), forward<Args>(args)...);
 	}
 
-	message warning(string s) {
-		return gen<severity_t::warning>(s);
+	template <class S, class ...Args>
+	message warning(S&& s, Args&&... args) {
+		return gen<severity_t::warning>(forward<S>(s), forward<Args>(args)...);
 	}
 
-	message error(string s) {
-		return gen<severity_t::error>(s);
+	template <class S, class ...Args>
+	message error(S&& s, Args&&... args) {
+		return gen<severity_t::error>(forward<S>(s), forward<Args>(args)...);
 	}
 };
 
-logger as(tag_t t) {
+logger as(tag_handle t) {
 	return {t};
 }
 
+inline void writer::note_dropped() {
+	int64_t dropped = stats::log_lines_dropped.get();
+	auto now = chrono::steady_clock::now();
+	if (dropped > dropped_noted_ && now - noted_at_ >= chrono::seconds{1}) {
+		as(tag_log{}).warning(FMT_COMPILE("dropped {} log lines, the writer could not keep up"), dropped - dropped_noted_);
+		dropped_noted_ = dropped;
+		noted_at_ = now;
+	}
+}
+
 }
 
 }
@@ -9,6 +9,7 @@
 #include "zrp/json_misc.hpp"
 #include "zrp/exceptions.hpp"
 #include "zrp/log.hpp"
+#include "zrp/stats.hpp"
 
 namespace zrp {
 
@@ -65,63 +66,270 @@ namespace zrp {
 		}
 	}
 
+	template <endian e>
+	inline uint32_t extract_uint32(const span<const char, 4> data) noexcept {
+		auto align = [](const char ch) -> uint32_t {
+			return static_cast<uint32_t>(static_cast<uint8_t>(ch)); // mind the sign
+		};
+		if constexpr (e == endian::little) {
+			return (align(data[0]) << 0)
+				 | (align(data[1]) << 8)
+				 | (align(data[2]) << 16)
+				 | (align(data[3]) << 24);
+		} else {
+			return (align(data[3]) << 0)
+				 | (align(data[2]) << 8)
+				 | (align(data[1]) << 16)
+				 | (align(data[0]) << 24);
+		}
+	}
+
+	template <endian e>
+	inline void put_uint32(const span<char, 4> data, const uint32_t in) noexcept {
+		auto trunc = [](const uint32_t i) -> char {
+			return static_cast<char>(static_cast<uint8_t>(i)); // mind the sign
+		};
+		if constexpr (e == endian::little) {
+			data[0] = trunc(in >> 0);
+			data[1] = trunc(in >> 8);
+			data[2] = trunc(in >> 16);
+			data[3] = trunc(in >> 24);
+		} else {
+			data[3] = trunc(in >> 0);
+			data[2] = trunc(in >> 8);
+			data[1] = trunc(in >> 16);
+			data[0] = trunc(in >> 24);
+		}
+	}
+
+	/**
+	 * Protocol versions, the lower of both sides is used :
+	 * 0 - one worker connection per visit
+	 * 1 - visits may be multiplexed over tunnel connections
+	 * 2 - idle workers may be retired by the client
+	 * 3 - the server asks for workers when visitors find none idle
+	 * 4 - worker connections may carry one visit after another
+	 * 5 - visits are not confirmed, workers are kept alive by the server's
+	 *     pings, which the client answers, and retired over the controller
+	 *     socket
+	 * 6 - messages past the hellos may be sent in binary, see msg_format
+	 */
+	const int protocol_version = 6;
+
+	/**
+	 * Messages are json, or since version 6 a compact binary form for those
+	 * having one. The receiver tells them apart by the first byte : json is
+	 * framed with an 8 byte big endian length, whose first byte is always 0,
+	 * while a binary message starts with its type id with the high bit set,
+	 * then a 2 byte big endian payload length.
+	 */
+	enum class msg_format { json, binary };
+
+	const size_t msg_size_max = 8192;
+	const size_t msg_batch_max = 64;
+
 	struct msg_t {
 		json::value jv_;
+		uint8_t bin_type_ = 0; // 0 for json
+		string bin_;
+
+		// not an aggregate, gcc mishandles aggregate temporaries in co_await
+		msg_t() = default;
+
+		explicit msg_t(json::value jv)
+			: jv_(move(jv))
+		{}
+
+		bool empty() const noexcept {
+			return bin_type_ == 0 && jv_.is_null();
+		}
 	};
 
 	string to_string(const msg_t& msg) {
 		ostringstream oss;
-		oss << "Data: " << msg.jv_ << "\n";
+		if (msg.bin_type_ != 0) {
+			oss << "Binary: type " << static_cast<int>(msg.bin_type_) << ", " << msg.bin_.size() << " bytes\n";
+		} else {
+			oss << "Data: " << msg.jv_ << "\n";
+		}
 		return oss.str();
 	}
 
-#if 0
-	awaitable<msg_t> recv_msg(tcp::socket& s) {
-#else
-	template <class AsyncReadable>
-	awaitable<msg_t> recv_msg(AsyncReadable& s) {
-#endif
+	// frames msg at the end of out, whose capacity is kept across calls
+	inline void encode_frame(const msg_t& msg, string& out, json::serializer& sr) {
+		if (msg.bin_type_ != 0) {
+			out.push_back(static_cast<char>(0x80 | msg.bin_type_));
+			out.push_back(static_cast<char>((msg.bin_.size() >> 8) & 0xff));
+			out.push_back(static_cast<char>(msg.bin_.size() & 0xff));
+			out.append(msg.bin_);
+			return;
+		}
+		size_t head = out.size();
+		out.resize(head + 8);
+		sr.reset(&msg.jv_);
+		while (!sr.done()) {
+			size_t at = out.size();
+			out.resize(at + 512);
+			string_view chunk = sr.read(out.data() + at, 512);
+			out.resize(at + chunk.size());
+		}
+		put_uint64<endian::big>(span<char, 8>{out.data() + head, 8}, static_cast<uint64_t>(out.size() - head - 8));
+	}
+
+	/**
+	 * recv_msg and send_msg for a long lived connection, keeping buffers
+	 * around so that small messages, keepalives included, cost no heap
+	 * allocation of their own. Json is parsed into a monotonic resource
+	 * released on the next recv(), so a message, and what is unmarshalled
+	 * from it, lives until then. One recv() and one send() may be pending
+	 * at once.
+	 *
+	 * recv() and send() are single async operations rather than coroutines,
+	 * a coroutine nested in the caller's would take a frame that asio's
+	 * per thread cache, holding one, does not keep.
+	 */
+	struct msg_codec {
+		unsigned char value_buf_[512];
+		json::monotonic_resource mr_{value_buf_, sizeof(value_buf_)};
 		json::stream_parser parser_;
-		msg_t msg;
+		json::serializer sr_;
+		string in_; // the frame being read, head included
+		string out_;
+
+		struct frame_head {
+			uint8_t bin_type; // 0 for json
+			size_t head_size;
+			size_t len;
+		};
+
+		// nullopt until enough of the head is read to tell
+		static optional<frame_head> parse_head(const char *in, size_t n) noexcept {
+			if (n < 3) {
+				return std::nullopt;
+			}
+			if (static_cast<uint8_t>(in[0]) & 0x80) {
+				return frame_head{static_cast<uint8_t>(static_cast<uint8_t>(in[0]) & 0x7f), 3,
+					(static_cast<size_t>(static_cast<uint8_t>(in[1])) << 8) | static_cast<uint8_t>(in[2])};
+			}
+			if (n < 8) {
+				return std::nullopt;
+			}
+			return frame_head{0, 8, extract_uint64<endian::big>(span<const char, 8>{in, 8})};
+		}
 
-		char buf_meta[8];
-		size_t meta_read_sz = co_await async_read(s, buffer(buf_meta), asio::use_awaitable);
-		size_t len = extract_uint64<endian::big>(span<char, 8>{buf_meta, 8});
-		log::as(log::tag_msg{}).debug(fmt::format(FMT_COMPILE("Read len {}"), len));
+		// how much more to read for the frame in in_[0, n), never past it
+		size_t frame_left(size_t n) const noexcept {
+			auto head = parse_head(in_.data(), n);
+			if (!head) {
+				return (n < 3 ? 3 : 8) - n;
+			}
+			if (head->len > msg_size_max) {
+				return 0; // decode() throws
+			}
+			return head->head_size + head->len - n;
+		}
 
-		if (len > 8192) {
-			throw exceptions::msg_too_big{len};
+		msg_t decode(size_t n) {
+			frame_head head = *parse_head(in_.data(), n);
+			if (log::enabled(log::severity_t::debug)) { // spares making a logger per message
+				log::as(log::tag_msg{}).debug(FMT_COMPILE("Read len {}"), head.len);
+			}
+			if (head.len > msg_size_max) {
+				throw exceptions::msg_too_big{head.len};
+			}
+			string_view payload{in_.data() + head.head_size, head.len};
+			if (head.bin_type != 0) {
+				msg_t msg;
+				msg.bin_type_ = head.bin_type;
+				msg.bin_.assign(payload); // small payloads stay inline
+				return msg;
+			}
+			if (log::enabled(log::severity_t::debug)) {
+				log::as(log::tag_msg{}).debug(FMT_COMPILE("Read payload {}"), payload);
+			}
+			mr_.release();
+			parser_.reset(json::storage_ptr(&mr_));
+			parser_.write(payload.data(), payload.size());
+			return msg_t{parser_.release()}; // assigning would copy it out of mr_
 		}
 
-		size_t remain = len;
-		while (remain > 4096) {
-			char buf_payload[4096];
-			size_t payload_read_sz = co_await s.async_read_some(buffer(buf_payload), asio::use_awaitable);
-			log::as(log::tag_msg{}).debug(fmt::format(FMT_COMPILE("Read payload {}"), std::string_view{buf_payload, payload_read_sz}));
-			parser_.write({buf_payload, payload_read_sz});
-			remain -= payload_read_sz;
+		template <class AsyncReadable>
+		awaitable<msg_t> recv(AsyncReadable& s) {
+			auto initiation = [this, &s](auto&& handler) {
+				auto ex = asio::get_associated_executor(handler, s.get_executor());
+				in_.resize(8 + msg_size_max); // once, the capacity is kept
+				async_read(s, buffer(in_), [this](const error_code& ec, size_t n) -> size_t {
+					return ec ? 0 : frame_left(n);
+				}, asio::bind_executor(ex, [this, handler = forward<decltype(handler)>(handler)](error_code ec, size_t n) mutable {
+					exception_ptr ep;
+					msg_t msg;
+					if (ec) {
+						ep = std::make_exception_ptr(system_error{ec});
+					} else {
+						try {
+							msg = decode(n);
+						} catch (...) {
+							ep = std::current_exception();
+						}
+					}
+					handler(ep, move(msg));
+				}));
+			};
+			return asio::async_initiate<decltype(asio::use_awaitable), void(exception_ptr, msg_t)>(move(initiation), asio::use_awaitable);
 		}
-		if (remain > 0) {
-			char buf_payload[4096];
-			size_t payload_read_sz = co_await async_read(s, buffer(buf_payload, remain), asio::use_awaitable);
-			log::as(log::tag_msg{}).debug(fmt::format(FMT_COMPILE("Read payload {}"), std::string_view{buf_payload, payload_read_sz}));
-			parser_.write({buf_payload, payload_read_sz});
+
+		template <class AsyncWritable>
+		awaitable<size_t> send(AsyncWritable& s, const msg_t& msg) {
+			out_.clear();
+			encode_frame(msg, out_, sr_);
+			return async_write(s, buffer(out_), asio::use_awaitable);
+		}
+
+		/**
+		 * Sends first along with the messages queued behind it, up to
+		 * msg_batch_max, in one write. take() gives the next queued message
+		 * without waiting, nullopt if there is none. Messages are counted
+		 * as sent once handed to the write.
+		 */
+		template <class AsyncWritable, class Take>
+		awaitable<size_t> send_batch(AsyncWritable& s, msg_t first, Take take) {
+			out_.clear();
+			size_t n = 0;
+			msg_t m = move(first);
+			for (;;) {
+				encode_frame(m, out_, sr_);
+				if (++n >= msg_batch_max) {
+					break;
+				}
+				optional<msg_t> next = take();
+				if (!next) {
+					break;
+				}
+				m = move(*next);
+			}
+			stats::ctrl_msgs_sent.add(static_cast<int64_t>(n));
+			stats::ctrl_msg_writes.add(1);
+			return async_write(s, buffer(out_), asio::use_awaitable);
+		}
+	};
+
+	// for one-off messages, like hellos, the message owns its memory
+	template <class AsyncReadable>
+	awaitable<msg_t> recv_msg(AsyncReadable& s) {
+		msg_codec codec;
+		msg_t msg = co_await codec.recv(s);
+		if (msg.bin_type_ == 0) {
+			co_return msg_t{json::value(msg.jv_, json::storage_ptr())};
 		}
-		msg.jv_ = move(parser_.release());
 		co_return move(msg);
 	}
 
-#if 0
-	awaitable<void> send_msg(tcp::socket& s, const msg_t& msg) {
-#else
-	template <class AsyncReadable>
-	awaitable<void> send_msg(AsyncReadable& s, const msg_t& msg) {
-#endif
-		string str = json::serialize(msg.jv_);
-		uint64_t len = static_cast<uint64_t>(str.size());
-		char buf_meta[8];
-		put_uint64<endian::big>(span<char, 8>{buf_meta, 8}, len);
-		co_await async_write(s, array<asio::const_buffer, 2>{buffer(buf_meta), buffer(str)}, asio::use_awaitable);
+	template <class AsyncWritable>
+	awaitable<void> send_msg(AsyncWritable& s, const msg_t& msg) {
+		string out;
+		json::serializer sr;
+		encode_frame(msg, out, sr);
+		co_await async_write(s, buffer(out), asio::use_awaitable);
 	}
 
 	namespace msg
@@ -130,11 +338,99 @@ namespace zrp {
 	template <class msg>
 	class msg_type_id;
 
+	// ids from 1 to 127, for messages having a binary form
+	template <class msg>
+	struct msg_bin_id;
+
+	template <class msg>
+	concept HasBinForm = requires {
+		msg_bin_id<msg>::v;
+	};
+
+	/**
+	 * Big endian integers and strings with a 2 byte length. Fields are only
+	 * ever appended to a binary form, so readers may check at_end() for
+	 * fields newer than the peer.
+	 */
+	struct bin_writer {
+		string &out_;
+
+		void u8(uint8_t v) {
+			out_.push_back(static_cast<char>(v));
+		}
+
+		void u16(uint16_t v) {
+			u8(static_cast<uint8_t>(v >> 8));
+			u8(static_cast<uint8_t>(v & 0xff));
+		}
+
+		void u32(uint32_t v) {
+			char b[4];
+			put_uint32<endian::big>(span<char, 4>{b, 4}, v);
+			out_.append(b, 4);
+		}
+
+		void u64(uint64_t v) {
+			char b[8];
+			put_uint64<endian::big>(span<char, 8>{b, 8}, v);
+			out_.append(b, 8);
+		}
+
+		void str(string_view v) {
+			if (v.size() > msg_size_max) {
+				throw exceptions::msg_too_big{v.size()};
+			}
+			u16(static_cast<uint16_t>(v.size()));
+			out_.append(v);
+		}
+	};
+
+	struct bin_reader {
+		string_view in_;
+		size_t pos_ = 0;
+
+		bool at_end() const noexcept {
+			return pos_ >= in_.size();
+		}
+
+		string_view take(size_t n) {
+			if (in_.size() - pos_ < n) {
+				throw exceptions::msg_truncated{in_.size()};
+			}
+			string_view ret = in_.substr(pos_, n);
+			pos_ += n;
+			return ret;
+		}
+
+		uint8_t u8() {
+			return static_cast<uint8_t>(take(1)[0]);
+		}
+
+		uint16_t u16() {
+			string_view b = take(2);
+			return static_cast<uint16_t>((static_cast<uint8_t>(b[0]) << 8) | static_cast<uint8_t>(b[1]));
+		}
+
+		uint32_t u32() {
+			return extract_uint32<endian::big>(span<const char, 4>{take(4).data(), 4});
+		}
+
+		uint64_t u64() {
+			return extract_uint64<endian::big>(span<const char, 8>{take(8).data(), 8});
+		}
+
+		string_view str() {
+			return take(u16());
+		}
+	};
+
 	// facets
 	
 	struct tcp_share {
 		string_view id;
 		unsigned short port;
+		int buffer_min; // 0 for the server default
+		int buffer_max;
 	};
 	
 	void tag_invoke(json::value_from_tag, json::value& jv, const tcp_share& c)
@@ -142,6 +438,8 @@ namespace zrp {
 		jv = {
 			{"id", c.id},
 			{"port", c.port},
+			{"buffer_min", c.buffer_min},
+			{"buffer_max", c.buffer_max},
 		};
 	}
 
@@ -151,6 +449,8 @@ namespace zrp {
 		json::object const& obj = jv.as_object();
 		extract(obj, ts.id, "id");
 		extract(obj, ts.port, "port");
+		extract_with_default(obj, ts.buffer_min, "buffer_min", 0);
+		extract_with_default(obj, ts.buffer_max, "buffer_max", 0);
 		return ts;
 	}
 
@@ -181,6 +481,8 @@ namespace zrp {
 	struct server_hello {
 		int version;
 		string_view welcome;
+		bool tunnels; // visits come over tunnel connections instead of workers
+		bool reuse_workers; // workers are kept as single stream tunnels across visits
 	};
 
 	void tag_invoke(json::value_from_tag, json::value& jv, const server_hello& c)
@@ -188,6 +490,8 @@ namespace zrp {
 		jv = {
 			{"version", c.version},
 			{"welcome", c.welcome},
+			{"tunnels", c.tunnels},
+			{"reuse_workers", c.reuse_workers},
 		};
 	}
 
@@ -197,6 +501,8 @@ namespace zrp {
 		json::object const& obj = jv.as_object();
 		extract(obj, sh.version, "version");
 		extract(obj, sh.welcome, "welcome");
+		extract_with_default(obj, sh.tunnels, "tunnels", false);
+		extract_with_default(obj, sh.reuse_workers, "reuse_workers", false);
 		return sh;
 	}
 
@@ -213,6 +519,12 @@ namespace zrp {
 		return {};
 	}
 
+	void put_bin(bin_writer& w, const pong& c) {}
+
+	pong get_bin(bin_reader& r, std::type_identity<pong>) {
+		return {};
+	}
+
 	struct visit_tcp_share {
 		uint64_t epoch;
 		tcp_endpoint peer;
@@ -235,17 +547,62 @@ namespace zrp {
 		return v;
 	}
 
+	void put_bin(bin_writer& w, const visit_tcp_share& c) {
+		w.u64(c.epoch);
+		w.str(c.peer.ip);
+		w.u16(c.peer.port);
+	}
+
+	visit_tcp_share get_bin(bin_reader& r, std::type_identity<visit_tcp_share>) {
+		visit_tcp_share v;
+		v.epoch = r.u64();
+		v.peer.ip = r.str();
+		v.peer.port = r.u16();
+		return v;
+	}
+
+
+	// carried by the open frame of a tunnel stream, not sent on its own
+	struct stream_open {
+		string_view tcp_share_id;
+		uint64_t epoch;
+		tcp_endpoint peer;
+	};
+
+	void tag_invoke(json::value_from_tag, json::value& jv, const stream_open& c)
+	{
+		jv = {
+			{"tcp_share_id", c.tcp_share_id},
+			{"epoch", c.epoch},
+			{"peer", c.peer},
+		};
+	}
+
+	stream_open tag_invoke(json::value_to_tag<stream_open>, const json::value& jv)
+	{
+		stream_open so;
+		json::object const& obj = jv.as_object();
+		extract(obj, so.tcp_share_id, "tcp_share_id");
+		extract(obj, so.epoch, "epoch");
+		extract(obj, so.peer, "peer");
+		return so;
+	}
 
 	template <> struct msg_type_id<server_hello> { inline static const string s = "server_hello"; };
 	template <> struct msg_type_id<pong> { inline static const string s = "pong"; };
 	template <> struct msg_type_id<visit_tcp_share> { inline static const string s = "visit_tcp_share"; };
 
+	template <> struct msg_bin_id<pong> { static const uint8_t v = 2; };
+	template <> struct msg_bin_id<visit_tcp_share> { static const uint8_t v = 3; };
+
 	// client -> server
 
 	struct client_hello {
 		int version;
 		string_view client_uuid;
 		vector<tcp_share> tcp_shares;
+		int tunnels; // tunnel connections the client would open, 0 for workers
+		bool reuse_workers;
 	};
 
 	void tag_invoke(json::value_from_tag, json::value& jv, const client_hello& c)
@@ -254,6 +611,8 @@ namespace zrp {
 			{"version", c.version},
 			{"client_uuid", c.client_uuid},
 			{"tcp_shares", c.tcp_shares},
+			{"tunnels", c.tunnels},
+			{"reuse_workers", c.reuse_workers},
 		};
 	}
 
@@ -264,12 +623,37 @@ namespace zrp {
 		extract(obj, ch.version, "version");
 		extract(obj, ch.client_uuid, "client_uuid");
 		extract(obj, ch.tcp_shares, "tcp_shares");
+		extract_with_default(obj, ch.tunnels, "tunnels", 0);
+		extract_with_default(obj, ch.reuse_workers, "reuse_workers", false);
 		return ch;
 	}
 
+	struct tunnel_hello {
+		string_view client_uuid;
+		int tunnel_id;
+	};
+
+	void tag_invoke(json::value_from_tag, json::value& jv, const tunnel_hello& c)
+	{
+		jv = {
+			{"client_uuid", c.client_uuid},
+			{"tunnel_id", c.tunnel_id},
+		};
+	}
+
+	tunnel_hello tag_invoke(json::value_to_tag<tunnel_hello>, const json::value& jv)
+	{
+		tunnel_hello th;
+		json::object const& obj = jv.as_object();
+		extract(obj, th.client_uuid, "client_uuid");
+		extract(obj, th.tunnel_id, "tunnel_id");
+		return th;
+	}
+
 	struct tcp_share_worker_hello {
 		string_view tcp_share_id;
 		int worker_id;
+		bool reuse; // the connection turns into a tunnel right after this
 	};
 
 	void tag_invoke(json::value_from_tag, json::value& jv, const tcp_share_worker_hello& c)
@@ -277,6 +661,7 @@ namespace zrp {
 		jv = {
 			{"tcp_share_id", c.tcp_share_id},
 			{"worker_id", c.worker_id},
+			{"reuse", c.reuse},
 		};
 	}
 
@@ -286,6 +671,7 @@ namespace zrp {
 		json::object const& obj = jv.as_object();
 		extract(obj, wr.tcp_share_id, "tcp_share_id");
 		extract(obj, wr.worker_id, "worker_id");
+		extract_with_default(obj, wr.reuse, "reuse", false);
 		return wr;
 	}
 
@@ -302,6 +688,12 @@ namespace zrp {
 		return {};
 	}
 
+	void put_bin(bin_writer& w, const ping& c) {}
+
+	ping get_bin(bin_reader& r, std::type_identity<ping>) {
+		return {};
+	}
+
 	struct visit_confirmed {
 	};
 
@@ -315,10 +707,117 @@ namespace zrp {
 		return {};
 	}
 
+	void put_bin(bin_writer& w, const visit_confirmed& c) {}
+
+	visit_confirmed get_bin(bin_reader& r, std::type_identity<visit_confirmed>) {
+		return {};
+	}
+
+	// sent by an idle worker that the client no longer needs, since version 5
+	// on the controller socket instead, naming the worker
+	struct worker_retire {
+		string_view tcp_share_id;
+		int worker_id = -1;
+	};
+
+	void tag_invoke(json::value_from_tag, json::value& jv, const worker_retire& c)
+	{
+		jv = {
+			{"tcp_share_id", c.tcp_share_id},
+			{"worker_id", c.worker_id},
+		};
+	}
+
+	worker_retire tag_invoke(json::value_to_tag<worker_retire>, const json::value& jv)
+	{
+		worker_retire wr;
+		json::object const& obj = jv.as_object();
+		extract_with_default(obj, wr.tcp_share_id, "tcp_share_id", string_view{});
+		extract_with_default(obj, wr.worker_id, "worker_id", -1);
+		return wr;
+	}
+
+	void put_bin(bin_writer& w, const worker_retire& c) {
+		w.str(c.tcp_share_id);
+		w.u32(static_cast<uint32_t>(c.worker_id));
+	}
+
+	worker_retire get_bin(bin_reader& r, std::type_identity<worker_retire>) {
+		worker_retire wr;
+		wr.tcp_share_id = r.str();
+		wr.worker_id = static_cast<int>(r.u32());
+		return wr;
+	}
+
+	// sent on the controller socket when visitors of a share wait for a worker
+	struct worker_demand {
+		string_view tcp_share_id;
+		int idle;
+		int waiting;
+	};
+
+	void tag_invoke(json::value_from_tag, json::value& jv, const worker_demand& c)
+	{
+		jv = {
+			{"tcp_share_id", c.tcp_share_id},
+			{"idle", c.idle},
+			{"waiting", c.waiting},
+		};
+	}
+
+	worker_demand tag_invoke(json::value_to_tag<worker_demand>, const json::value& jv)
+	{
+		worker_demand ret;
+		json::object const& obj = jv.as_object();
+		extract(obj, ret.tcp_share_id, "tcp_share_id");
+		extract(obj, ret.idle, "idle");
+		extract(obj, ret.waiting, "waiting");
+		return ret;
+	}
+
+	void put_bin(bin_writer& w, const worker_demand& c) {
+		w.str(c.tcp_share_id);
+		w.u32(static_cast<uint32_t>(c.idle));
+		w.u32(static_cast<uint32_t>(c.waiting));
+	}
+
+	worker_demand get_bin(bin_reader& r, std::type_identity<worker_demand>) {
+		worker_demand ret;
+		ret.tcp_share_id = r.str();
+		ret.idle = static_cast<int>(r.u32());
+		ret.waiting = static_cast<int>(r.u32());
+		return ret;
+	}
+
 	template <> struct msg_type_id<client_hello> { inline static const string s = "client_hello"; };
 	template <> struct msg_type_id<ping> { inline static const string s = "ping"; };
 	template <> struct msg_type_id<tcp_share_worker_hello> { inline static const string s = "tcp_share_worker_hello"; };
+	template <> struct msg_type_id<tunnel_hello> { inline static const string s = "tunnel_hello"; };
 	template <> struct msg_type_id<visit_confirmed> { inline static const string s = "visit_confirmed"; };
+	template <> struct msg_type_id<worker_retire> { inline static const string s = "worker_retire"; };
+	template <> struct msg_type_id<worker_demand> { inline static const string s = "worker_demand"; };
+
+	template <> struct msg_bin_id<ping> { static const uint8_t v = 1; };
+	template <> struct msg_bin_id<visit_confirmed> { static const uint8_t v = 4; };
+	template <> struct msg_bin_id<worker_retire> { static const uint8_t v = 5; };
+	template <> struct msg_bin_id<worker_demand> { static const uint8_t v = 6; };
+
+	template <class ReturningVariant>
+	ReturningVariant unmarshal_bin_impl(const msg_t& msg) {
+		// no expected msg type found
+		throw exceptions::unexpected_msg_type(fmt::format(FMT_COMPILE("binary {}"), static_cast<int>(msg.bin_type_)));
+	}
+
+	template <class ReturningVariant, class CurrExpecting, class... OtherExpecting>
+	ReturningVariant unmarshal_bin_impl(const msg_t& msg) {
+		if constexpr (HasBinForm<CurrExpecting>) {
+			if (msg.bin_type_ == msg_bin_id<CurrExpecting>::v) {
+				bin_reader r{msg.bin_};
+				return get_bin(r, std::type_identity<CurrExpecting>{});
+			}
+		}
+		return unmarshal_bin_impl<ReturningVariant, OtherExpecting...>(msg);
+	}
 
 	template <class ReturningVariant>
 	ReturningVariant unmarshal_msg_impl(string type_id, const msg_t& msg) {
@@ -336,14 +835,26 @@ namespace zrp {
 
 	template <class... Expecting>
 	variant<Expecting...> unmarshal_msg(const msg_t& msg) {
+		if (msg.bin_type_ != 0) {
+			return unmarshal_bin_impl<variant<Expecting...>, Expecting...>(msg);
+		}
 		string type_id;
 		extract(msg.jv_.as_object(), type_id, "msg_type");
 		return unmarshal_msg_impl<variant<Expecting...>, Expecting...>(type_id, msg);
 	}
 
+	// messages without a binary form go as json whatever the format
 	template <class Message>
-	msg_t marshal_msg(Message msg) {
+	msg_t marshal_msg(Message msg, msg_format f = msg_format::json) {
 		msg_t ret;
+		if constexpr (HasBinForm<Message>) {
+			if (f == msg_format::binary) {
+				ret.bin_type_ = msg_bin_id<Message>::v;
+				bin_writer w{ret.bin_};
+				put_bin(w, msg);
+				return ret;
+			}
+		}
 		ret.jv_ = json::value_from<Message>(move(msg));
 		ret.jv_.as_object()["msg_type"] = msg_type_id<Message>::s;
 		return ret;
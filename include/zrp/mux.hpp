@@ -0,0 +1,688 @@
+// SPDX-License-Identifier: BSL-1.0
+// copyleft 2021 youcai <omegacoleman@gmail.com>
+// Distributed under the Boost Software License, Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include "zrp/bindings.hpp"
+
+#include "zrp/completion_handler.hpp"
+#include "zrp/buffer_pool.hpp"
+#include "zrp/exceptions.hpp"
+#include "zrp/log.hpp"
+#include "zrp/msg.hpp"
+
+namespace zrp {
+
+	/**
+	 * A tunnel connection carries many streams. Every frame starts with a
+	 * 4 bytes stream id, a 1 byte frame type and a 4 bytes payload length,
+	 * all big endian, followed by the payload.
+	 */
+	enum class mux_frame_t : uint8_t {
+		open = 0, // server -> client, payload is a json msg::stream_open
+		data = 1,
+		fin = 2, // no more data in this direction
+		reset = 3, // stream aborted in both directions
+		window = 4, // payload is a 4 bytes increment of the send window
+		ping = 5,
+		pong = 6,
+		goaway = 7, // sender takes no new streams, close once the last one is done
+	};
+
+	const size_t mux_header_size = 9;
+	const size_t mux_frame_max = 65536;
+	const size_t mux_control_frame_max = 8192;
+	const size_t mux_initial_window = 262144;
+	const size_t mux_window_max = 16 * 1024 * 1024;
+
+	inline size_t check_tunnel_window(int window) {
+		if (window < static_cast<int>(mux_initial_window) || window > static_cast<int>(mux_window_max)) {
+			throw exceptions::bad_config_value{"tunnel_window", fmt::format(FMT_COMPILE("{}"), window)};
+		}
+		return static_cast<size_t>(window);
+	}
+
+	using mux_waiter_t = completion_handler<void(error_code)>;
+
+	/**
+	 * Suspends until ready() holds. ready() is checked with mtx held, and
+	 * whoever makes it hold calls mux_wake() on the same slot, also with
+	 * mtx held.
+	 */
+	template <class Ready>
+	awaitable<void> mux_wait(mutex &mtx, mux_waiter_t &slot, Ready ready) {
+		auto initiation = [&mtx, &slot, ready](auto&& handler) mutable {
+			mux_waiter_t h{forward<decltype(handler)>(handler)};
+			lock_guard lk{mtx};
+			if (ready()) {
+				h({}); // posted, so fine under the lock
+			} else {
+				slot = move(h);
+			}
+		};
+		return asio::async_initiate<decltype(asio::use_awaitable), void(error_code)>(initiation, asio::use_awaitable);
+	}
+
+	inline void mux_wake(mux_waiter_t &slot) {
+		if (slot.ptr_) {
+			auto h = move(slot);
+			h({});
+		}
+	}
+
+	struct mux_tunnel;
+
+	struct mux_stream {
+		weak_ptr<mux_tunnel> tunnel_;
+		uint32_t id_;
+		size_t recv_window_;
+
+		mutex mtx_;
+		deque<tuple<pooled_buffer, size_t>> recv_q_;
+		size_t recv_outstanding_ = 0; // received but not yet handed back as window
+		size_t recv_consumed_ = 0;
+		size_t last_chunk_ = 0;
+		size_t send_window_ = mux_initial_window;
+		bool recv_fin_ = false;
+		bool send_fin_ = false;
+		bool reset_ = false;
+		bool closed_ = false;
+		mux_waiter_t read_waiter_;
+		mux_waiter_t write_waiter_;
+
+		mux_stream(weak_ptr<mux_tunnel> tunnel, uint32_t id, size_t recv_window)
+			: tunnel_(move(tunnel)), id_(id), recv_window_(recv_window) {}
+
+		// false if the peer overran the window
+		bool on_data(pooled_buffer buf, size_t n) {
+			lock_guard lk{mtx_};
+			if (recv_outstanding_ + n > recv_window_) {
+				return false;
+			}
+			recv_outstanding_ += n;
+			recv_q_.emplace_back(move(buf), n);
+			mux_wake(read_waiter_);
+			return true;
+		}
+
+		void on_fin() {
+			lock_guard lk{mtx_};
+			recv_fin_ = true;
+			mux_wake(read_waiter_);
+		}
+
+		void on_window(size_t inc) {
+			lock_guard lk{mtx_};
+			send_window_ += inc;
+			mux_wake(write_waiter_);
+		}
+
+		void on_reset() {
+			lock_guard lk{mtx_};
+			reset_ = true;
+			recv_q_.clear();
+			mux_wake(read_waiter_);
+			mux_wake(write_waiter_);
+		}
+
+		// with mtx_ held
+		void throw_if_broken() const {
+			if (closed_) {
+				throw system_error{asio::error::operation_aborted};
+			}
+			if (reset_) {
+				throw system_error{asio::error::connection_reset};
+			}
+		}
+	};
+
+	/**
+	 * One end of a tunnel stream, owned by a pipe like a socket would be.
+	 * Dropping it before both sides finished resets the stream.
+	 */
+	struct mux_socket {
+		shared_ptr<mux_stream> st_;
+
+		mux_socket() = default;
+		mux_socket(shared_ptr<mux_stream> st) noexcept
+			: st_(move(st)) {}
+		mux_socket(mux_socket&&) = default;
+		mux_socket& operator=(mux_socket&& o) noexcept {
+			close();
+			st_ = move(o.st_);
+			return *this;
+		}
+		~mux_socket() {
+			close();
+		}
+
+		bool is_open() const noexcept {
+			return static_cast<bool>(st_);
+		}
+
+		void close() noexcept;
+
+		/**
+		 * Next chunk of received data. Hands the window of the previous chunk
+		 * back first, as the caller is done with it by now. Throws eof once
+		 * the peer finished sending.
+		 */
+		awaitable<tuple<pooled_buffer, size_t>> read_chunk();
+
+		// waits for some send window, returns how much
+		awaitable<size_t> wait_writable();
+
+		// n must fit in the window from wait_writable(), returns what is left
+		size_t write(pooled_buffer buf, size_t n);
+
+		void shutdown_send();
+	};
+
+	/**
+	 * A tunnel connection between zclient and zserver. Frames are demuxed by
+	 * a reader coroutine and written in batches by a writer coroutine, both
+	 * on a strand of the forwarder thread pool. Streams are only opened by
+	 * the server side.
+	 */
+	struct mux_tunnel : enable_shared_from_this<mux_tunnel> {
+		using open_handler_t = function<void(mux_socket, string)>;
+		using idle_handler_t = function<void()>;
+
+		struct frame {
+			array<char, mux_header_size> hdr_;
+			pooled_buffer data_;
+			string str_;
+			size_t len_ = 0;
+		};
+
+		asio::io_context &ioc_;
+		asio::strand<asio::io_context::executor_type> str_;
+		tcp::socket s_;
+		size_t recv_window_;
+		bool keepalive_;
+		open_handler_t on_open_;
+		idle_handler_t on_idle_; // set before run(), called whenever the last stream is gone
+		log::logger logger_;
+
+		mutex mtx_;
+		map<uint32_t, weak_ptr<mux_stream>> streams_;
+		uint32_t next_stream_id_ = 1;
+		deque<frame> send_q_;
+		mux_waiter_t send_waiter_;
+		mux_waiter_t closed_waiter_;
+		bool stopping_ = false;
+		bool draining_ = false; // we sent a goaway
+		bool peer_draining_ = false; // the peer sent one
+
+		steady_timer ddl_;
+		steady_timer ping_timer_;
+
+		mux_tunnel(asio::io_context &ioc, tcp::socket s, log::tag_tunnel tag, size_t recv_window, bool keepalive, open_handler_t on_open)
+			: ioc_(ioc), str_(asio::make_strand(ioc)), s_(move(s)), recv_window_(recv_window), keepalive_(keepalive), on_open_(move(on_open)), logger_(tag), ddl_(ioc), ping_timer_(ioc)
+		{}
+
+		static shared_ptr<mux_tunnel> create(asio::io_context &ioc, tcp::socket s, log::tag_tunnel tag, size_t recv_window, bool keepalive, open_handler_t on_open = {}) {
+			return make_shared<mux_tunnel>(ioc, move(s), move(tag), recv_window, keepalive, move(on_open));
+		}
+
+		size_t nr_streams() {
+			lock_guard lk{mtx_};
+			return streams_.size();
+		}
+
+		void run() {
+			auto sg = this->shared_from_this();
+			co_spawn(str_, [this, sg]() mutable -> awaitable<void> {
+				co_await recv_frames();
+			}, asio::detached);
+			co_spawn(str_, [this, sg]() mutable -> awaitable<void> {
+				co_await send_frames();
+			}, asio::detached);
+			co_spawn(str_, [this, sg]() mutable -> awaitable<void> {
+				co_await ddl_actor();
+			}, asio::detached);
+			if (keepalive_) {
+				co_spawn(str_, [this, sg]() mutable -> awaitable<void> {
+					co_await ping_actor();
+				}, asio::detached);
+			}
+		}
+
+		// may be called from any thread
+		void try_stop() noexcept {
+			vector<shared_ptr<mux_stream>> streams;
+			{
+				lock_guard lk{mtx_};
+				if (stopping_) {
+					return;
+				}
+				stopping_ = true;
+				for (auto& it : streams_) {
+					if (auto st = it.second.lock()) {
+						streams.emplace_back(move(st));
+					}
+				}
+				streams_.clear();
+				send_q_.clear();
+				mux_wake(send_waiter_);
+				mux_wake(closed_waiter_);
+			}
+			for (auto& st : streams) {
+				st->on_reset();
+			}
+			auto sg = this->shared_from_this();
+			asio::post(str_, [this, sg]() {
+				try {
+					s_.close();
+				} catch (...) {}
+				try {
+					ddl_.cancel();
+					ping_timer_.cancel();
+				} catch (...) {}
+			});
+		}
+
+		void handle_error(const exception& e) noexcept {
+			bool stopping;
+			{
+				lock_guard lk{mtx_};
+				stopping = stopping_ || draining_; // after a goaway the peer closes on us
+			}
+			if (!stopping) {
+				logger_.error("got an exception, stopping : ").with_exception(e);
+				try_stop();
+			} else {
+				logger_.trace("exited by exception : ").with_exception(e);
+			}
+		}
+
+		awaitable<void> wait_closed() {
+			return mux_wait(mtx_, closed_waiter_, [this]() {
+				return stopping_;
+			});
+		}
+
+		mux_socket open_stream(string payload) {
+			shared_ptr<mux_stream> st;
+			{
+				lock_guard lk{mtx_};
+				if (stopping_) {
+					throw system_error{asio::error::not_connected};
+				}
+				uint32_t id = next_stream_id_++;
+				st = make_shared<mux_stream>(this->weak_from_this(), id, recv_window_);
+				streams_.emplace(id, st);
+				push_frame(id, mux_frame_t::open, {}, move(payload));
+			}
+			grow_window(*st);
+			return {move(st)};
+		}
+
+		void send_frame(uint32_t id, mux_frame_t type, pooled_buffer data, size_t len) {
+			lock_guard lk{mtx_};
+			if (!stopping_) {
+				push_frame(id, type, move(data), {}, len);
+			}
+		}
+
+		void send_frame(uint32_t id, mux_frame_t type, string payload = {}) {
+			lock_guard lk{mtx_};
+			if (!stopping_) {
+				push_frame(id, type, {}, move(payload));
+			}
+		}
+
+		void send_window(uint32_t id, size_t inc) {
+			string payload(4, '\0');
+			put_uint32<endian::big>(span<char, 4>{payload.data(), 4}, static_cast<uint32_t>(inc));
+			send_frame(id, mux_frame_t::window, move(payload));
+		}
+
+		void remove_stream(uint32_t id, bool reset) {
+			bool idle;
+			bool drained;
+			{
+				lock_guard lk{mtx_};
+				bool erased = streams_.erase(id) > 0;
+				if (reset && !stopping_) {
+					push_frame(id, mux_frame_t::reset, {}, {});
+				}
+				idle = erased && streams_.empty() && !stopping_;
+				drained = idle && peer_draining_;
+			}
+			if (drained) {
+				try_stop();
+			} else if (idle && on_idle_) {
+				on_idle_();
+			}
+		}
+
+		// may be called from any thread
+		void goaway() {
+			lock_guard lk{mtx_};
+			if (!stopping_ && !draining_) {
+				draining_ = true;
+				push_frame(0, mux_frame_t::goaway, {}, {});
+			}
+		}
+
+		// no new streams should be opened on a draining tunnel
+		bool draining() {
+			lock_guard lk{mtx_};
+			return stopping_ || draining_ || peer_draining_;
+		}
+
+	private:
+		// with mtx_ held
+		void push_frame(uint32_t id, mux_frame_t type, pooled_buffer data, string str, size_t len = 0) {
+			frame f;
+			f.len_ = data.data() ? len : str.size();
+			put_uint32<endian::big>(span<char, 4>{f.hdr_.data(), 4}, id);
+			f.hdr_[4] = static_cast<char>(type);
+			put_uint32<endian::big>(span<char, 4>{f.hdr_.data() + 5, 4}, static_cast<uint32_t>(f.len_));
+			f.data_ = move(data);
+			f.str_ = move(str);
+			send_q_.emplace_back(move(f));
+			mux_wake(send_waiter_);
+		}
+
+		// the window starts at mux_initial_window on both sides, so a larger
+		// one is announced right away
+		void grow_window(const mux_stream &st) {
+			if (recv_window_ > mux_initial_window) {
+				send_window(st.id_, recv_window_ - mux_initial_window);
+			}
+		}
+
+		shared_ptr<mux_stream> find_stream(uint32_t id) {
+			lock_guard lk{mtx_};
+			auto it = streams_.find(id);
+			if (it == streams_.end()) {
+				return {};
+			}
+			return it->second.lock();
+		}
+
+		awaitable<string> recv_payload(size_t len) {
+			if (len > mux_control_frame_max) {
+				throw exceptions::tunnel_protocol_error{fmt::format(FMT_COMPILE("control frame of {} bytes"), len)};
+			}
+			string ret(len, '\0');
+			if (len > 0) {
+				co_await async_read(s_, buffer(ret), asio::use_awaitable);
+			}
+			co_return move(ret);
+		}
+
+		awaitable<void> recv_frames() {
+			try {
+				for (;;) {
+					ddl_.expires_after(chrono::seconds{60});
+					array<char, mux_header_size> hdr;
+					co_await async_read(s_, buffer(hdr), asio::use_awaitable);
+					uint32_t id = extract_uint32<endian::big>(span<const char, 4>{hdr.data(), 4});
+					auto type = static_cast<mux_frame_t>(static_cast<uint8_t>(hdr[4]));
+					size_t len = extract_uint32<endian::big>(span<const char, 4>{hdr.data() + 5, 4});
+
+					switch (type) {
+						case mux_frame_t::data: {
+							if (len > mux_frame_max) {
+								throw exceptions::tunnel_protocol_error{fmt::format(FMT_COMPILE("data frame of {} bytes"), len)};
+							}
+							pooled_buffer buf = buffer_pool::local().acquire(len);
+							co_await async_read(s_, buffer(buf.data(), len), asio::use_awaitable);
+							if (auto st = find_stream(id)) {
+								if (!st->on_data(move(buf), len)) {
+									logger_.warning(FMT_COMPILE("stream {} overran its window, resetting"), id);
+									st->on_reset();
+									remove_stream(id, true);
+								}
+							}
+							break;
+						}
+						case mux_frame_t::open: {
+							string payload = co_await recv_payload(len);
+							if (!on_open_) {
+								throw exceptions::tunnel_protocol_error{"unexpected open frame"};
+							}
+							auto st = make_shared<mux_stream>(this->weak_from_this(), id, recv_window_);
+							{
+								lock_guard lk{mtx_};
+								streams_.emplace(id, st);
+							}
+							grow_window(*st);
+							on_open_(mux_socket{move(st)}, move(payload));
+							break;
+						}
+						case mux_frame_t::fin: {
+							co_await recv_payload(len);
+							if (auto st = find_stream(id)) {
+								st->on_fin();
+							}
+							break;
+						}
+						case mux_frame_t::reset: {
+							co_await recv_payload(len);
+							if (auto st = find_stream(id)) {
+								st->on_reset();
+							}
+							remove_stream(id, false);
+							break;
+						}
+						case mux_frame_t::window: {
+							string payload = co_await recv_payload(len);
+							if (payload.size() != 4) {
+								throw exceptions::tunnel_protocol_error{"bad window frame"};
+							}
+							if (auto st = find_stream(id)) {
+								st->on_window(extract_uint32<endian::big>(span<const char, 4>{payload.data(), 4}));
+							}
+							break;
+						}
+						case mux_frame_t::ping: {
+							co_await recv_payload(len);
+							send_frame(0, mux_frame_t::pong);
+							break;
+						}
+						case mux_frame_t::pong: {
+							co_await recv_payload(len);
+							logger_.trace("recv a pong");
+							break;
+						}
+						case mux_frame_t::goaway: {
+							co_await recv_payload(len);
+							logger_.trace("recv a goaway");
+							bool idle;
+							{
+								lock_guard lk{mtx_};
+								peer_draining_ = true;
+								idle = streams_.empty();
+							}
+							if (idle) {
+								try_stop();
+							}
+							break;
+						}
+						default:
+							throw exceptions::tunnel_protocol_error{fmt::format(FMT_COMPILE("unknown frame type {}"), static_cast<int>(type))};
+					}
+				}
+			} catch (const exception& e) {
+				handle_error(e);
+			}
+		}
+
+		awaitable<void> send_frames() {
+			try {
+				deque<frame> batch;
+				vector<asio::const_buffer> bufs;
+				for (;;) {
+					co_await mux_wait(mtx_, send_waiter_, [this]() {
+						return stopping_ || !send_q_.empty();
+					});
+					{
+						lock_guard lk{mtx_};
+						if (stopping_) {
+							break;
+						}
+						batch.swap(send_q_);
+					}
+					bufs.clear();
+					for (auto& f : batch) {
+						bufs.emplace_back(buffer(f.hdr_));
+						if (f.len_ > 0) {
+							bufs.emplace_back(f.data_.data() ? buffer(f.data_.data(), f.len_) : buffer(f.str_));
+						}
+					}
+					co_await async_write(s_, bufs, asio::use_awaitable);
+					batch.clear();
+				}
+			} catch (const exception& e) {
+				handle_error(e);
+			}
+		}
+
+		awaitable<void> ddl_actor() {
+			try {
+				for (;;) {
+					try {
+						co_await ddl_.async_wait(asio::use_awaitable);
+					} catch (const system_error & se) {
+						if (se.code() != asio::error::operation_aborted) {
+							throw;
+						}
+					}
+					{
+						lock_guard lk{mtx_};
+						if (stopping_) {
+							co_return;
+						}
+					}
+					if (ddl_.expiry() <= steady_timer::clock_type::now()) {
+						logger_.warning("timeout exceeded : recv_frames()");
+						try_stop();
+						co_return;
+					}
+				}
+			} catch (const exception& e) {
+				handle_error(e);
+			}
+		}
+
+		awaitable<void> ping_actor() {
+			try {
+				for (;;) {
+					ping_timer_.expires_after(chrono::seconds{20});
+					co_await ping_timer_.async_wait(asio::use_awaitable);
+					send_frame(0, mux_frame_t::ping);
+					logger_.trace("sent a ping");
+				}
+			} catch (const system_error & se) {
+				if (se.code() != asio::error::operation_aborted) {
+					handle_error(se);
+				}
+			}
+		}
+	};
+
+	inline void mux_socket::close() noexcept {
+		if (!st_) {
+			return;
+		}
+		auto st = move(st_);
+		bool clean;
+		{
+			lock_guard lk{st->mtx_};
+			clean = (st->send_fin_ && st->recv_fin_) || st->reset_;
+			st->closed_ = true;
+			st->recv_q_.clear();
+			mux_wake(st->read_waiter_);
+			mux_wake(st->write_waiter_);
+		}
+		if (auto t = st->tunnel_.lock()) {
+			t->remove_stream(st->id_, !clean);
+		}
+	}
+
+	inline awaitable<tuple<pooled_buffer, size_t>> mux_socket::read_chunk() {
+		auto st = st_;
+		if (!st) {
+			throw system_error{asio::error::bad_descriptor};
+		}
+		size_t credit = 0;
+		{
+			lock_guard lk{st->mtx_};
+			st->recv_consumed_ += st->last_chunk_;
+			st->last_chunk_ = 0;
+			if (st->recv_consumed_ >= st->recv_window_ / 2) {
+				credit = st->recv_consumed_;
+				st->recv_outstanding_ -= credit;
+				st->recv_consumed_ = 0;
+			}
+		}
+		if (credit > 0) {
+			if (auto t = st->tunnel_.lock()) {
+				t->send_window(st->id_, credit);
+			}
+		}
+		co_await mux_wait(st->mtx_, st->read_waiter_, [&st]() {
+			return !st->recv_q_.empty() || st->recv_fin_ || st->reset_ || st->closed_;
+		});
+		lock_guard lk{st->mtx_};
+		st->throw_if_broken();
+		if (st->recv_q_.empty()) {
+			throw system_error{asio::error::eof};
+		}
+		auto ret = move(st->recv_q_.front());
+		st->recv_q_.pop_front();
+		st->last_chunk_ = std::get<1>(ret);
+		co_return move(ret);
+	}
+
+	inline awaitable<size_t> mux_socket::wait_writable() {
+		auto st = st_;
+		if (!st) {
+			throw system_error{asio::error::bad_descriptor};
+		}
+		co_await mux_wait(st->mtx_, st->write_waiter_, [&st]() {
+			return st->send_window_ > 0 || st->reset_ || st->closed_;
+		});
+		lock_guard lk{st->mtx_};
+		st->throw_if_broken();
+		co_return st->send_window_;
+	}
+
+	inline size_t mux_socket::write(pooled_buffer buf, size_t n) {
+		size_t left;
+		{
+			lock_guard lk{st_->mtx_};
+			st_->throw_if_broken();
+			st_->send_window_ -= n;
+			left = st_->send_window_;
+		}
+		auto t = st_->tunnel_.lock();
+		if (!t) {
+			throw system_error{asio::error::connection_reset};
+		}
+		t->send_frame(st_->id_, mux_frame_t::data, move(buf), n);
+		return left;
+	}
+
+	inline void mux_socket::shutdown_send() {
+		if (!st_) {
+			return;
+		}
+		{
+			lock_guard lk{st_->mtx_};
+			if (st_->send_fin_ || st_->reset_ || st_->closed_) {
+				return;
+			}
+			st_->send_fin_ = true;
+		}
+		if (auto t = st_->tunnel_.lock()) {
+			t->send_frame(st_->id_, mux_frame_t::fin);
+		}
+	}
+
+}
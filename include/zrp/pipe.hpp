@@ -9,10 +9,213 @@
 #include "zrp/concepts.hpp"
 #include "zrp/completion_handler.hpp"
 #include "zrp/log.hpp"
+#include "zrp/exceptions.hpp"
+#include "zrp/stats.hpp"
+#include "zrp/buffer_pool.hpp"
+#include "zrp/kernel_pipe.hpp"
+#include "zrp/uring.hpp"
+#include "zrp/mux.hpp"
+#include "zrp/registry.hpp"
+#include "zrp/access_log.hpp"
 
 namespace zrp {
 
 	const size_t pipe_buffer_size = 8192;
+	const size_t pipe_buffer_max_size = 262144;
+	const int pipe_pipeline_depth_max = 64;
+
+	enum class pipe_engine_t {
+		copy,
+		splice,
+		io_uring,
+	};
+
+	inline string to_string(const pipe_engine_t &e) {
+		switch (e) {
+			case pipe_engine_t::copy:
+				return "copy";
+			case pipe_engine_t::splice:
+				return "splice";
+			case pipe_engine_t::io_uring:
+				return "io_uring";
+		}
+		return "invalid";
+	}
+
+	inline pipe_engine_t pipe_engine_from_string(const string_view s) {
+		if (s == "copy") {
+			return pipe_engine_t::copy;
+		} else if (s == "splice") {
+			return pipe_engine_t::splice;
+		} else if (s == "io_uring") {
+			return pipe_engine_t::io_uring;
+		}
+		throw exceptions::bad_config_value{"pipe_engine", string{s}};
+	}
+
+	struct pipe_options {
+		pipe_engine_t engine = pipe_engine_t::copy;
+		size_t buffer_min = pipe_buffer_size;
+		size_t buffer_max = pipe_buffer_max_size;
+		size_t pipeline_depth = 1;
+	};
+
+	/**
+	 * Read size of one pipe direction. Doubles when reads keep filling the
+	 * buffer, halves when they keep coming back small, so bulk transfers
+	 * get big reads and interactive ones stay small.
+	 */
+	struct adaptive_read_size {
+		size_t min_;
+		size_t max_;
+		size_t curr_;
+		int full_streak_ = 0;
+		int small_streak_ = 0;
+
+		adaptive_read_size(size_t min, size_t max) noexcept
+			: min_(min), max_(std::max(min, max)), curr_(min) {}
+
+		size_t get() const noexcept {
+			return curr_;
+		}
+
+		void update(size_t n) noexcept {
+			if (n >= curr_) {
+				small_streak_ = 0;
+				if (++full_streak_ >= 2 && curr_ < max_) {
+					curr_ = std::min(curr_ * 2, max_);
+					full_streak_ = 0;
+				}
+			} else if (n < curr_ / 4) {
+				full_streak_ = 0;
+				if (++small_streak_ >= 2 && curr_ > min_) {
+					curr_ = std::max(curr_ / 2, min_);
+					small_streak_ = 0;
+				}
+			} else {
+				full_streak_ = 0;
+				small_streak_ = 0;
+			}
+		}
+	};
+
+	inline pipe_options with_buffer_limits(pipe_options base, int buffer_min, int buffer_max) {
+		if (buffer_min <= 0) {
+			throw exceptions::bad_config_value{"pipe_buffer_min", fmt::format(FMT_COMPILE("{}"), buffer_min)};
+		}
+		if (buffer_max < buffer_min) {
+			throw exceptions::bad_config_value{"pipe_buffer_max", fmt::format(FMT_COMPILE("{} (less than pipe_buffer_min)"), buffer_max)};
+		}
+		base.buffer_min = static_cast<size_t>(buffer_min);
+		base.buffer_max = static_cast<size_t>(buffer_max);
+		return base;
+	}
+
+	inline pipe_options with_pipeline_depth(pipe_options base, int depth) {
+		if (depth < 1 || depth > pipe_pipeline_depth_max) {
+			throw exceptions::bad_config_value{"pipe_pipeline_depth", fmt::format(FMT_COMPILE("{}"), depth)};
+		}
+		base.pipeline_depth = static_cast<size_t>(depth);
+		return base;
+	}
+
+	/**
+	 * Writes chunks to a socket one after another in the background, so the
+	 * reading side can go on while a write is still in flight. At most depth
+	 * chunks are queued, push() suspends the reader past that. Everything
+	 * runs on the strand of the reading coroutine.
+	 */
+	template <class WriteSocket>
+	struct pipe_write_queue : enable_shared_from_this<pipe_write_queue<WriteSocket>> {
+		WriteSocket &write_s_;
+		shared_ptr<void> owner_;
+		asio::any_io_executor exec_;
+		size_t depth_;
+		deque<tuple<pooled_buffer, size_t>> chunks_;
+		bool writing_ = false;
+		error_code ec_;
+		completion_handler<void(error_code)> waiter_;
+		function<void()> on_error_; // for a reader not waiting on the queue
+
+		pipe_write_queue(WriteSocket &write_s, shared_ptr<void> owner, asio::any_io_executor exec, size_t depth)
+			: write_s_(write_s), owner_(move(owner)), exec_(move(exec)), depth_(depth)
+		{}
+
+		awaitable<void> push(pooled_buffer buf, size_t n) {
+			if (ec_) {
+				throw system_error{ec_};
+			}
+			chunks_.emplace_back(move(buf), n);
+			if (!writing_) {
+				write_front();
+			}
+			while (chunks_.size() >= depth_ && !ec_) {
+				co_await wait();
+			}
+		}
+
+		awaitable<void> drain() {
+			while (!chunks_.empty() && !ec_) {
+				co_await wait();
+			}
+			if (ec_) {
+				throw system_error{ec_};
+			}
+		}
+
+	private:
+		void write_front() {
+			writing_ = true;
+			auto &[buf, n] = chunks_.front();
+			async_write(write_s_, buffer(buf.data(), n), asio::bind_executor(exec_,
+				[this, self = this->shared_from_this()](error_code ec, size_t) {
+					chunks_.pop_front();
+					writing_ = false;
+					if (ec) {
+						ec_ = ec;
+						chunks_.clear();
+						if (on_error_) {
+							on_error_();
+						}
+					} else if (!chunks_.empty()) {
+						write_front();
+					}
+					wake();
+				}));
+		}
+
+		awaitable<void> wait() {
+			auto initiation = [this](auto&& handler) mutable {
+				waiter_ = completion_handler<void(error_code)>{forward<decltype(handler)>(handler)};
+			};
+			return asio::async_initiate<decltype(asio::use_awaitable), void(error_code)>(initiation, asio::use_awaitable);
+		}
+
+		void wake() {
+			if (waiter_.ptr_) {
+				auto h = move(waiter_);
+				h({});
+			}
+		}
+	};
+
+	inline pipe_options load_pipe_options(const string_view engine) {
+		pipe_options ret;
+		ret.engine = pipe_engine_from_string(engine);
+#ifndef ZRP_HAS_SPLICE
+		if (ret.engine == pipe_engine_t::splice) {
+			log::as(log::tag_main{}).warning("splice is only available on linux, using copy pipe engine instead");
+			ret.engine = pipe_engine_t::copy;
+		}
+#endif
+#ifndef ZRP_HAS_IO_URING
+		if (ret.engine == pipe_engine_t::io_uring) {
+			log::as(log::tag_main{}).warning("io_uring is only available on linux, using copy pipe engine instead");
+			ret.engine = pipe_engine_t::copy;
+		}
+#endif
+		return ret;
+	}
 
 	template <class Upstream, class Downstream>
 		requires IsUpstream<Upstream> && IsDownstream<Downstream>
@@ -22,25 +225,73 @@ namespace zrp {
 		requires IsUpstream<Upstream> && IsDownstream<Downstream>
 	struct pipe : enable_shared_from_this<pipe<Upstream, Downstream>> {
 		using forwarder_ptr_t = shared_ptr<forwarder<Upstream, Downstream>>;
+		using lhs_socket_t = socket_of_t<Downstream>;
+		using rhs_socket_t = socket_of_t<Upstream>;
+		static constexpr bool stream_sockets_only = IsStreamSocket<lhs_socket_t> && IsStreamSocket<rhs_socket_t>;
 
 		asio::io_context &exec_;
+		asio::strand<asio::io_context::executor_type> strand_; // both directions and try_stop run on it
 		int id_;
-		tcp::socket lhs_s_;
-		tcp::socket rhs_s_;
+		lhs_socket_t lhs_s_;
+		rhs_socket_t rhs_s_;
 		forwarder_ptr_t fwd_;
-		bool stopping_ = false;
+		typename sharded_registry<pipe>::handle registered_; // in fwd_->pipes_
+		atomic<bool> stopping_ = false; // also read by io_uring directions, which run off strand_
 		log::logger logger_;
 
-		pipe(asio::io_context &exec, forwarder_ptr_t fwd, int id, tcp::socket lhs_s, tcp::socket rhs_s)
-			: exec_(exec), fwd_(fwd), id_(id), lhs_s_(move(lhs_s)), rhs_s_(move(rhs_s)), logger_(log::tag_pipe{fwd->name_, id}) {}
+		// for the access log, [0] is the downstream side reading, [1] the upstream side
+		tcp::endpoint peer_;
+		chrono::steady_clock::time_point opened_at_ = chrono::steady_clock::now();
+		uint64_t bytes_[2] = {0, 0};
+		access_log::close_reason reasons_[2] = {access_log::close_reason::closed, access_log::close_reason::closed};
+
+		// raw fds, only set when the sockets are handed over to io_uring
+		int lhs_fd_ = -1;
+		int rhs_fd_ = -1;
 
-		static shared_ptr<pipe<Upstream, Downstream>> create(asio::io_context &exec, forwarder_ptr_t fwd, int id, tcp::socket lhs_s, tcp::socket rhs_s)
+		pipe(asio::io_context &exec, forwarder_ptr_t fwd, int id, lhs_socket_t lhs_s, rhs_socket_t rhs_s)
+			: exec_(exec), strand_(asio::make_strand(exec)), fwd_(fwd), id_(id), lhs_s_(move(lhs_s)), rhs_s_(move(rhs_s)), logger_(log::tag_pipe{fwd->name_, id})
+		{
+			stats::pipes.add(1);
+			stats::pipes_bytes.add(sizeof(*this));
+		}
+
+		static shared_ptr<pipe<Upstream, Downstream>> create(asio::io_context &exec, forwarder_ptr_t fwd, int id, lhs_socket_t lhs_s, rhs_socket_t rhs_s)
 		{
 			return make_shared<pipe<Upstream, Downstream>>(exec, fwd, id, move(lhs_s), move(rhs_s));
 		}
 
+		~pipe() {
+			fwd_->pipes_.remove(registered_);
+			if (fwd_->access_log_) {
+				fwd_->access_log_->append(access_record());
+			}
+			stats::pipes.sub(1);
+			stats::pipes_bytes.sub(sizeof(*this));
+#ifdef ZRP_HAS_IO_URING
+			if (lhs_fd_ >= 0)
+				::close(lhs_fd_);
+			if (rhs_fd_ >= 0)
+				::close(rhs_fd_);
+#endif
+		}
+
+		// from any thread, the sockets are closed on strand_
 		void try_stop() noexcept {
 			stopping_ = true;
+			asio::dispatch(strand_, [this, sg = this->shared_from_this()]() {
+				close_sockets();
+			});
+		}
+
+		void close_sockets() noexcept {
+#ifdef ZRP_HAS_IO_URING
+			// ops in flight keep the sockets alive until they are shut down
+			if (lhs_fd_ >= 0)
+				::shutdown(lhs_fd_, SHUT_RDWR);
+			if (rhs_fd_ >= 0)
+				::shutdown(rhs_fd_, SHUT_RDWR);
+#endif
 			try {
 				if (lhs_s_.is_open())
 					lhs_s_.close();
@@ -51,6 +302,35 @@ namespace zrp {
 			} catch (...) {}
 		}
 
+		access_log::record access_record() const {
+			access_log::record r;
+			auto took = chrono::steady_clock::now() - opened_at_;
+			r.start_us = chrono::duration_cast<chrono::microseconds>((chrono::system_clock::now() - took).time_since_epoch()).count();
+			r.duration_ms = static_cast<uint32_t>(chrono::duration_cast<chrono::milliseconds>(took).count());
+			r.bytes_in = bytes_[0];
+			r.bytes_out = bytes_[1];
+			auto addr = peer_.address();
+			r.ip = (addr.is_v4() ? asio::ip::make_address_v6(asio::ip::v4_mapped, addr.to_v4()) : addr.to_v6()).to_bytes();
+			r.port = peer_.port();
+			r.reason = std::max(reasons_[0], reasons_[1]);
+			r.share_id = fwd_->name_;
+			return r;
+		}
+
+		template <class ReadSocket>
+		int direction_of(const ReadSocket &read_s) const noexcept {
+			return static_cast<const void*>(&read_s) == static_cast<const void*>(&lhs_s_) ? 0 : 1;
+		}
+
+		template <class ReadSocket>
+		void count(const ReadSocket &read_s, size_t n) noexcept {
+			bytes_[direction_of(read_s)] += n;
+		}
+
+		static access_log::close_reason reason_of(const error_code& ec) noexcept {
+			return ec == asio::error::connection_reset ? access_log::close_reason::reset : access_log::close_reason::closed;
+		}
+
 		void handle_error(const exception& e) noexcept {
 			if (!stopping_) {
 				logger_.error("got an exception, stopping : ").with_exception(e);
@@ -62,37 +342,360 @@ namespace zrp {
 
 		void run() {
 			auto sg = this->shared_from_this();
-			co_spawn(exec_, [this, sg]() mutable -> awaitable<void> {
+#ifdef ZRP_HAS_IO_URING
+			if constexpr (stream_sockets_only) {
+				// without a ring on this io_context, or once it is stopping, the
+				// sockets stay as they are and take the copy path below
+				if (fwd_->popts_.engine == pipe_engine_t::io_uring && uring_accepting()) {
+					lhs_fd_ = release_to_uring(lhs_s_);
+					rhs_fd_ = release_to_uring(rhs_s_);
+					co_spawn(exec_, [this, sg]() mutable -> awaitable<void> {
+						co_await uring_half_pipe(lhs_fd_, rhs_fd_);
+					}, asio::detached);
+					co_spawn(exec_, [this, sg]() mutable -> awaitable<void> {
+						co_await uring_half_pipe(rhs_fd_, lhs_fd_);
+					}, asio::detached);
+					return;
+				}
+			}
+#endif
+			// one strand for both, as they share the sockets with try_stop, a
+			// pipelined direction completes its writes on it too
+			co_spawn(strand_, [this, sg]() mutable -> awaitable<void> {
 				co_await half_pipe(lhs_s_, rhs_s_);
 			}, asio::detached);
-			co_spawn(exec_, [this, sg]() mutable -> awaitable<void> {
+			co_spawn(strand_, [this, sg]() mutable -> awaitable<void> {
 				co_await half_pipe(rhs_s_, lhs_s_);
 			}, asio::detached);
 		}
 
-		awaitable<void> half_pipe(tcp::socket &read_s, tcp::socket &write_s) {
+		template <class ReadSocket, class WriteSocket>
+		awaitable<void> half_pipe(ReadSocket &read_s, WriteSocket &write_s) {
 			try {
 				try {
-					char data[pipe_buffer_size];
-					for (;;) {
-						size_t n = co_await read_s.async_read_some(buffer(data, pipe_buffer_size), asio::use_awaitable);
-						logger_.trace(fmt::format(FMT_COMPILE(".. transferring {} bytes of data .."), n));
-						co_await async_write(write_s, buffer(data, n), asio::use_awaitable);
-					}
+					co_await transfer(read_s, write_s);
 				} catch (system_error & se) {
 					if ((se.code() != asio::error::not_connected) &&
 						(se.code() != asio::error::eof) &&
 						(se.code() != asio::error::connection_reset)) {
 						throw;
 					}
+					reasons_[direction_of(read_s)] = reason_of(se.code());
 					try {
-						write_s.shutdown(tcp::socket::shutdown_send);
+						shutdown_send(write_s);
 					} catch(...) {}
 				}
 			} catch (const exception& e) {
+				reasons_[direction_of(read_s)] = stopping_ ? access_log::close_reason::stopped : access_log::close_reason::error;
+				handle_error(e);
+			}
+		}
+
+		template <IsStreamSocket Socket>
+		static void shutdown_send(Socket &s) {
+			s.shutdown(Socket::shutdown_send);
+		}
+
+		static void shutdown_send(mux_socket &s) {
+			s.shutdown_send();
+		}
+
+		template <IsStreamSocket ReadSocket, IsStreamSocket WriteSocket>
+		awaitable<void> transfer(ReadSocket &read_s, WriteSocket &write_s) {
+#ifdef ZRP_HAS_SPLICE
+			if (fwd_->popts_.engine == pipe_engine_t::splice) {
+				co_await splice_half_pipe(read_s, write_s);
+			}
+#endif
+			if (fwd_->popts_.pipeline_depth > 1) {
+				co_await pipelined_half_pipe(read_s, write_s);
+			} else {
+				co_await copy_half_pipe(read_s, write_s);
+			}
+		}
+
+		/**
+		 * Out of a tunnel stream. Chunks arrive in pooled buffers already, so
+		 * they are written as they are, the stream window is handed back on
+		 * the next read.
+		 */
+		template <IsStreamSocket WriteSocket>
+		awaitable<void> transfer(mux_socket &read_s, WriteSocket &write_s) {
+			for (;;) {
+				auto [buf, n] = co_await read_s.read_chunk();
+				logger_.trace(FMT_COMPILE(".. transferring {} bytes of data .."), n);
+				count(read_s, n);
+				co_await async_write(write_s, buffer(buf.data(), n), asio::use_awaitable);
+			}
+		}
+
+		/**
+		 * Into a tunnel stream. Reads no more than the send window allows, and
+		 * does not even wait for the socket while the window is closed.
+		 */
+		template <IsStreamSocket ReadSocket>
+		awaitable<void> transfer(ReadSocket &read_s, mux_socket &write_s) {
+			read_s.non_blocking(true);
+			size_t max = std::min(fwd_->popts_.buffer_max, mux_frame_max);
+			adaptive_read_size rsz{std::min(fwd_->popts_.buffer_min, max), max};
+			for (;;) {
+				size_t window = co_await write_s.wait_writable();
+				{
+					stats::scoped_gauge idle{stats::pipe_directions_idle};
+					co_await read_s.async_wait(asio::socket_base::wait_read, asio::use_awaitable);
+				}
+				while (window > 0) {
+					size_t want = std::min(rsz.get(), window);
+					pooled_buffer buf = buffer_pool::local().acquire(want);
+					error_code ec;
+					size_t n = read_s.read_some(buffer(buf.data(), want), ec);
+					if (ec == asio::error::would_block || ec == asio::error::try_again) {
+						break;
+					}
+					if (ec) {
+						throw system_error{ec};
+					}
+					rsz.update(n);
+					logger_.trace(FMT_COMPILE(".. transferring {} bytes of data .."), n);
+					count(read_s, n);
+					window = write_s.write(move(buf), n);
+				}
+			}
+		}
+
+		/**
+		 * Waits for readability holding no buffer, then borrows one from the
+		 * per-thread pool until the socket runs dry again.
+		 */
+		template <class ReadSocket, class WriteSocket>
+		awaitable<void> copy_half_pipe(ReadSocket &read_s, WriteSocket &write_s) {
+			// so that read_some returns would_block instead of polling
+			read_s.non_blocking(true);
+			adaptive_read_size rsz{fwd_->popts_.buffer_min, fwd_->popts_.buffer_max};
+			for (;;) {
+				{
+					stats::scoped_gauge idle{stats::pipe_directions_idle};
+					co_await read_s.async_wait(asio::socket_base::wait_read, asio::use_awaitable);
+				}
+				pooled_buffer buf = buffer_pool::local().acquire(rsz.get());
+				for (;;) {
+					if (buf.size() < rsz.get()) {
+						buf = buffer_pool::local().acquire(rsz.get());
+					}
+					size_t want = std::min(buf.size(), rsz.get());
+					error_code ec;
+					size_t n = read_s.read_some(buffer(buf.data(), want), ec);
+					if (ec == asio::error::would_block || ec == asio::error::try_again) {
+						break;
+					}
+					if (ec) {
+						throw system_error{ec};
+					}
+					rsz.update(n);
+					logger_.trace(FMT_COMPILE(".. transferring {} bytes of data .."), n);
+					count(read_s, n);
+					co_await async_write(write_s, buffer(buf.data(), n), asio::use_awaitable);
+				}
+			}
+		}
+
+		/**
+		 * Like copy_half_pipe, but hands filled buffers to a write queue and
+		 * reads on while they are written, holding at most pipeline_depth
+		 * buffers per direction. The writes are drained before an eof is
+		 * passed on, and a failed one ends the wait for readability.
+		 */
+		template <class ReadSocket, class WriteSocket>
+		awaitable<void> pipelined_half_pipe(ReadSocket &read_s, WriteSocket &write_s) {
+			read_s.non_blocking(true);
+			adaptive_read_size rsz{fwd_->popts_.buffer_min, fwd_->popts_.buffer_max};
+			auto wq = make_shared<pipe_write_queue<WriteSocket>>(write_s, this->shared_from_this(),
+				co_await asio::this_coro::executor, fwd_->popts_.pipeline_depth);
+			// nothing read from now on could be written, and the reader wakes up
+			// to an eof, then drain() throws the write error. Cancelling the
+			// socket would also abort the other direction writing to it.
+			wq->on_error_ = [&read_s]() {
+				error_code ignored;
+				read_s.shutdown(ReadSocket::shutdown_receive, ignored);
+			};
+			for (;;) {
+				if (wq->chunks_.empty()) {
+					stats::scoped_gauge idle{stats::pipe_directions_idle};
+					co_await read_s.async_wait(asio::socket_base::wait_read, asio::use_awaitable);
+				} else {
+					co_await read_s.async_wait(asio::socket_base::wait_read, asio::use_awaitable);
+				}
+				for (;;) {
+					pooled_buffer buf = buffer_pool::local().acquire(rsz.get());
+					size_t want = std::min(buf.size(), rsz.get());
+					error_code ec;
+					size_t n = read_s.read_some(buffer(buf.data(), want), ec);
+					if (ec == asio::error::would_block || ec == asio::error::try_again) {
+						break;
+					}
+					if (ec == asio::error::eof) {
+						co_await wq->drain();
+					}
+					if (ec) {
+						throw system_error{ec};
+					}
+					rsz.update(n);
+					logger_.trace(FMT_COMPILE(".. transferring {} bytes of data .."), n);
+					count(read_s, n);
+					co_await wq->push(move(buf), n);
+				}
+			}
+		}
+
+#ifdef ZRP_HAS_SPLICE
+		static bool splice_unsupported(const error_code& ec) noexcept {
+			return (ec == errc::invalid_argument) ||
+				(ec == errc::function_not_supported) ||
+				(ec == errc::operation_not_supported);
+		}
+
+		/**
+		 * Moves data with splice(2) through a kernel pipe borrowed from the
+		 * per-thread pool, never copying it into userspace. Returns normally
+		 * only if splice is not usable on these sockets, leaving the rest to
+		 * the copy loop.
+		 */
+		template <class ReadSocket, class WriteSocket>
+		awaitable<void> splice_half_pipe(ReadSocket &read_s, WriteSocket &write_s) {
+			read_s.native_non_blocking(true);
+			write_s.native_non_blocking(true);
+			bool spliced = false;
+			for (;;) {
+				{
+					stats::scoped_gauge idle{stats::pipe_directions_idle};
+					co_await read_s.async_wait(asio::socket_base::wait_read, asio::use_awaitable);
+				}
+
+				error_code ec;
+				kernel_pipe kp = kernel_pipe_pool::local().acquire(ec);
+				if (ec) {
+					logger_.warning("failed to open a kernel pipe, falling back to copy : ").with_exception(system_error{ec});
+					co_return;
+				}
+				for (;;) {
+					ec = {};
+					size_t n = kp.splice_from(read_s.native_handle(), kernel_pipe_size, ec);
+					if (ec == errc::operation_would_block || ec == errc::resource_unavailable_try_again) {
+						break;
+					}
+					if (ec && !spliced && splice_unsupported(ec)) {
+						logger_.warning("splice not supported, falling back to copy : ").with_exception(system_error{ec});
+						kernel_pipe_pool::local().release(move(kp));
+						co_return;
+					}
+					if (ec) {
+						throw system_error{ec};
+					}
+					if (n == 0) {
+						kernel_pipe_pool::local().release(move(kp));
+						throw system_error{asio::error::eof};
+					}
+					spliced = true;
+					logger_.trace(FMT_COMPILE(".. splicing {} bytes of data .."), n);
+					count(read_s, n);
+					while (kp.pending_ > 0) {
+						ec = {};
+						kp.splice_to(write_s.native_handle(), ec);
+						if (ec == errc::operation_would_block || ec == errc::resource_unavailable_try_again) {
+							co_await write_s.async_wait(asio::socket_base::wait_write, asio::use_awaitable);
+						} else if (ec) {
+							throw system_error{ec};
+						}
+					}
+				}
+				kernel_pipe_pool::local().release(move(kp));
+			}
+		}
+#endif
+
+#ifdef ZRP_HAS_IO_URING
+		bool uring_accepting() {
+			return asio::has_service<uring_service>(exec_) && asio::use_service<uring_service>(exec_).accepting();
+		}
+
+		/**
+		 * Takes the socket away from the reactor, so no readiness events are
+		 * generated for it any more, and puts it back into blocking mode so
+		 * io_uring polls it internally instead of returning EAGAIN. There is no
+		 * way back, so only once uring_accepting() said yes.
+		 */
+		template <class Socket>
+		static int release_to_uring(Socket &s) {
+			int fd = s.release();
+			int flags = ::fcntl(fd, F_GETFL);
+			if (flags >= 0) {
+				::fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+			}
+			return fd;
+		}
+
+		/**
+		 * Waits for readability holding no buffer, as copy_half_pipe does, then
+		 * writes each chunk with the next read linked to it until the socket
+		 * runs dry.
+		 */
+		awaitable<void> uring_half_pipe(int read_fd, int write_fd) {
+			auto sys_error = [](int res) -> system_error {
+				return system_error{error_code(-res, asio::error::get_system_category())};
+			};
+			try {
+				try {
+					auto &ring = asio::use_service<uring_service>(exec_);
+					uring_op op;
+					for (;;) {
+						{
+							stats::scoped_gauge idle{stats::pipe_directions_idle};
+							int ready = co_await ring.async_poll_in(op, read_fd);
+							if (ready < 0) {
+								throw sys_error(ready);
+							}
+						}
+						uring_buffer buf = ring.acquire_buffer();
+						int n = co_await ring.async_read(op, read_fd, buf);
+						while (n != -EAGAIN) {
+							if (n < 0) {
+								throw sys_error(n);
+							}
+							if (n == 0) {
+								throw system_error{asio::error::eof};
+							}
+							logger_.trace(FMT_COMPILE(".. transferring {} bytes of data .."), n);
+							bytes_[read_fd == lhs_fd_ ? 0 : 1] += n;
+							size_t off = 0;
+							for (;;) {
+								auto [w, r] = co_await ring.async_write_then_read(op, write_fd, buf, off, n - off, read_fd);
+								if (w < 0) {
+									throw sys_error(w);
+								}
+								off += w;
+								if (off == static_cast<size_t>(n)) {
+									n = r;
+									break;
+								}
+								// short write, the linked read got cancelled
+							}
+						}
+					}
+				} catch (system_error & se) {
+					if ((se.code() != asio::error::not_connected) &&
+						(se.code() != asio::error::eof) &&
+						(se.code() != asio::error::connection_reset)) {
+						throw;
+					}
+					reasons_[read_fd == lhs_fd_ ? 0 : 1] = reason_of(se.code());
+					::shutdown(write_fd, SHUT_WR);
+				}
+			} catch (const exception& e) {
+				reasons_[read_fd == lhs_fd_ ? 0 : 1] = stopping_ ? access_log::close_reason::stopped : access_log::close_reason::error;
 				handle_error(e);
 			}
 		}
+#endif
 	};
 }
 
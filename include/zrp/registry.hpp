@@ -0,0 +1,94 @@
+// SPDX-License-Identifier: BSL-1.0
+// copyleft 2021 youcai <omegacoleman@gmail.com>
+// Distributed under the Boost Software License, Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include "zrp/bindings.hpp"
+
+namespace zrp {
+
+	namespace detail {
+		inline size_t registry_thread_slot() noexcept {
+			static atomic<size_t> next{0};
+			static thread_local size_t slot = next.fetch_add(1, std::memory_order_relaxed);
+			return slot;
+		}
+	}
+
+	/**
+	 * Weak references to live objects, split into shards so that threads
+	 * adding and removing at the same time mostly take different locks. Each
+	 * thread adds to a shard of its own. An entry is taken out by its owner
+	 * through the handle add() gave back, in O(1), usually on destruction,
+	 * so nothing is left behind by dead objects.
+	 */
+	template <class T>
+	struct sharded_registry {
+		struct shard {
+			mutex mtx_;
+			list<weak_ptr<T>> items_;
+		};
+
+		struct handle {
+			shard *shard_ = nullptr;
+			typename list<weak_ptr<T>>::iterator it_;
+		};
+
+		vector<unique_ptr<shard>> shards_;
+
+		explicit sharded_registry(size_t nr_shards = std::max(thread::hardware_concurrency(), 1u)) {
+			for (size_t i = 0; i < nr_shards; i++) {
+				shards_.emplace_back(make_unique<shard>());
+			}
+		}
+
+		handle add(weak_ptr<T> p) {
+			shard &sh = *shards_[detail::registry_thread_slot() % shards_.size()];
+			lock_guard lk{sh.mtx_};
+			sh.items_.emplace_front(move(p));
+			return {&sh, sh.items_.begin()};
+		}
+
+		void remove(const handle &h) noexcept {
+			if (!h.shard_) {
+				return;
+			}
+			lock_guard lk{h.shard_->mtx_};
+			h.shard_->items_.erase(h.it_);
+		}
+
+		size_t size() {
+			size_t ret = 0;
+			for (auto& sh : shards_) {
+				lock_guard lk{sh->mtx_};
+				ret += sh->items_.size();
+			}
+			return ret;
+		}
+
+		/**
+		 * Calls f on every object still alive, outside of the locks, so f may
+		 * drop the last reference to it.
+		 */
+		template <class F>
+		void for_each(F&& f) {
+			for (auto& sh : shards_) {
+				vector<shared_ptr<T>> alive;
+				{
+					lock_guard lk{sh->mtx_};
+					alive.reserve(sh->items_.size());
+					for (auto& it : sh->items_) {
+						if (auto p = it.lock()) {
+							alive.emplace_back(move(p));
+						}
+					}
+				}
+				for (auto& p : alive) {
+					f(p);
+				}
+			}
+		}
+	};
+
+}
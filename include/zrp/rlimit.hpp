@@ -24,7 +24,7 @@ inline void try_set_rlimit_nofile(int configured_rlim_nofile) {
 	if (ret < 0) {
 		logger.warning("setting rlimit failed with error : ").with_exception(system_error{make_error_code(static_cast<errc::errc_t>(errno))});
 	} else {
-		logger.trace(fmt::format(FMT_COMPILE("setting RLIMIT_NOFILE soft & hard limit to {}"), configured_rlim_nofile));
+		logger.trace(FMT_COMPILE("setting RLIMIT_NOFILE soft & hard limit to {}"), configured_rlim_nofile);
 	}
 }
 
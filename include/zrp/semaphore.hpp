@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: BSL-1.0
+// copyleft 2021 youcai <omegacoleman@gmail.com>
+// Distributed under the Boost Software License, Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include "zrp/bindings.hpp"
+
+#include "zrp/completion_handler.hpp"
+
+namespace zrp {
+
+struct semaphore;
+
+/**
+ * One unit taken from a semaphore, given back when dropped.
+ */
+struct semaphore_permit {
+	semaphore *sem_ = nullptr;
+
+	semaphore_permit() = default;
+	explicit semaphore_permit(semaphore *sem) noexcept
+		: sem_(sem) {}
+	semaphore_permit(semaphore_permit&& o) noexcept
+		: sem_(std::exchange(o.sem_, nullptr)) {}
+	semaphore_permit& operator=(semaphore_permit&&) = delete;
+	~semaphore_permit();
+};
+
+/**
+ * Counting semaphore for coroutines, all state is touched on exec_ only,
+ * like waitqueue. Waiters are served in order.
+ */
+struct semaphore {
+	using waiter_completion_handler_t = completion_handler<void(error_code)>;
+
+	deque<waiter_completion_handler_t> q_;
+	asio::executor exec_;
+	size_t avail_;
+
+	semaphore(asio::executor exec, size_t count)
+	: exec_(exec), avail_(count)
+	{}
+
+	awaitable<semaphore_permit> acquire() {
+		auto initiation = [this](auto&& handler) mutable
+		{
+			waiter_completion_handler_t curr_handler = forward<decltype(handler)>(handler);
+			asio::post(exec_, [this, curr_handler = move(curr_handler)]() mutable {
+				if (avail_ > 0) {
+					avail_--;
+					curr_handler({});
+				} else {
+					q_.emplace_back(move(curr_handler));
+				}
+			});
+		};
+		co_await asio::async_initiate<decltype(asio::use_awaitable), void(error_code)>(initiation, asio::use_awaitable);
+		co_return semaphore_permit{this};
+	}
+
+	void release() {
+		asio::post(exec_, [this]() mutable {
+			if (!q_.empty()) {
+				auto h = move(q_.front());
+				q_.pop_front();
+				h({});
+			} else {
+				avail_++;
+			}
+		});
+	}
+};
+
+inline semaphore_permit::~semaphore_permit() {
+	if (sem_) {
+		sem_->release();
+	}
+}
+
+}
@@ -14,6 +14,9 @@
 #include "zrp/log.hpp"
 #include "zrp/rlimit.hpp"
 #include "zrp/exceptions.hpp"
+#include "zrp/stats.hpp"
+#include "zrp/acceptor.hpp"
+#include "zrp/access_log.hpp"
 
 namespace zrp {
 
@@ -23,6 +26,11 @@ static inline config_t cfg;
 
 static inline asio::ip::address tcp_share_host = asio::ip::address::from_string("0.0.0.0");
 static inline string welcome_msg = "welcome to zrp server";
+static inline pipe_options pipe_opts;
+static inline log::writer_options log_opts;
+static inline access_log::options access_log_opts;
+static inline shared_ptr<access_log::sink> access_sink; // set by run() with access_log_file
+static inline size_t tunnel_window = mux_initial_window;
 
 inline void load_config(const string_view filename) {
 	static json::value jv = parse_file(filename);
@@ -34,6 +42,32 @@ inline void load_config(const string_view filename) {
 	try_set_rlimit_nofile(cfg.rlimit_nofile);
 	tcp_share_host = asio::ip::address::from_string(cfg.sharing_host);
 	welcome_msg = cfg.welcome;
+	pipe_opts = with_buffer_limits(load_pipe_options(cfg.pipe_engine), cfg.pipe_buffer_min, cfg.pipe_buffer_max);
+	pipe_opts = with_pipeline_depth(pipe_opts, cfg.pipe_pipeline_depth);
+	tunnel_window = check_tunnel_window(cfg.tunnel_window);
+	log_opts = log::load_writer_options(cfg.log_buffer, cfg.log_overflow);
+	access_log_opts = access_log::load_options(cfg.access_log_file, cfg.access_log_max_size, cfg.access_log_max_age);
+	if (cfg.accept_batch < 1 || cfg.accept_batch > static_cast<int>(accept_batch_max)) {
+		throw exceptions::bad_config_value{"accept_batch", fmt::format(FMT_COMPILE("{}"), cfg.accept_batch)};
+	}
+	if (cfg.listen_reuseport && !cfg.forwarder_sharding) {
+		log::as(log::tag_server{}).warning("listen_reuseport takes effect with forwarder_sharding only");
+	}
+	if (cfg.listen_incoming_cpu && !(cfg.listen_reuseport && cfg.forwarder_pin_threads)) {
+		log::as(log::tag_server{}).warning("listen_incoming_cpu takes effect with listen_reuseport and forwarder_pin_threads only");
+	}
+}
+
+// with access_log_file, visits are recorded by their pipes once done instead
+inline bool access_log_lines() {
+	return cfg.access_log && cfg.access_log_file.empty();
+}
+
+// the client picks buffer limits per share, capped by ours
+inline pipe_options share_pipe_options(const msg::tcp_share &ts) {
+	int max = ts.buffer_max > 0 ? std::min(ts.buffer_max, cfg.pipe_buffer_max) : cfg.pipe_buffer_max;
+	int min = ts.buffer_min > 0 ? std::min(ts.buffer_min, max) : std::min(cfg.pipe_buffer_min, max);
+	return with_buffer_limits(pipe_opts, min, max);
 }
 
 extern int exit_code;
@@ -59,15 +93,20 @@ struct tcp_share : enable_shared_from_this<tcp_share> {
 	tcp::endpoint listen_;
 	atomic<int> nr_workers_ = 0;
 	ctrl_ptr_t ctrl_;
+	pipe_options popts_;
 
 	waitqueue<tcp_share_worker_weak_ptr_t> wq_;
 	map<int, tcp_share_worker_weak_ptr_t> workers_{};
+	waitqueue<weak_ptr<mux_tunnel>> reuse_wq_; // idle reusable workers
+	list<weak_ptr<mux_tunnel>> reusable_;
+	stats::gauge nr_waiting_; // visitors waiting for a worker
+	bool demand_posted_ = false;
 
 	bool closing_ = false;
 	log::logger logger_;
 
-	tcp_share(asio::io_context &ioc, asio::io_context &fwd_ioc, ctrl_ptr_t ctrl, string share_id, unsigned short listen_port);
-	static shared_ptr<tcp_share> create(asio::io_context &ioc, asio::io_context &fwd_ioc, ctrl_ptr_t ctrl, string share_id, unsigned short port);
+	tcp_share(asio::io_context &ioc, asio::io_context &fwd_ioc, ctrl_ptr_t ctrl, string share_id, unsigned short listen_port, pipe_options popts);
+	static shared_ptr<tcp_share> create(asio::io_context &ioc, asio::io_context &fwd_ioc, ctrl_ptr_t ctrl, string share_id, unsigned short port, pipe_options popts);
 
 	struct upstream {
 		using tcp_share_ptr_t = shared_ptr<tcp_share>;
@@ -78,14 +117,37 @@ struct tcp_share : enable_shared_from_this<tcp_share> {
 		awaitable<tcp::socket> get_socket(const tcp::endpoint ep);
 	};
 
+	// opens a stream on one of the tunnels of the client instead
+	struct mux_upstream {
+		using tcp_share_ptr_t = shared_ptr<tcp_share>;
+
+		tcp_share_ptr_t sh_;
+
+		mux_upstream(tcp_share_ptr_t sh);
+		awaitable<mux_socket> get_socket(const tcp::endpoint ep);
+	};
+
+	// opens the only stream on an idle reusable worker
+	struct reuse_upstream {
+		using tcp_share_ptr_t = shared_ptr<tcp_share>;
+
+		tcp_share_ptr_t sh_;
+
+		reuse_upstream(tcp_share_ptr_t sh);
+		awaitable<mux_socket> get_socket(const tcp::endpoint ep);
+	};
+
 	struct downstream {
 		using tcp_share_ptr_t = shared_ptr<tcp_share>;
 
 		tcp_share_ptr_t sh_;
-		tcp::acceptor ac_;
+		vector<shared_ptr<batch_acceptor>> lanes_; // one per forwarder shard with listen_reuseport
 
 		downstream(tcp_share_ptr_t sh);
 		void try_stop() noexcept;
+		size_t lanes() const noexcept;
+		asio::io_context& lane_context(size_t lane) noexcept;
+		awaitable<tcp::socket> get_socket(size_t lane, tcp::endpoint& ep);
 		awaitable<tcp::socket> get_socket(tcp::endpoint& ep);
 	};
 
@@ -94,7 +156,19 @@ struct tcp_share : enable_shared_from_this<tcp_share> {
 	using forwarder_weak_ptr_t = weak_ptr<forwarder_t>;
 	forwarder_weak_ptr_t fwd_;
 
+	using mux_forwarder_t = forwarder<mux_upstream, downstream>;
+	using mux_forwarder_ptr_t = shared_ptr<mux_forwarder_t>;
+	using mux_forwarder_weak_ptr_t = weak_ptr<mux_forwarder_t>;
+	mux_forwarder_weak_ptr_t mux_fwd_;
+
+	using reuse_forwarder_t = forwarder<reuse_upstream, downstream>;
+	using reuse_forwarder_ptr_t = shared_ptr<reuse_forwarder_t>;
+	using reuse_forwarder_weak_ptr_t = weak_ptr<reuse_forwarder_t>;
+	reuse_forwarder_weak_ptr_t reuse_fwd_;
+
 	upstream make_upstream();
+	mux_upstream make_mux_upstream();
+	reuse_upstream make_reuse_upstream();
 	downstream make_downstream();
 
 	void try_stop() noexcept;
@@ -105,15 +179,20 @@ struct tcp_share : enable_shared_from_this<tcp_share> {
 
 	void cleanup_workers();
 	awaitable<void> got_worker(tcp_share_worker_weak_ptr_t w);
+	void got_reusable(shared_ptr<mux_tunnel> t);
+	void signal_demand();
+	string stream_open_payload(const tcp::endpoint& ep);
 };
 
 struct tcp_share_worker : enable_shared_from_this<tcp_share_worker> {
 	asio::io_context &ioc_;
 	tcp::socket s_;
+	msg_codec codec_;
 	bool visited_ = false;
 	bool visited_confirmed_ = false;
 	int id_;
 	waitqueue<msg_t> to_send_;
+	bool confirms_; // the client answers a visit with visit_confirmed, before version 5
 
 	tcp_share_ptr_t share_;
 
@@ -122,6 +201,10 @@ struct tcp_share_worker : enable_shared_from_this<tcp_share_worker> {
 
 	steady_timer ddl_;
 	string_view ddl_action_;
+	steady_timer ping_timer_;
+	int pongs_due_ = 0; // pings sent and not yet answered, since version 5
+	steady_timer pongs_in_; // cancelled once pongs_due_ drops to 0
+	bool visiting_ = false;
 
 	tcp_share_worker(asio::io_context &ioc, tcp_share_ptr_t share, int id, tcp::socket s);
 	~tcp_share_worker();
@@ -137,8 +220,11 @@ struct tcp_share_worker : enable_shared_from_this<tcp_share_worker> {
 	void set_ddl(const string_view action, chrono::seconds after);
 	void cancel_ddl();
 	awaitable<void> ddl_actor();
+	awaitable<void> ping_actor();
 
 	awaitable<void> handle_msg(msg::ping);
+	awaitable<void> handle_msg(msg::pong);
+	awaitable<void> handle_msg(msg::worker_retire);
 
 	awaitable<tcp::socket> visit(const tcp::endpoint ep);
 
@@ -148,19 +234,29 @@ struct controller_socket : enable_shared_from_this<controller_socket> {
 	asio::io_context &ioc_;
 	asio::io_context &fwd_ioc_;
 	tcp::socket s_;
+	msg_codec codec_;
 	string client_uuid_;
 	map<string, tcp_share_weak_ptr_t> shares_;
 	waitqueue<msg_t> to_send_;
 	bool stopping_ = false;
 	log::logger logger_;
 
+	int version_ = 0;
+	msg_format fmt_ = msg_format::json;
+	bool tunnels_enabled_ = false;
+	bool reuse_workers_ = false;
+	mutex tunnels_mtx_; // tunnels are picked from the forwarder threads
+	vector<weak_ptr<mux_tunnel>> tunnels_;
+
 	steady_timer ddl_;
 	string_view ddl_action_;
 
 	controller_socket(asio::io_context &ioc, asio::io_context &fwd_ioc, tcp::socket s, string client_uuid);
 	static shared_ptr<controller_socket> create(asio::io_context &ioc, asio::io_context &fwd_ioc, tcp::socket s, string client_uuid);
 
-	tcp_share_ptr_t add_tcp_share(string share_id, unsigned short port);
+	tcp_share_ptr_t add_tcp_share(string share_id, unsigned short port, pipe_options popts);
+	void add_tunnel(shared_ptr<mux_tunnel> t);
+	mux_socket open_stream(string payload);
 
 	void try_stop() noexcept;
 	void handle_error(const exception& e) noexcept;
@@ -174,16 +270,19 @@ struct controller_socket : enable_shared_from_this<controller_socket> {
 	awaitable<void> ddl_actor();
 
 	awaitable<void> handle_msg(msg::ping);
+	awaitable<void> handle_msg(msg::worker_retire);
 };
 
 struct server : enable_shared_from_this<server> {
 	asio::io_context &ioc_;
 	asio::io_context &fwd_ioc_;
+	mutex mtx_; // hellos come in on every control shard
 	map<string, ctrl_weak_ptr_t> ctrls_;
 	map<string, tcp_share_weak_ptr_t> tcp_shares_;
-	tcp::acceptor ac_;
+	shared_ptr<batch_acceptor> ac_;
 	bool stopping_ = false;
 	log::logger logger_;
+	steady_timer stats_timer_;
 
 	struct socket_type : enable_shared_from_this<socket_type> {
 		asio::io_context &ioc_;
@@ -207,6 +306,7 @@ struct server : enable_shared_from_this<server> {
 		awaitable<void> ddl_actor();
 		awaitable<void> handle_hello_msg(msg::client_hello hello);
 		awaitable<void> handle_hello_msg(msg::tcp_share_worker_hello hello);
+		awaitable<void> handle_hello_msg(msg::tunnel_hello hello);
 	};
 	list<weak_ptr<socket_type>> sockets_;
 
@@ -220,14 +320,15 @@ struct server : enable_shared_from_this<server> {
 	void run();
 	awaitable<void> serve();
 	void handle_socket(tcp::socket s);
+	awaitable<void> stats_actor();
 };
 
-inline tcp_share::tcp_share(asio::io_context &ioc, asio::io_context &fwd_ioc, ctrl_ptr_t ctrl, string share_id, unsigned short listen_port)
-	: ioc_(ioc), fwd_ioc_(fwd_ioc), ctrl_(ctrl), share_id_(share_id), listen_port_(listen_port), listen_(tcp_share_host, listen_port), wq_(ioc.get_executor()), logger_(log::tag_tcp_share{share_id})
+inline tcp_share::tcp_share(asio::io_context &ioc, asio::io_context &fwd_ioc, ctrl_ptr_t ctrl, string share_id, unsigned short listen_port, pipe_options popts)
+	: ioc_(ioc), fwd_ioc_(fwd_ioc), ctrl_(ctrl), share_id_(share_id), listen_port_(listen_port), listen_(tcp_share_host, listen_port), popts_(popts), wq_(ioc.get_executor()), reuse_wq_(ioc.get_executor()), logger_(log::tag_tcp_share{share_id})
 {}
 
-inline shared_ptr<tcp_share> tcp_share::create(asio::io_context &ioc, asio::io_context &fwd_ioc, ctrl_ptr_t ctrl, string share_id, unsigned short port) {
-	return make_shared<tcp_share>(ioc, fwd_ioc, ctrl, move(share_id), port);
+inline shared_ptr<tcp_share> tcp_share::create(asio::io_context &ioc, asio::io_context &fwd_ioc, ctrl_ptr_t ctrl, string share_id, unsigned short port, pipe_options popts) {
+	return make_shared<tcp_share>(ioc, fwd_ioc, ctrl, move(share_id), port, popts);
 }
 
 inline tcp_share::upstream::upstream(tcp_share_ptr_t sh)
@@ -236,30 +337,106 @@ inline tcp_share::upstream::upstream(tcp_share_ptr_t sh)
 
 inline awaitable<tcp::socket> tcp_share::upstream::get_socket(const tcp::endpoint ep) {
 	for (;;) {
-		if(auto worker = (co_await sh_->wq_.wait()).lock()) { // skip if worker died before visit
+		stats::scoped_gauge waiting{sh_->nr_waiting_};
+		sh_->signal_demand();
+		auto worker = (co_await sh_->wq_.wait()).lock();
+		if (worker && !worker->stopping_) { // skip if worker died or retired before visit
 			co_return co_await worker->visit(ep);
 		}
 	}
 }
 
-inline tcp_share::downstream::downstream(tcp_share_ptr_t sh)
-	: ac_(sh->fwd_ioc_, sh->listen_), sh_(sh)
+inline tcp_share::mux_upstream::mux_upstream(tcp_share_ptr_t sh)
+	: sh_(sh)
+{}
+
+inline awaitable<mux_socket> tcp_share::mux_upstream::get_socket(const tcp::endpoint ep) {
+	co_return sh_->ctrl_->open_stream(sh_->stream_open_payload(ep));
+}
+
+inline tcp_share::reuse_upstream::reuse_upstream(tcp_share_ptr_t sh)
+	: sh_(sh)
 {}
 
+inline awaitable<mux_socket> tcp_share::reuse_upstream::get_socket(const tcp::endpoint ep) {
+	for (;;) {
+		stats::scoped_gauge waiting{sh_->nr_waiting_};
+		sh_->signal_demand();
+		auto t = (co_await sh_->reuse_wq_.wait()).lock();
+		if (!t || t->draining()) { // skip if the worker died or was retired while idle
+			continue;
+		}
+		try {
+			co_return t->open_stream(sh_->stream_open_payload(ep));
+		} catch (const system_error& se) {
+			sh_->logger_.trace("reusable worker stopped before visit : ").with_exception(se);
+		}
+	}
+}
+
+inline string tcp_share::stream_open_payload(const tcp::endpoint& ep) {
+	msg::stream_open so;
+	so.tcp_share_id = share_id_;
+	so.epoch = chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+	string ip = ep.address().to_string();
+	if (access_log_lines())
+		logger_.access(FMT_COMPILE("accessed from ip {} port {}"), ip, ep.port());
+	so.peer.ip = ip;
+	so.peer.port = ep.port();
+	return json::serialize(json::value_from(so));
+}
+
+inline tcp_share::downstream::downstream(tcp_share_ptr_t sh)
+	: sh_(sh)
+{
+	size_t batch = static_cast<size_t>(cfg.accept_batch);
+	io_shards_service *shards = cfg.listen_reuseport ? find_shards(sh->fwd_ioc_) : nullptr;
+	if (!shards) {
+		lanes_.emplace_back(batch_acceptor::create(sh->fwd_ioc_, sh->listen_, batch));
+		return;
+	}
+	for (size_t i = 0; i < shards->size(); i++) {
+		int cpu = cfg.listen_incoming_cpu && cfg.forwarder_pin_threads ? static_cast<int>(i % std::max(thread::hardware_concurrency(), 1u)) : -1;
+		lanes_.emplace_back(batch_acceptor::create(shards->at(i), sh->listen_, batch, true, cpu));
+	}
+}
+
 inline void tcp_share::downstream::try_stop() noexcept {
-	try {
-		ac_.close();
-	} catch(...) {}
+	for (auto& it : lanes_) {
+		asio::post(it->ioc_, [it]() {
+			it->close();
+		});
+	}
+}
+
+inline size_t tcp_share::downstream::lanes() const noexcept {
+	return lanes_.size();
+}
+
+inline asio::io_context& tcp_share::downstream::lane_context(size_t lane) noexcept {
+	return lanes_[lane]->ioc_;
+}
+
+inline awaitable<tcp::socket> tcp_share::downstream::get_socket(size_t lane, tcp::endpoint &ep) {
+	co_return co_await lanes_[lane]->accept(ep);
 }
 
 inline awaitable<tcp::socket> tcp_share::downstream::get_socket(tcp::endpoint &ep) {
-	co_return co_await ac_.async_accept(ep, asio::use_awaitable);
+	co_return co_await lanes_[0]->accept(ep);
 }
 
 inline tcp_share::upstream tcp_share::make_upstream() {
 	return {this->shared_from_this()};
 }
 
+inline tcp_share::mux_upstream tcp_share::make_mux_upstream() {
+	return {this->shared_from_this()};
+}
+
+inline tcp_share::reuse_upstream tcp_share::make_reuse_upstream() {
+	return {this->shared_from_this()};
+}
+
 inline tcp_share::downstream tcp_share::make_downstream() {
 	return {this->shared_from_this()};
 }
@@ -269,12 +446,24 @@ inline void tcp_share::try_stop() noexcept {
 	if (forwarder_ptr_t ptr = fwd_.lock()) {
 		ptr->post_try_stop();
 	}
+	if (mux_forwarder_ptr_t ptr = mux_fwd_.lock()) {
+		ptr->post_try_stop();
+	}
+	if (reuse_forwarder_ptr_t ptr = reuse_fwd_.lock()) {
+		ptr->post_try_stop();
+	}
 	wq_.close();
+	reuse_wq_.close();
 	for (auto& it : workers_) {
 		if (tcp_share_worker_ptr_t w = it.second.lock()) { // if not already stopped
 			w->try_stop();
 		}
 	}
+	for (auto& it : reusable_) {
+		if (auto t = it.lock()) {
+			t->try_stop();
+		}
+	}
 }
 
 inline void tcp_share::handle_error(const exception& e) noexcept {
@@ -288,9 +477,22 @@ inline void tcp_share::handle_error(const exception& e) noexcept {
 
 inline awaitable<void> tcp_share::run_forwarder() {
 	try {
-		forwarder_ptr_t fwd = forwarder_t::create(fwd_ioc_, share_id_, make_upstream(), make_downstream());
-		fwd_ = fwd;
-		co_await fwd->forward();
+		if (ctrl_->tunnels_enabled_) {
+			mux_forwarder_ptr_t fwd = mux_forwarder_t::create(fwd_ioc_, share_id_, make_mux_upstream(), make_downstream(), popts_);
+			fwd->access_log_ = access_sink;
+			mux_fwd_ = fwd;
+			co_await fwd->forward();
+		} else if (ctrl_->reuse_workers_) {
+			reuse_forwarder_ptr_t fwd = reuse_forwarder_t::create(fwd_ioc_, share_id_, make_reuse_upstream(), make_downstream(), popts_);
+			fwd->access_log_ = access_sink;
+			reuse_fwd_ = fwd;
+			co_await fwd->forward();
+		} else {
+			forwarder_ptr_t fwd = forwarder_t::create(fwd_ioc_, share_id_, make_upstream(), make_downstream(), popts_);
+			fwd->access_log_ = access_sink;
+			fwd_ = fwd;
+			co_await fwd->forward();
+		}
 	} catch (const exception& e) {
 		handle_error(e);
 	}
@@ -326,8 +528,63 @@ inline awaitable<void> tcp_share::got_worker(tcp_share_worker_weak_ptr_t w) {
 	co_await wq_.provide(w);
 }
 
+/**
+ * A reusable worker is a tunnel carrying one stream at a time, it goes back
+ * to reuse_wq_ each time its stream is done.
+ */
+inline void tcp_share::got_reusable(shared_ptr<mux_tunnel> t) {
+	std::erase_if(reusable_, [](auto& it) {
+		return it.expired();
+	});
+	reusable_.emplace_back(t);
+	if (closing_) {
+		t->try_stop();
+		return;
+	}
+	auto sg = this->shared_from_this();
+	weak_ptr<mux_tunnel> wt = t;
+	auto provide = [this, sg, wt]() {
+		reuse_wq_.push(wt, sg);
+	};
+	t->on_idle_ = provide; // from the tunnel strand, push() hands it over to ioc_
+	t->run();
+	provide();
+}
+
+/**
+ * Tells the client that visitors are waiting while no worker is idle, so
+ * that it connects more at once. Calls made before the message is built
+ * fold into it.
+ */
+inline void tcp_share::signal_demand() {
+	if (ctrl_->version_ < 3) {
+		return;
+	}
+	auto sg = this->shared_from_this();
+	asio::post(ioc_, [this, sg]() {
+		if (demand_posted_ || closing_ || !wq_.vq_.empty() || !reuse_wq_.vq_.empty()) {
+			return;
+		}
+		demand_posted_ = true;
+		co_spawn(ioc_, [this, sg]() mutable -> awaitable<void> {
+			demand_posted_ = false;
+			msg::worker_demand m;
+			m.tcp_share_id = share_id_;
+			m.idle = static_cast<int>(wq_.vq_.size() + reuse_wq_.vq_.size());
+			m.waiting = static_cast<int>(nr_waiting_.get());
+			if (m.waiting <= 0) {
+				co_return;
+			}
+			logger_.trace(FMT_COMPILE("asking for workers, {} visitors waiting"), m.waiting);
+			try {
+				co_await ctrl_->to_send_.provide(marshal_msg(m, ctrl_->fmt_));
+			} catch (...) {}
+		}, asio::detached);
+	});
+}
+
 inline tcp_share_worker::tcp_share_worker(asio::io_context &ioc, tcp_share_ptr_t share, int id, tcp::socket s)
-		: ioc_(ioc), share_(share), id_(id), s_(move(s)), to_send_(ioc.get_executor()), logger_(log::tag_tcp_share_worker{share->share_id_, id}), ddl_(ioc)
+		: ioc_(ioc), share_(share), id_(id), s_(move(s)), to_send_(ioc.get_executor()), confirms_(share->ctrl_->version_ < 5), logger_(log::tag_tcp_share_worker{share->share_id_, id}), ddl_(ioc), ping_timer_(ioc), pongs_in_(ioc)
 {
 	share_->nr_workers_ ++;
 }
@@ -353,6 +610,10 @@ inline void tcp_share_worker::try_stop() noexcept {
 		ddl_.expires_at(steady_timer::time_point::max());
 		ddl_.cancel();
 	} catch (...) {}
+	try {
+		ping_timer_.cancel();
+		pongs_in_.cancel();
+	} catch (...) {}
 }
 
 inline void tcp_share_worker::handle_error(const exception& e) noexcept {
@@ -379,16 +640,23 @@ inline void tcp_share_worker::run() {
 	co_spawn(ioc_, [this, sg]() mutable -> awaitable<void> {
 		co_await ddl_actor();
 	}, asio::detached);
+	if (!confirms_) {
+		co_spawn(ioc_, [this, sg]() mutable -> awaitable<void> {
+			co_await ping_actor();
+		}, asio::detached);
+	}
 }
 
 inline awaitable<void> tcp_share_worker::recv_msgs() {
 	try {
 		for (;;) {
-			set_ddl("recv_msgs()", std::chrono::seconds(60));
-			auto in = co_await recv_msg(s_);
+			if (!visiting_) { // visit() has a deadline of its own
+				set_ddl("recv_msgs()", std::chrono::seconds(60));
+			}
+			auto in = co_await codec_.recv(s_);
 			co_await std::visit([this](auto&& m) mutable -> auto {
 				return this->handle_msg(forward<decltype(m)>(m));
-			}, unmarshal_msg<msg::ping>(in));
+			}, unmarshal_msg<msg::ping, msg::pong, msg::worker_retire>(in));
 		}
 	} catch (const exception& e) {
 		handle_error(e);
@@ -399,9 +667,18 @@ inline awaitable<void> tcp_share_worker::send_msgs() {
 	try {
 		for (;;) {
 			msg_t m = co_await to_send_.wait();
-			co_await send_msg(s_, m);
+			if (m.empty()) {
+				co_return; // put by visit(), everything before is written
+			}
+			co_await codec_.send_batch(s_, move(m), [this]() {
+				// visit() is done once its empty message is taken, so not before the write
+				return to_send_.try_take_if([](const msg_t& next) {
+					return !next.empty();
+				});
+			});
 		}
 	} catch (const exception& e) {
+		to_send_.close(); // fails a visit() waiting for its message to be written
 		handle_error(e);
 	}
 }
@@ -432,7 +709,7 @@ inline awaitable<void> tcp_share_worker::ddl_actor() {
 				co_return;
 			}
 			if (ddl_.expiry() <= steady_timer::clock_type::now()) {
-				logger_.warning(fmt::format(FMT_COMPILE("timeout exceeded : {}"), ddl_action_));
+				logger_.warning(FMT_COMPILE("timeout exceeded : {}"), ddl_action_);
 				try_stop();
 				co_return;
 			}
@@ -442,36 +719,100 @@ inline awaitable<void> tcp_share_worker::ddl_actor() {
 	}
 }
 
+/**
+ * Since version 5 the client writes nothing on an idle worker but pongs to
+ * these pings, so that any byte after the visit message is from the visitor.
+ * visit() waits for the pongs due first, and a client that stops answering
+ * runs into the deadline of recv_msgs().
+ */
+inline awaitable<void> tcp_share_worker::ping_actor() {
+	try {
+		for (;;) {
+			ping_timer_.expires_after(std::chrono::seconds(20));
+			co_await ping_timer_.async_wait(asio::use_awaitable);
+			if (stopping_ || visiting_) {
+				co_return;
+			}
+			msg::ping ping;
+			pongs_due_++;
+			co_await to_send_.provide(marshal_msg(ping, share_->ctrl_->fmt_));
+			logger_.trace("sent a ping");
+		}
+	} catch (const system_error& se) {
+		if (se.code() != asio::error::operation_aborted) {
+			handle_error(se);
+		}
+	}
+}
+
 inline awaitable<void> tcp_share_worker::handle_msg(msg::ping) {
 	logger_.trace("recv a ping");
 	msg::pong pong;
-	co_await to_send_.provide(marshal_msg(pong));
+	co_await to_send_.provide(marshal_msg(pong, share_->ctrl_->fmt_));
 	logger_.trace("sent a pong");
 }
 
+inline awaitable<void> tcp_share_worker::handle_msg(msg::pong) {
+	logger_.trace("recv a pong");
+	if (pongs_due_ > 0 && --pongs_due_ == 0) {
+		pongs_in_.cancel();
+	}
+	co_return;
+}
+
+inline awaitable<void> tcp_share_worker::handle_msg(msg::worker_retire) {
+	logger_.trace("retired by client");
+	try_stop();
+	co_return;
+}
+
 inline awaitable<tcp::socket> tcp_share_worker::visit(const tcp::endpoint ep) {
 	auto exec = co_await this_coro::executor;
 	co_await asio::co_spawn(ioc_, [this, ep]() mutable -> awaitable<void> {
+		visiting_ = true;
+		ping_timer_.cancel();
+		set_ddl("visit()", std::chrono::seconds(20));
+
+		while (pongs_due_ > 0 && !stopping_) { // a pong after the visit message would go to the visitor
+			pongs_in_.expires_at(steady_timer::time_point::max());
+			try {
+				co_await pongs_in_.async_wait(asio::use_awaitable);
+			} catch (const system_error & se) {
+				if (se.code() != asio::error::operation_aborted) {
+					throw;
+				}
+			}
+		}
+		if (stopping_) {
+			throw system_error{asio::error::operation_aborted};
+		}
 		visited_ = true;
 		s_.cancel();
 
-		set_ddl("visit()", std::chrono::seconds(20));
-
 		msg::visit_tcp_share v;
 		v.epoch = chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
 		string ip = ep.address().to_string();
-		if (cfg.access_log)
-			share_->logger_.access(fmt::format(FMT_COMPILE("accessed from ip {} port {}"), ip, ep.port()));
+		if (access_log_lines())
+			share_->logger_.access(FMT_COMPILE("accessed from ip {} port {}"), ip, ep.port());
 		v.peer.ip = ip;
 		v.peer.port = ep.port();
-		co_await to_send_.provide(marshal_msg(v));
+		co_await to_send_.provide(marshal_msg(v, share_->ctrl_->fmt_));
+
+		if (!confirms_) {
+			// taken once the visit message is out, the visitor's bytes may follow
+			co_await to_send_.provide(msg_t{});
+			to_send_.close();
+			visited_confirmed_ = true;
+			cancel_ddl();
+			co_return;
+		}
 		to_send_.close();
 
 	retry:
-		auto in = co_await recv_msg(s_);
-		auto m = unmarshal_msg<msg::ping, msg::visit_confirmed>(in);
-		if (std::holds_alternative<msg::ping>(m)) {
-			goto retry;
+		auto in = co_await codec_.recv(s_);
+		auto m = unmarshal_msg<msg::ping, msg::worker_retire, msg::visit_confirmed>(in);
+		if (!std::holds_alternative<msg::visit_confirmed>(m)) {
+			goto retry; // a retire crossing the visit is answered by the visit
 		}
 
 		visited_confirmed_ = true;
@@ -483,7 +824,7 @@ inline awaitable<tcp::socket> tcp_share_worker::visit(const tcp::endpoint ep) {
 }
 
 inline controller_socket::controller_socket(asio::io_context &ioc, asio::io_context &fwd_ioc, tcp::socket s, string client_uuid)
-	: ioc_(ioc), fwd_ioc_(fwd_ioc), s_(move(s)), client_uuid_(client_uuid), to_send_(ioc.get_executor()), logger_(log::tag_controller{client_uuid}), ddl_(ioc)
+	: ioc_(ioc), fwd_ioc_(fwd_ioc), s_(move(s)), client_uuid_(client_uuid), to_send_(ioc.get_executor(), msg_batch_max), logger_(log::tag_controller{client_uuid}), ddl_(ioc)
 {
 	logger_.info("connected");
 }
@@ -492,16 +833,54 @@ inline shared_ptr<controller_socket> controller_socket::create(asio::io_context
 	return make_shared<controller_socket>(ioc, fwd_ioc, move(s), move(client_uuid));
 }
 
-inline tcp_share_ptr_t controller_socket::add_tcp_share(string share_id, unsigned short port) {
-	logger_.info(fmt::format(FMT_COMPILE("add tcp share : {} at port {}"), share_id, port));
-	tcp_share_ptr_t sh = tcp_share::create(ioc_, fwd_ioc_, this->shared_from_this(), share_id, port);
+inline tcp_share_ptr_t controller_socket::add_tcp_share(string share_id, unsigned short port, pipe_options popts) {
+	logger_.info(FMT_COMPILE("add tcp share : {} at port {}"), share_id, port);
+	tcp_share_ptr_t sh = tcp_share::create(ioc_, fwd_ioc_, this->shared_from_this(), share_id, port, popts);
 	shares_.emplace(share_id, sh);
 	sh->run();
 	return sh;
 }
 
+inline void controller_socket::add_tunnel(shared_ptr<mux_tunnel> t) {
+	lock_guard lk{tunnels_mtx_};
+	std::erase_if(tunnels_, [](auto& it) {
+		return it.expired();
+	});
+	tunnels_.emplace_back(move(t));
+}
+
+// on the tunnel carrying the fewest streams
+inline mux_socket controller_socket::open_stream(string payload) {
+	shared_ptr<mux_tunnel> best;
+	size_t best_nr = 0;
+	{
+		lock_guard lk{tunnels_mtx_};
+		for (auto& it : tunnels_) {
+			if (auto t = it.lock()) {
+				size_t nr = t->nr_streams();
+				if (!best || nr < best_nr) {
+					best = move(t);
+					best_nr = nr;
+				}
+			}
+		}
+	}
+	if (!best) {
+		throw exceptions::no_tunnel{};
+	}
+	return best->open_stream(move(payload));
+}
+
 inline void controller_socket::try_stop() noexcept {
 	stopping_ = true;
+	{
+		lock_guard lk{tunnels_mtx_};
+		for (auto& it : tunnels_) {
+			if (auto t = it.lock()) {
+				t->try_stop();
+			}
+		}
+	}
 	to_send_.close();
 	try {
 		s_.close();
@@ -541,10 +920,10 @@ inline awaitable<void> controller_socket::recv_msgs() {
 	try {
 		for (;;) {
 			set_ddl("recv_msgs()", std::chrono::seconds(60));
-			auto in = co_await recv_msg(s_);
+			auto in = co_await codec_.recv(s_);
 			co_await visit([this](auto&& m) mutable -> auto {
 				return this->handle_msg(forward<decltype(m)>(m));
-			}, unmarshal_msg<msg::ping>(in));
+			}, unmarshal_msg<msg::ping, msg::worker_retire>(in));
 		}
 	} catch (const exception& e) {
 		handle_error(e);
@@ -554,19 +933,43 @@ inline awaitable<void> controller_socket::recv_msgs() {
 inline awaitable<void> controller_socket::handle_msg(msg::ping) {
 	logger_.trace("recv a ping");
 	msg::pong pong;
-	co_await to_send_.provide(marshal_msg(pong));
+	co_await to_send_.provide(marshal_msg(pong, fmt_));
 	logger_.trace("sent a pong");
 }
 
+// a worker already visited is left alone, the client serves the visit
+inline awaitable<void> controller_socket::handle_msg(msg::worker_retire m) {
+	auto it = shares_.find(string{m.tcp_share_id});
+	if (it == shares_.end()) {
+		co_return;
+	}
+	auto sh = it->second.lock();
+	if (!sh) {
+		co_return;
+	}
+	auto wit = sh->workers_.find(m.worker_id);
+	if (wit == sh->workers_.end()) {
+		co_return;
+	}
+	if (auto w = wit->second.lock()) {
+		w->logger_.trace("retired by client");
+		w->try_stop();
+	}
+}
+
 inline awaitable<void> controller_socket::send_msgs() {
 	msg::server_hello hello;
-	hello.version = 0; // TODO
+	hello.version = version_;
 	hello.welcome = welcome_msg;
-	co_await send_msg(s_, marshal_msg(hello));
+	hello.tunnels = tunnels_enabled_;
+	hello.reuse_workers = reuse_workers_;
+	co_await codec_.send(s_, marshal_msg(hello));
 	try {
 		for (;;) {
 			msg_t m = co_await to_send_.wait();
-			co_await send_msg(s_, m);
+			co_await codec_.send_batch(s_, move(m), [this]() {
+				return to_send_.try_take();
+			});
 		}
 	} catch (const exception& e) {
 		handle_error(e);
@@ -596,7 +999,7 @@ inline awaitable<void> controller_socket::ddl_actor() {
 				co_return;
 			}
 			if (ddl_.expiry() <= steady_timer::clock_type::now()) {
-				logger_.warning(fmt::format(FMT_COMPILE("timeout exceeded : {}"), ddl_action_));
+				logger_.warning(FMT_COMPILE("timeout exceeded : {}"), ddl_action_);
 				try_stop();
 				co_return;
 			}
@@ -607,7 +1010,7 @@ inline awaitable<void> controller_socket::ddl_actor() {
 }
 
 inline server::server(asio::io_context &ioc, asio::io_context &fwd_ioc)
-	: ioc_(ioc), fwd_ioc_(fwd_ioc), ac_(ioc, {asio::ip::address::from_string(cfg.server_host), cfg.server_port}), logger_(log::tag_server{})
+	: ioc_(ioc), fwd_ioc_(fwd_ioc), ac_(batch_acceptor::create(ioc, {asio::ip::address::from_string(cfg.server_host), cfg.server_port}, static_cast<size_t>(cfg.accept_batch))), logger_(log::tag_server{}), stats_timer_(ioc)
 {}
 
 inline shared_ptr<server> server::create(asio::io_context &ioc, asio::io_context &fwd_ioc) {
@@ -616,17 +1019,27 @@ inline shared_ptr<server> server::create(asio::io_context &ioc, asio::io_context
 
 inline void server::try_stop() noexcept {
 	stopping_ = true;
+	lock_guard lk{mtx_};
 	for (auto& it : ctrls_) {
 		if (auto ptr = it.second.lock()) {
-			ptr->try_stop();
+			asio::post(ptr->ioc_, [ptr]() {
+				ptr->try_stop();
+			});
 		}
 	}
 	for (auto& it : sockets_) {
 		if (auto ptr = it.lock()) {
-			ptr->try_stop();
+			asio::post(ptr->ioc_, [ptr]() {
+				ptr->try_stop();
+			});
 		}
 	}
-	ac_.close();
+	asio::post(ac_->ioc_, [ac = ac_]() {
+		ac->close();
+	});
+	try {
+		stats_timer_.cancel();
+	} catch (...) {}
 }
 
 inline void server::handle_error(const exception &e) noexcept {
@@ -646,13 +1059,19 @@ inline void server::run() {
 			co_await sg->serve();
 		} catch(...) {};
 	}, asio::detached);
+	if (cfg.stats_interval > 0) {
+		co_spawn(ioc_, [this, sg]() mutable -> awaitable<void> {
+			co_await stats_actor();
+		}, asio::detached);
+	}
 }
 
 inline awaitable<void> server::serve() {
 	try {
 		auto sg = this->shared_from_this();
 		for (;;) {
-			tcp::socket s = co_await ac_.async_accept(asio::use_awaitable);
+			tcp::endpoint ep;
+			tcp::socket s = co_await ac_->accept(ep);
 			handle_socket(move(s));
 		}
 	} catch(const exception &e) {
@@ -661,16 +1080,38 @@ inline awaitable<void> server::serve() {
 	}
 }
 
+inline awaitable<void> server::stats_actor() {
+	try {
+		while (!stopping_) {
+			stats_timer_.expires_after(chrono::seconds{cfg.stats_interval});
+			co_await stats_timer_.async_wait(asio::use_awaitable);
+			log::as(log::tag_stats{}).info(stats::report());
+		}
+	} catch (const system_error & se) {
+		if (se.code() != asio::error::operation_aborted) {
+			handle_error(se);
+		}
+	}
+}
+
 inline void server::cleanup_sockets() {
 	sockets_.remove_if([](auto it) -> bool {
 		return it.expired();
 	});
 }
 
+/**
+ * The hello is parsed on the next control shard, and whatever it creates
+ * stays there, so that a reconnect storm is spread over control_threads.
+ */
 inline void server::handle_socket(tcp::socket s) {
-	auto ptr = server::socket_type::create(ioc_, fwd_ioc_, move(s), this->shared_from_this());
-	cleanup_sockets();
-	sockets_.push_back(ptr);
+	asio::io_context &shard = pick_shard(ioc_);
+	auto ptr = server::socket_type::create(shard, fwd_ioc_, rebind_ioc(shard, move(s)), this->shared_from_this());
+	{
+		lock_guard lk{mtx_};
+		cleanup_sockets();
+		sockets_.push_back(ptr);
+	}
 	ptr->run();
 }
 
@@ -723,7 +1164,7 @@ inline awaitable<void> server::socket_type::recv_hello() {
 		auto m = co_await recv_msg(s_);
 		co_await visit([this](auto msg) mutable -> awaitable<void> {
 			return handle_hello_msg(msg);
-		}, unmarshal_msg<msg::client_hello, msg::tcp_share_worker_hello>(m));
+		}, unmarshal_msg<msg::client_hello, msg::tcp_share_worker_hello, msg::tunnel_hello>(m));
 		finished_ = true;
 		try_stop();
 	} catch(const exception &e) {
@@ -754,6 +1195,13 @@ inline awaitable<void> server::socket_type::handle_hello_msg(msg::client_hello h
 	string client_uuid{hello.client_uuid};
 
 	ctrl_ptr_t ctrl = ctrl_t::create(ioc_, fwd_ioc_, move(s_), client_uuid);
+	ctrl->version_ = std::min(hello.version, protocol_version);
+	ctrl->tunnels_enabled_ = cfg.allow_tunnels && ctrl->version_ >= 1 && hello.tunnels > 0;
+	ctrl->reuse_workers_ = cfg.allow_worker_reuse && ctrl->version_ >= 4 && hello.reuse_workers && !ctrl->tunnels_enabled_;
+	ctrl->fmt_ = ctrl->version_ >= 6 && !cfg.json_msgs ? msg_format::binary : msg_format::json;
+
+	// the controller and its shares are owned by this shard from now on
+	lock_guard lk{server_->mtx_};
 	if (server_->ctrls_.find(client_uuid) == server_->ctrls_.end()) {
 		server_->ctrls_.emplace(client_uuid, ctrl);
 	} else {
@@ -767,10 +1215,10 @@ inline awaitable<void> server::socket_type::handle_hello_msg(msg::client_hello h
 	for (auto it : hello.tcp_shares) {
 		string id{it.id};
 		if (server_->tcp_shares_.find(id) == server_->tcp_shares_.end()) {
-			server_->tcp_shares_.emplace(it.id, ctrl->add_tcp_share(id, it.port));
+			server_->tcp_shares_.emplace(it.id, ctrl->add_tcp_share(id, it.port, share_pipe_options(it)));
 		} else {
 			if (server_->tcp_shares_.at(id).expired()) {
-				server_->tcp_shares_.at(id) = ctrl->add_tcp_share(id, it.port);
+				server_->tcp_shares_.at(id) = ctrl->add_tcp_share(id, it.port, share_pipe_options(it));
 			} else {
 				throw exceptions::duplicate_tcp_share{id};
 			}
@@ -784,27 +1232,67 @@ inline awaitable<void> server::socket_type::handle_hello_msg(msg::client_hello h
 inline awaitable<void> server::socket_type::handle_hello_msg(msg::tcp_share_worker_hello hello) {
 	string tcp_share_id{hello.tcp_share_id};
 
-	if (auto tcp_share = server_->tcp_shares_.at(tcp_share_id).lock()) {
-
-		tcp_share_worker_weak_ptr_t worker_weak_ptr;
-		{
-			auto worker_ptr = tcp_share_worker::create(ioc_, tcp_share, hello.worker_id, move(s_));
-			worker_ptr->run();
-			worker_weak_ptr = worker_ptr;
-		}
-		co_spawn(ioc_, [tcp_share, worker_weak_ptr]() mutable -> awaitable<void> {
-			co_await tcp_share->got_worker(worker_weak_ptr);
+	tcp_share_ptr_t tcp_share;
+	{
+		lock_guard lk{server_->mtx_};
+		tcp_share = server_->tcp_shares_.at(tcp_share_id).lock();
+	}
+	if (tcp_share) {
+		// the worker joins the shard owning the share, which may not be ours
+		asio::io_context &owner = tcp_share->ioc_;
+		if (hello.reuse) {
+			if (!tcp_share->ctrl_->reuse_workers_) {
+				throw exceptions::tunnel_protocol_error{"reusable worker from a client not reusing workers"};
+			}
+			asio::io_context &shard = pick_shard(fwd_ioc_);
+			auto t = mux_tunnel::create(shard, rebind_ioc(shard, move(s_)), log::tag_tunnel{tcp_share_id, hello.worker_id}, tunnel_window, false);
+			asio::post(owner, [tcp_share, t]() {
+				tcp_share->got_reusable(t);
+			});
 			co_return;
-		}, asio::detached);
+		}
+
+		asio::post(owner, [tcp_share, id = hello.worker_id, s = rebind_ioc(owner, move(s_))]() mutable {
+			tcp_share_worker_weak_ptr_t worker_weak_ptr;
+			{
+				auto worker_ptr = tcp_share_worker::create(tcp_share->ioc_, tcp_share, id, move(s));
+				worker_ptr->run();
+				worker_weak_ptr = worker_ptr;
+			}
+			co_spawn(tcp_share->ioc_, [tcp_share, worker_weak_ptr]() mutable -> awaitable<void> {
+				co_await tcp_share->got_worker(worker_weak_ptr);
+				co_return;
+			}, asio::detached);
+		});
 	} else {
 		throw exceptions::tcp_share_closed{};
 	}
 	co_return;
 }
 
-}
+inline awaitable<void> server::socket_type::handle_hello_msg(msg::tunnel_hello hello) {
+	string client_uuid{hello.client_uuid};
 
-}
+	ctrl_ptr_t ctrl;
+	{
+		lock_guard lk{server_->mtx_};
+		auto it = server_->ctrls_.find(client_uuid);
+		if (it != server_->ctrls_.end()) {
+			ctrl = it->second.lock();
+		}
+	}
+	if (!ctrl || !ctrl->tunnels_enabled_) {
+		throw exceptions::tunnel_protocol_error{"tunnel from a client not using tunnels"};
+	}
 
+	asio::io_context &shard = pick_shard(fwd_ioc_);
+	auto t = mux_tunnel::create(shard, rebind_ioc(shard, move(s_)), log::tag_tunnel{client_uuid, hello.tunnel_id}, tunnel_window, false);
+	t->run();
+	ctrl->add_tunnel(t);
+	t->logger_.info("connected");
+	co_return;
+}
 
+}
 
+}
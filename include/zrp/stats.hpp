@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: BSL-1.0
+// copyleft 2021 youcai <omegacoleman@gmail.com>
+// Distributed under the Boost Software License, Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include "zrp/bindings.hpp"
+
+namespace zrp {
+
+namespace stats {
+
+/**
+ * Process wide counters, updated relaxed from any thread and read from time
+ * to time by the stats reporter.
+ */
+struct gauge {
+	atomic<int64_t> v_ = 0;
+
+	void add(int64_t d) noexcept {
+		v_.fetch_add(d, std::memory_order_relaxed);
+	}
+
+	void sub(int64_t d) noexcept {
+		v_.fetch_sub(d, std::memory_order_relaxed);
+	}
+
+	int64_t get() const noexcept {
+		return v_.load(std::memory_order_relaxed);
+	}
+};
+
+struct scoped_gauge {
+	gauge &g_;
+
+	scoped_gauge(gauge &g) noexcept
+		: g_(g)
+	{
+		g_.add(1);
+	}
+
+	~scoped_gauge() {
+		g_.sub(1);
+	}
+};
+
+static inline gauge pipes;
+static inline gauge pipes_bytes;
+static inline gauge pipe_directions_idle;
+static inline gauge buffers_in_use_bytes;
+static inline gauge buffers_cached_bytes;
+static inline gauge workers_idle;
+static inline gauge workers_target;
+static inline gauge ctrl_msgs_sent;
+static inline gauge ctrl_msg_writes;
+static inline gauge log_lines_dropped;
+
+inline string report() {
+	int64_t nr_pipes = pipes.get();
+	int64_t per_pipe = nr_pipes > 0 ? (pipes_bytes.get() + buffers_in_use_bytes.get()) / nr_pipes : 0;
+	string ret = fmt::format(FMT_COMPILE("pipes {} (idle directions {}), buffers in use {} KiB, buffers cached {} KiB, {} bytes per pipe"),
+		nr_pipes,
+		pipe_directions_idle.get(),
+		buffers_in_use_bytes.get() / 1024,
+		buffers_cached_bytes.get() / 1024,
+		per_pipe);
+	if (workers_target.get() > 0) {
+		ret += fmt::format(FMT_COMPILE(", idle workers {} (target {})"), workers_idle.get(), workers_target.get());
+	}
+	if (int64_t writes = ctrl_msg_writes.get(); writes > 0) {
+		ret += fmt::format(FMT_COMPILE(", {:.2f} control messages per write"), static_cast<double>(ctrl_msgs_sent.get()) / writes);
+	}
+	if (int64_t dropped = log_lines_dropped.get(); dropped > 0) {
+		ret += fmt::format(FMT_COMPILE(", {} log lines dropped"), dropped);
+	}
+	return ret;
+}
+
+}
+
+}
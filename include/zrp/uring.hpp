@@ -0,0 +1,615 @@
+// SPDX-License-Identifier: BSL-1.0
+// copyleft 2021 youcai <omegacoleman@gmail.com>
+// Distributed under the Boost Software License, Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include "zrp/bindings.hpp"
+
+#include "zrp/buffer_pool.hpp"
+#include "zrp/completion_handler.hpp"
+#include "zrp/log.hpp"
+
+#if defined (__linux__) && __has_include(<linux/io_uring.h>)
+
+#include <cstring>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+#define ZRP_HAS_IO_URING 1
+
+namespace zrp {
+
+	struct uring_options {
+		unsigned entries = 4096;
+		size_t buffer_count = 1024;
+		size_t buffer_size = 16384;
+		bool sqpoll = false;
+	};
+
+	namespace detail {
+
+		inline int sys_io_uring_setup(unsigned entries, io_uring_params *p) noexcept {
+			return static_cast<int>(::syscall(__NR_io_uring_setup, entries, p));
+		}
+
+		inline int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) noexcept {
+			return static_cast<int>(::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+		}
+
+		inline int sys_io_uring_register(int fd, unsigned opcode, const void *arg, unsigned nr_args) noexcept {
+			return static_cast<int>(::syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+		}
+
+		template <class T>
+		inline T load_acquire(T *p) noexcept {
+			return std::atomic_ref<T>(*p).load(std::memory_order_acquire);
+		}
+
+		template <class T>
+		inline void store_release(T *p, T v) noexcept {
+			std::atomic_ref<T>(*p).store(v, std::memory_order_release);
+		}
+
+	}
+
+	/**
+	 * One submission of one or two linked sqes, lives in the frame of the
+	 * awaiting coroutine. res_ holds cqe results in order, negative for -errno.
+	 */
+	struct uring_op {
+		completion_handler<void(error_code)> handler_;
+		int res_[2] = {0, 0};
+		int nr_ = 0;
+		int done_ = 0;
+
+		// from reap(), the awaiting coroutine resumes right there when it runs
+		// on the same thread, and its next submission joins the batch
+		void complete(int res) {
+			res_[done_++] = res;
+			if (done_ == nr_) {
+				auto h = move(handler_);
+				h.dispatch({});
+			}
+		}
+	};
+
+	struct uring_service;
+
+	/**
+	 * A buffer registered to the ring, or a pooled one when all the
+	 * registered ones are taken.
+	 */
+	struct uring_buffer {
+		uring_service *svc_ = nullptr;
+		int index_ = -1;
+		char *data_ = nullptr;
+		size_t size_ = 0;
+		pooled_buffer spare_;
+		iovec iov_{};
+
+		uring_buffer() = default;
+		uring_buffer(const uring_buffer&) = delete;
+		uring_buffer& operator=(const uring_buffer&) = delete;
+		uring_buffer(uring_buffer&& o) noexcept
+			: svc_(o.svc_), index_(o.index_), data_(o.data_), size_(o.size_), spare_(move(o.spare_))
+		{
+			o.svc_ = nullptr;
+			o.index_ = -1;
+		}
+		~uring_buffer();
+
+		bool registered() const noexcept {
+			return index_ >= 0;
+		}
+	};
+
+	/**
+	 * An io_uring instance attached to an io_context. Completions are
+	 * signalled through an eventfd watched by the io_context, the coroutines
+	 * they resume submit again right away and reap() flushes all of that with
+	 * a single io_uring_enter (or none at all with sqpoll). Submissions from
+	 * elsewhere are flushed once per turn of the event loop.
+	 */
+	struct uring_service : asio::execution_context::service {
+		static inline asio::execution_context::id id;
+
+		asio::io_context &ioc_;
+		int fd_ = -1;
+		io_uring_params params_{};
+
+		void *sq_ptr_ = nullptr;
+		size_t sq_sz_ = 0;
+		void *cq_ptr_ = nullptr;
+		size_t cq_sz_ = 0;
+		io_uring_sqe *sqes_ = nullptr;
+		size_t sqes_sz_ = 0;
+
+		unsigned *sq_head_ = nullptr;
+		unsigned *sq_tail_ = nullptr;
+		unsigned *sq_mask_ = nullptr;
+		unsigned *sq_entries_ = nullptr;
+		unsigned *sq_flags_ = nullptr;
+		unsigned *sq_array_ = nullptr;
+		unsigned sq_tail_local_ = 0;
+
+		unsigned *cq_head_ = nullptr;
+		unsigned *cq_tail_ = nullptr;
+		unsigned *cq_mask_ = nullptr;
+		io_uring_cqe *cqes_ = nullptr;
+
+		mutex mtx_;
+		atomic<bool> flush_posted_ = false;
+		atomic<size_t> inflight_ = 0; // sqes submitted and not yet reaped
+
+		asio::strand<asio::io_context::executor_type> strand_; // reap() and stop() run on it
+		asio::posix::stream_descriptor ev_;
+		bool stopping_ = false; // on strand_
+
+		size_t buffer_size_ = 0;
+		unique_ptr<char[]> buffers_;
+		vector<int> free_buffers_;
+		mutex buffers_mtx_;
+
+		bool sqpoll_ = false;
+		log::logger logger_;
+
+		uring_service(asio::execution_context &ctx)
+			: asio::execution_context::service(ctx), ioc_(static_cast<asio::io_context&>(ctx)), strand_(asio::make_strand(ioc_)), ev_(ioc_), logger_(log::tag_io_uring{})
+		{}
+
+		~uring_service() {
+			close();
+		}
+
+		void shutdown() override {
+			close();
+		}
+
+		bool is_open() const noexcept {
+			return fd_ >= 0;
+		}
+
+		// from any thread, whether new submissions can still go through
+		bool accepting() {
+			lock_guard<mutex> lk{mtx_};
+			return is_open();
+		}
+
+		void open(const uring_options &opts, error_code &ec) {
+			io_uring_params p{};
+			p.flags = IORING_SETUP_CQSIZE;
+			p.cq_entries = opts.entries * 4;
+			if (opts.sqpoll) {
+				p.flags |= IORING_SETUP_SQPOLL;
+				p.sq_thread_idle = 1000;
+			}
+			fd_ = detail::sys_io_uring_setup(opts.entries, &p);
+			if (fd_ < 0) {
+				ec = last_error();
+				fd_ = -1;
+				return;
+			}
+			params_ = p;
+			sqpoll_ = opts.sqpoll;
+
+			// a read or write on a blocking socket that has to wait would otherwise
+			// park a kernel worker, this comes with linux 5.7, after
+			// IORING_SETUP_CQSIZE and the ops probed below
+			if (!(p.features & IORING_FEAT_FAST_POLL)) {
+				logger_.warning("io_uring lacks IORING_FEAT_FAST_POLL, linux 5.7 or newer is needed");
+				ec = make_error_code(errc::not_supported);
+				close();
+				return;
+			}
+			if (!probe_ops(ec)) {
+				close();
+				return;
+			}
+
+			sq_sz_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+			cq_sz_ = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+			bool single_mmap = p.features & IORING_FEAT_SINGLE_MMAP;
+			if (single_mmap) {
+				sq_sz_ = cq_sz_ = std::max(sq_sz_, cq_sz_);
+			}
+			sq_ptr_ = ::mmap(nullptr, sq_sz_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+			if (sq_ptr_ == MAP_FAILED) {
+				sq_ptr_ = nullptr;
+				return fail(ec);
+			}
+			if (single_mmap) {
+				cq_ptr_ = sq_ptr_;
+			} else {
+				cq_ptr_ = ::mmap(nullptr, cq_sz_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+				if (cq_ptr_ == MAP_FAILED) {
+					cq_ptr_ = nullptr;
+					return fail(ec);
+				}
+			}
+			sqes_sz_ = p.sq_entries * sizeof(io_uring_sqe);
+			void *sqes = ::mmap(nullptr, sqes_sz_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+			if (sqes == MAP_FAILED) {
+				return fail(ec);
+			}
+			sqes_ = static_cast<io_uring_sqe*>(sqes);
+
+			char *sq = static_cast<char*>(sq_ptr_);
+			sq_head_ = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+			sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+			sq_mask_ = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+			sq_entries_ = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_entries);
+			sq_flags_ = reinterpret_cast<unsigned*>(sq + p.sq_off.flags);
+			sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+			sq_tail_local_ = *sq_tail_;
+
+			char *cq = static_cast<char*>(cq_ptr_);
+			cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+			cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+			cq_mask_ = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+			cqes_ = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+
+			int efd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+			if (efd < 0) {
+				return fail(ec);
+			}
+			ev_.assign(efd);
+			if (detail::sys_io_uring_register(fd_, IORING_REGISTER_EVENTFD, &efd, 1) < 0) {
+				return fail(ec);
+			}
+
+			register_buffers(opts);
+
+			co_spawn(strand_, [this]() mutable -> awaitable<void> {
+				co_await reap();
+			}, asio::detached);
+		}
+
+		/**
+		 * Closes the ring once every op submitted to it has completed, from any
+		 * thread. Until then reap() keeps the io_context busy, so call it before
+		 * waiting for the io_context to run out of work. Pipes still running
+		 * then fail their next submission.
+		 */
+		void stop() {
+			asio::dispatch(strand_, [this]() {
+				stopping_ = true;
+				if (inflight_ == 0) {
+					close();
+				}
+			});
+		}
+
+		void close() noexcept {
+			error_code ignored;
+			ev_.close(ignored);
+			lock_guard<mutex> lk{mtx_};
+			if (sqes_) {
+				::munmap(sqes_, sqes_sz_);
+				sqes_ = nullptr;
+			}
+			if (cq_ptr_ && cq_ptr_ != sq_ptr_) {
+				::munmap(cq_ptr_, cq_sz_);
+			}
+			cq_ptr_ = nullptr;
+			if (sq_ptr_) {
+				::munmap(sq_ptr_, sq_sz_);
+				sq_ptr_ = nullptr;
+			}
+			if (fd_ >= 0) {
+				::close(fd_);
+				fd_ = -1;
+			}
+		}
+
+		uring_buffer acquire_buffer() {
+			uring_buffer ret;
+			{
+				lock_guard<mutex> lk{buffers_mtx_};
+				if (!free_buffers_.empty()) {
+					ret.svc_ = this;
+					ret.index_ = free_buffers_.back();
+					free_buffers_.pop_back();
+					ret.data_ = buffers_.get() + ret.index_ * buffer_size_;
+					ret.size_ = buffer_size_;
+					return ret;
+				}
+			}
+			ret.spare_ = buffer_pool::local().acquire(buffer_size_);
+			ret.size_ = buffer_size_;
+			ret.data_ = ret.spare_.data();
+			return ret;
+		}
+
+		void release_buffer(int index) noexcept {
+			lock_guard<mutex> lk{buffers_mtx_};
+			free_buffers_.push_back(index);
+		}
+
+		// waits for fd to be readable, or closed, holding no buffer
+		awaitable<int> async_poll_in(uring_op &op, int fd) {
+			co_await async_submit(op, 1, [&](io_uring_sqe **sqes) {
+				prep_rw(sqes[0], IORING_OP_POLL_ADD, fd, nullptr, 0);
+				sqes[0]->off = 0;
+				sqes[0]->poll_events = POLLIN; // the low half of poll32_events, whatever the byte order
+			});
+			co_return op.res_[0];
+		}
+
+		awaitable<int> async_read(uring_op &op, int fd, uring_buffer &buf) {
+			co_await async_submit(op, 1, [&](io_uring_sqe **sqes) {
+				prep_read(sqes[0], fd, buf, buf.size_);
+			});
+			co_return op.res_[0];
+		}
+
+		/**
+		 * Writes buf[off, off + len) then reads into buf again, the read is
+		 * linked so it is cancelled if the write fails or comes up short. The
+		 * read does not wait, it gives -EAGAIN once the socket runs dry.
+		 */
+		awaitable<tuple<int, int>> async_write_then_read(uring_op &op, int wfd, uring_buffer &buf, size_t off, size_t len, int rfd) {
+			co_await async_submit(op, 2, [&](io_uring_sqe **sqes) {
+				prep_write(sqes[0], wfd, buf, off, len);
+				sqes[0]->flags |= IOSQE_IO_LINK;
+				prep_recv_nowait(sqes[1], rfd, buf);
+			});
+			co_return make_tuple(op.res_[0], op.res_[1]);
+		}
+
+	private:
+
+		static error_code last_error() noexcept {
+			return error_code(errno, asio::error::get_system_category());
+		}
+
+		void fail(error_code &ec) noexcept {
+			ec = last_error();
+			close();
+		}
+
+		// every op the pipes submit
+		static constexpr uint8_t ops_used[] = {
+			IORING_OP_NOP,
+			IORING_OP_READV,
+			IORING_OP_READ_FIXED,
+			IORING_OP_WRITE_FIXED,
+			IORING_OP_WRITE,
+			IORING_OP_POLL_ADD,
+			IORING_OP_RECV,
+		};
+
+		bool probe_ops(error_code &ec) {
+			const unsigned nr_ops = 256;
+			auto mem = make_unique<char[]>(sizeof(io_uring_probe) + nr_ops * sizeof(io_uring_probe_op));
+			auto *probe = reinterpret_cast<io_uring_probe*>(mem.get());
+			if (detail::sys_io_uring_register(fd_, IORING_REGISTER_PROBE, probe, nr_ops) < 0) {
+				ec = last_error();
+				logger_.warning("probing io_uring ops failed, linux 5.6 or newer is needed : ").with_exception(system_error{ec});
+				return false;
+			}
+			for (uint8_t op : ops_used) {
+				if (op >= probe->ops_len || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+					logger_.warning(FMT_COMPILE("io_uring lacks op {}"), op);
+					ec = make_error_code(errc::not_supported);
+					return false;
+				}
+			}
+			return true;
+		}
+
+		void register_buffers(const uring_options &opts) {
+			buffer_size_ = opts.buffer_size;
+			if (opts.buffer_count == 0) {
+				return;
+			}
+			buffers_ = make_unique<char[]>(opts.buffer_count * buffer_size_);
+			vector<iovec> iovs(opts.buffer_count);
+			for (size_t i = 0; i < opts.buffer_count; i++) {
+				iovs[i].iov_base = buffers_.get() + i * buffer_size_;
+				iovs[i].iov_len = buffer_size_;
+			}
+			if (detail::sys_io_uring_register(fd_, IORING_REGISTER_BUFFERS, iovs.data(), static_cast<unsigned>(iovs.size())) < 0) {
+				logger_.warning("registering buffers failed, using plain buffers : ").with_exception(system_error{last_error()});
+				buffers_.reset();
+				return;
+			}
+			free_buffers_.reserve(opts.buffer_count);
+			for (int i = static_cast<int>(opts.buffer_count) - 1; i >= 0; i--) {
+				free_buffers_.push_back(i);
+			}
+		}
+
+		static void prep_rw(io_uring_sqe *sqe, uint8_t opcode, int fd, const void *addr, unsigned len) noexcept {
+			std::memset(sqe, 0, sizeof(*sqe));
+			sqe->opcode = opcode;
+			sqe->fd = fd;
+			sqe->addr = reinterpret_cast<uint64_t>(addr);
+			sqe->len = len;
+			sqe->off = static_cast<uint64_t>(-1); // current position, as for sockets
+		}
+
+		static void prep_read(io_uring_sqe *sqe, int fd, uring_buffer &buf, size_t len) noexcept {
+			if (buf.registered()) {
+				prep_rw(sqe, IORING_OP_READ_FIXED, fd, buf.data_, static_cast<unsigned>(len));
+				sqe->buf_index = static_cast<uint16_t>(buf.index_);
+			} else {
+				buf.iov_.iov_base = buf.data_;
+				buf.iov_.iov_len = len;
+				prep_rw(sqe, IORING_OP_READV, fd, &buf.iov_, 1);
+			}
+		}
+
+		static void prep_write(io_uring_sqe *sqe, int fd, uring_buffer &buf, size_t off, size_t len) noexcept {
+			if (buf.registered()) {
+				prep_rw(sqe, IORING_OP_WRITE_FIXED, fd, buf.data_ + off, static_cast<unsigned>(len));
+				sqe->buf_index = static_cast<uint16_t>(buf.index_);
+			} else {
+				prep_rw(sqe, IORING_OP_WRITE, fd, buf.data_ + off, static_cast<unsigned>(len));
+			}
+		}
+
+		static void prep_recv_nowait(io_uring_sqe *sqe, int fd, uring_buffer &buf) noexcept {
+			prep_rw(sqe, IORING_OP_RECV, fd, buf.data_, static_cast<unsigned>(buf.size_));
+			sqe->off = 0;
+			sqe->msg_flags = MSG_DONTWAIT;
+		}
+
+		// with mtx_ held
+		io_uring_sqe *get_sqe() {
+			for (int tries = 0; tries < 16; tries++) {
+				unsigned head = detail::load_acquire(sq_head_);
+				if (sq_tail_local_ - head < *sq_entries_) {
+					unsigned idx = sq_tail_local_ & *sq_mask_;
+					sq_array_[idx] = idx;
+					sq_tail_local_++;
+					return &sqes_[idx];
+				}
+				// ring full, push what we have to the kernel right now
+				detail::store_release(sq_tail_, sq_tail_local_);
+				submit_pending();
+				if (tries > 0) {
+					std::this_thread::yield();
+				}
+			}
+			return nullptr;
+		}
+
+		// with mtx_ held
+		void submit_pending() noexcept {
+			unsigned pending = sq_tail_local_ - detail::load_acquire(sq_head_);
+			if (pending == 0) {
+				return;
+			}
+			unsigned flags = 0;
+			if (sqpoll_) {
+				std::atomic_thread_fence(std::memory_order_seq_cst);
+				if (!(std::atomic_ref<unsigned>(*sq_flags_).load(std::memory_order_relaxed) & IORING_SQ_NEED_WAKEUP)) {
+					return;
+				}
+				flags |= IORING_ENTER_SQ_WAKEUP;
+			}
+			int ret;
+			do {
+				ret = detail::sys_io_uring_enter(fd_, pending, 0, flags);
+			} while (ret < 0 && errno == EINTR);
+		}
+
+		void schedule_flush() {
+			if (strand_.running_in_this_thread()) {
+				return; // submitted from a completion, reap() flushes after the batch
+			}
+			if (flush_posted_.exchange(true)) {
+				return;
+			}
+			asio::post(ioc_, [this]() mutable {
+				flush_posted_ = false;
+				lock_guard<mutex> lk{mtx_};
+				if (is_open()) {
+					submit_pending();
+				}
+			});
+		}
+
+		template <class Prep>
+		awaitable<void> async_submit(uring_op &op, int nr, Prep prep) {
+			auto initiation = [this, &op, nr, &prep](auto&& handler) mutable
+			{
+				// once the sqes are published another thread may flush and reap
+				// them, resuming the caller and freeing this lambda with its frame
+				uring_service *self = this;
+				op.handler_ = forward<decltype(handler)>(handler);
+				op.nr_ = nr;
+				op.done_ = 0;
+				{
+					lock_guard<mutex> lk{mtx_};
+					io_uring_sqe *sqes[2] = {nullptr, nullptr};
+					for (int i = 0; i < nr; i++) {
+						sqes[i] = is_open() ? get_sqe() : nullptr;
+						if (!sqes[i]) {
+							// can not happen with nr <= 2 unless the ring is stuck
+							for (int j = 0; j < i; j++) {
+								prep_rw(sqes[j], IORING_OP_NOP, -1, nullptr, 0);
+								sqes[j]->user_data = 0;
+							}
+							detail::store_release(sq_tail_, sq_tail_local_);
+							auto h = move(op.handler_);
+							h(make_error_code(errc::device_or_resource_busy));
+							return;
+						}
+					}
+					prep(sqes);
+					for (int i = 0; i < nr; i++) {
+						sqes[i]->user_data = reinterpret_cast<uint64_t>(&op);
+					}
+					inflight_ += nr;
+					detail::store_release(sq_tail_, sq_tail_local_);
+				}
+				self->schedule_flush();
+			};
+			co_await asio::async_initiate<decltype(asio::use_awaitable), void(error_code)>(initiation, asio::use_awaitable);
+		}
+
+		awaitable<void> reap() {
+			try {
+				uint64_t count;
+				for (;;) {
+					// waiting then reading spares the read that would find it empty
+					co_await ev_.async_wait(asio::posix::descriptor_base::wait_read, asio::use_awaitable);
+					if (::read(ev_.native_handle(), &count, sizeof(count)) < 0 && errno != EAGAIN) {
+						throw system_error{last_error()};
+					}
+					for (;;) {
+						unsigned head = *cq_head_;
+						unsigned tail = detail::load_acquire(cq_tail_);
+						if (head == tail) {
+							break;
+						}
+						for (; head != tail; head++) {
+							const io_uring_cqe &cqe = cqes_[head & *cq_mask_];
+							uring_op *op = reinterpret_cast<uring_op*>(cqe.user_data);
+							int res = cqe.res;
+							detail::store_release(cq_head_, head + 1);
+							if (op) {
+								inflight_--;
+								op->complete(res);
+							}
+						}
+						if (std::atomic_ref<unsigned>(*sq_flags_).load(std::memory_order_relaxed) & IORING_SQ_CQ_OVERFLOW) {
+							detail::sys_io_uring_enter(fd_, 0, 0, IORING_ENTER_GETEVENTS);
+						}
+					}
+					{
+						lock_guard<mutex> lk{mtx_};
+						if (is_open()) {
+							submit_pending();
+						}
+					}
+					if (stopping_ && inflight_ == 0) {
+						close();
+						co_return;
+					}
+				}
+			} catch (const exception& e) {
+				if (is_open()) {
+					logger_.error("reaping completions failed : ").with_exception(e);
+				}
+			}
+		}
+	};
+
+	inline uring_buffer::~uring_buffer() {
+		if (svc_ && index_ >= 0) {
+			svc_->release_buffer(index_);
+		}
+	}
+
+}
+
+#endif
@@ -10,39 +10,239 @@
 
 namespace zrp {
 
+/**
+ * A fifo on a ring of slots that only ever grows, so that once it has seen
+ * its busiest moment pushing and popping allocates nothing.
+ */
+template <class T>
+struct recycling_queue {
+	vector<optional<T>> slots_;
+	size_t head_ = 0;
+	size_t size_ = 0;
+
+	bool empty() const noexcept {
+		return size_ == 0;
+	}
+
+	size_t size() const noexcept {
+		return size_;
+	}
+
+	T& front() {
+		return *slots_[head_];
+	}
+
+	T& at(size_t i) {
+		return *slots_[(head_ + i) % slots_.size()];
+	}
+
+	void push_back(T t) {
+		if (size_ == slots_.size()) {
+			grow();
+		}
+		slots_[(head_ + size_) % slots_.size()].emplace(move(t));
+		size_++;
+	}
+
+	void pop_front() {
+		slots_[head_].reset();
+		head_ = (head_ + 1) % slots_.size();
+		size_--;
+	}
+
+	void clear() {
+		while (!empty()) {
+			pop_front();
+		}
+	}
+
+private:
+	void grow() {
+		vector<optional<T>> slots(std::max<size_t>(slots_.size() * 2, 8));
+		for (size_t i = 0; i < size_; i++) {
+			slots[i] = move(at(i));
+		}
+		slots_ = move(slots);
+		head_ = 0;
+	}
+};
+
+/**
+ * Values handed from any number of threads to one consumer without a lock.
+ * Producers push onto a list the consumer takes whole. Nodes come from a
+ * free list the consumer refills, so once it has seen its busiest moment
+ * pushing allocates nothing. Nodes are only freed with the inbox.
+ */
+template <class T>
+struct mpsc_inbox {
+	struct node {
+		optional<T> v_;
+		atomic<uint32_t> next_{0}; // 1 + index of the next node, 0 for none
+	};
+
+	static const size_t first_chunk_size = 64; // chunk k holds first_chunk_size << k nodes
+	static const size_t max_chunks = 26; // past that the indexes overflow
+
+	array<atomic<node*>, max_chunks> chunks_{};
+	size_t nr_chunks_ = 0; // guarded by grow_mtx_
+	mutex grow_mtx_; // taken only to add a chunk
+	atomic<uint64_t> free_{0}; // 1 + index of the top in the low half, the high half counts pops against ABA
+	atomic<uint32_t> head_{0}; // 1 + index of the value pushed last
+
+	mpsc_inbox() = default;
+	mpsc_inbox(const mpsc_inbox&) = delete;
+	mpsc_inbox& operator=(const mpsc_inbox&) = delete;
+
+	~mpsc_inbox() {
+		for (auto& it : chunks_) {
+			delete[] it.load(std::memory_order_relaxed);
+		}
+	}
+
+	// from any thread, true if the inbox was empty, so the consumer is to be woken
+	bool push(T v) {
+		uint32_t i = take_free();
+		node& n = at(i);
+		n.v_.emplace(move(v));
+		uint32_t head = head_.load(std::memory_order_relaxed);
+		do {
+			n.next_.store(head, std::memory_order_relaxed);
+		} while (!head_.compare_exchange_weak(head, i + 1, std::memory_order_release, std::memory_order_relaxed));
+		return head == 0;
+	}
+
+	// from the consumer only, calls f with every value pushed so far, oldest first
+	template <class F>
+	void drain(F f) {
+		uint32_t head = head_.exchange(0, std::memory_order_acquire);
+		uint32_t oldest = 0;
+		while (head != 0) {
+			node& n = at(head - 1);
+			uint32_t next = n.next_.load(std::memory_order_relaxed);
+			n.next_.store(oldest, std::memory_order_relaxed);
+			oldest = head;
+			head = next;
+		}
+		while (oldest != 0) {
+			node& n = at(oldest - 1);
+			uint32_t next = n.next_.load(std::memory_order_relaxed);
+			T v{move(*n.v_)};
+			n.v_.reset();
+			put_free(oldest - 1);
+			f(move(v));
+			oldest = next;
+		}
+	}
+
+	bool empty() const noexcept {
+		return head_.load(std::memory_order_relaxed) == 0;
+	}
+
+private:
+	node& at(uint32_t i) noexcept {
+		size_t k = std::bit_width(i / first_chunk_size + 1) - 1;
+		size_t off = i - first_chunk_size * ((size_t{1} << k) - 1);
+		return chunks_[k].load(std::memory_order_acquire)[off];
+	}
+
+	uint32_t take_free() {
+		uint64_t top = free_.load(std::memory_order_acquire);
+		for (;;) {
+			uint32_t i = static_cast<uint32_t>(top);
+			if (i == 0) {
+				grow();
+				top = free_.load(std::memory_order_acquire);
+				continue;
+			}
+			uint32_t next = at(i - 1).next_.load(std::memory_order_relaxed);
+			uint64_t popped = (((top >> 32) + 1) << 32) | next;
+			if (free_.compare_exchange_weak(top, popped, std::memory_order_acquire, std::memory_order_acquire)) {
+				return i - 1;
+			}
+		}
+	}
+
+	// links nodes [first, last] onto the free list
+	void put_free(uint32_t first, uint32_t last) noexcept {
+		node& n = at(last);
+		uint64_t top = free_.load(std::memory_order_relaxed);
+		for (;;) {
+			n.next_.store(static_cast<uint32_t>(top), std::memory_order_relaxed);
+			uint64_t pushed = (top & ~uint64_t{0xffffffff}) | (first + 1);
+			if (free_.compare_exchange_weak(top, pushed, std::memory_order_release, std::memory_order_relaxed)) {
+				return;
+			}
+		}
+	}
+
+	void put_free(uint32_t i) noexcept {
+		put_free(i, i);
+	}
+
+	void grow() {
+		lock_guard lk{grow_mtx_};
+		if (static_cast<uint32_t>(free_.load(std::memory_order_acquire)) != 0) {
+			return; // grown by another producer meanwhile
+		}
+		if (nr_chunks_ == max_chunks) {
+			throw std::bad_alloc{};
+		}
+		size_t k = nr_chunks_;
+		size_t size = first_chunk_size << k;
+		uint32_t first = static_cast<uint32_t>(first_chunk_size * ((size_t{1} << k) - 1));
+		node *chunk = new node[size];
+		for (size_t i = 0; i + 1 < size; i++) {
+			chunk[i].next_.store(first + static_cast<uint32_t>(i) + 2, std::memory_order_relaxed);
+		}
+		chunks_[k].store(chunk, std::memory_order_release);
+		nr_chunks_++;
+		put_free(first, first + static_cast<uint32_t>(size) - 1);
+	}
+};
+
+/**
+ * Hands values from providers to waiters in order, on exec_. With bound
+ * set, up to bound values are buffered and their providers go on at once,
+ * past that a provider waits until its value comes within bound. With
+ * bound 0 every provider waits until its value is taken.
+ */
 template <class R>
 struct waitqueue {
 	using waiter_completion_handler_t = completion_handler<void(error_code, optional<R>)>;
 	using provider_completion_handler_t = completion_handler<void(error_code)>;
 
-	deque<waiter_completion_handler_t> q_;
-	deque<tuple<provider_completion_handler_t, R>> vq_;
+	struct entry {
+		R r_;
+		provider_completion_handler_t h_; // empty once the provider has gone on
+	};
+
+	recycling_queue<waiter_completion_handler_t> q_;
+	recycling_queue<entry> vq_;
 
 	asio::executor exec_;
-	bool closed_{false};
+	size_t bound_;
+	atomic<bool> closed_{false}; // close() may be called from any thread
+
+	mpsc_inbox<R> inbox_; // pushed from other threads
+	bool draining_ = false; // on exec_, a push then goes after what is left in inbox_
 
-	waitqueue(asio::executor exec)
-	: exec_(exec)
+	waitqueue(asio::executor exec, size_t bound = 0)
+	: exec_(exec), bound_(bound)
 	{}
 
 	awaitable<R> wait() {
 		auto initiation = [this](auto&& handler) mutable
 		{
 			waiter_completion_handler_t curr_handler = forward<decltype(handler)>(handler);
-			asio::post(exec_, [this, curr_handler = move(curr_handler)]() mutable {
+			asio::dispatch(exec_, [this, curr_handler = move(curr_handler)]() mutable {
 				if (closed_) {
 					curr_handler(asio::error::operation_aborted, {});
 					return;
 				}
 				if (!vq_.empty()) {
-					auto tup = move(vq_.front());
-					provider_completion_handler_t h{move(std::get<0>(tup))};
-					R r{move(std::get<1>(tup))};
-					vq_.pop_front();
-					curr_handler({}, move(r));
-					h({});
+					curr_handler({}, take_front());
 				} else {
-					q_.emplace_back(move(curr_handler));
+					q_.push_back(move(curr_handler));
 				}
 			});
 		};
@@ -50,44 +250,132 @@ struct waitqueue {
 		co_return move(opt).value();
 	}
 
+	/**
+	 * The value provided first, without waiting, if there is one and pred
+	 * accepts it. Touches the queues directly, so call it on exec_ only.
+	 */
+	template <class Pred>
+	optional<R> try_take_if(Pred pred) {
+		if (closed_ || vq_.empty() || !pred(vq_.front().r_)) {
+			return std::nullopt;
+		}
+		return take_front();
+	}
+
+	optional<R> try_take() {
+		return try_take_if([](const R&) {
+			return true;
+		});
+	}
+
 	awaitable<void> provide(R r) {
-		shared_ptr<R> p_r = make_shared<R>(move(r));
-		auto initiation = [this, p_r](auto&& handler) mutable
+		auto initiation = [this, r = move(r)](auto&& handler) mutable
 		{
 			provider_completion_handler_t curr_handler = forward<decltype(handler)>(handler);
-			asio::post(exec_, [this, curr_handler = move(curr_handler), p_r]() mutable {
-				if (closed_) {
-					curr_handler(asio::error::operation_aborted);
-					return;
-				}
-				if (!q_.empty()) {
-					auto h = move(q_.front());
-					q_.pop_front();
-					h({}, move(*p_r));
-					curr_handler({});
-				} else {
-					vq_.emplace_back(make_tuple<provider_completion_handler_t, R>(move(curr_handler), move(*p_r)));
-				}
+			asio::dispatch(exec_, [this, curr_handler = move(curr_handler), r = move(r)]() mutable {
+				deliver(move(r), move(curr_handler));
 			});
 		};
-		return asio::async_initiate<decltype(asio::use_awaitable), void(error_code)>(initiation, asio::use_awaitable);
+		return asio::async_initiate<decltype(asio::use_awaitable), void(error_code)>(move(initiation), asio::use_awaitable);
+	}
+
+	/**
+	 * Provides without waiting, from any thread. On exec_ it is provided
+	 * right away, from other threads it goes through inbox_, and the values
+	 * pushed before exec_ gets to them are handed over together with one
+	 * post, in order. guard is held until then, pass the owner of the queue
+	 * if it might go away.
+	 */
+	void push(R r, shared_ptr<void> guard = nullptr) {
+		if (on_exec() && inbox_.empty() && !draining_) {
+			deliver(move(r), {});
+			return;
+		}
+		if (inbox_.push(move(r))) {
+			asio::post(exec_, [this, guard = move(guard)]() {
+				drain_inbox();
+			});
+		}
 	}
 
 	void close() {
 		closed_ = true;
 		asio::post(exec_, [this]() mutable {
-			for (auto& it : q_) {
-				it(asio::error::operation_aborted, {});
+			while (!q_.empty()) {
+				auto h = move(q_.front());
+				q_.pop_front();
+				h(asio::error::operation_aborted, {});
 			}
-			q_.clear();
-			for (auto& it : vq_) {
-				std::get<0>(it)(asio::error::operation_aborted);
+			while (!vq_.empty()) {
+				auto h = move(vq_.front().h_);
+				vq_.pop_front();
+				if (h) {
+					h(asio::error::operation_aborted);
+				}
 			}
-			vq_.clear();
 		});
 	}
-};
 
-};
+private:
+	bool on_exec() noexcept {
+		auto ioc_exec = exec_.target<asio::io_context::executor_type>();
+		return ioc_exec && ioc_exec->running_in_this_thread();
+	}
 
+	// with resume_here, a waiter on exec_ goes on right away rather than with a post
+	void deliver(R r, provider_completion_handler_t h, bool resume_here = false) {
+		if (closed_) {
+			if (h) {
+				h(asio::error::operation_aborted);
+			}
+			return;
+		}
+		if (!q_.empty()) {
+			auto w = move(q_.front());
+			q_.pop_front();
+			if (resume_here) {
+				w.dispatch({}, move(r));
+			} else {
+				w({}, move(r));
+			}
+			if (h) {
+				h({});
+			}
+		} else if (!h || vq_.size() < bound_) {
+			vq_.push_back(entry{move(r), {}});
+			if (h) {
+				h({});
+			}
+		} else {
+			vq_.push_back(entry{move(r), move(h)});
+		}
+	}
 
+	R take_front() {
+		R r{move(vq_.front().r_)};
+		auto h = move(vq_.front().h_);
+		vq_.pop_front();
+		if (h) {
+			h({});
+		}
+		if (bound_ > 0 && vq_.size() >= bound_) {
+			auto& e = vq_.at(bound_ - 1);
+			if (e.h_) {
+				auto released = move(e.h_);
+				released({});
+			}
+		}
+		return r;
+	}
+
+	// a handler of its own, so waiters may go on from it without another post
+	void drain_inbox() {
+		draining_ = true;
+		inbox_.drain([this](R r) {
+			deliver(move(r), {}, true);
+		});
+		draining_ = false;
+	}
+};
+
+};
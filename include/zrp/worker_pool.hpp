@@ -0,0 +1,113 @@
+// SPDX-License-Identifier: BSL-1.0
+// copyleft 2021 youcai <omegacoleman@gmail.com>
+// Distributed under the Boost Software License, Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+#pragma once
+
+#include "zrp/bindings.hpp"
+
+#include "zrp/exceptions.hpp"
+
+namespace zrp {
+
+	const chrono::seconds worker_pool_tick{1};
+	const double worker_pool_headroom = 2.0;
+	const double worker_pool_rtt_initial = 0.05; // seconds, until the first worker has connected
+
+	/**
+	 * Exponentially weighted moving average, takes the first sample as is.
+	 */
+	struct ewma {
+		double alpha_;
+		double v_ = 0;
+		bool primed_ = false;
+
+		explicit ewma(double alpha) noexcept
+			: alpha_(alpha) {}
+
+		void add(double sample) noexcept {
+			if (!primed_) {
+				v_ = sample;
+				primed_ = true;
+			} else {
+				v_ += alpha_ * (sample - v_);
+			}
+		}
+
+		double get() const noexcept {
+			return v_;
+		}
+	};
+
+	/**
+	 * Sizes the idle worker pool of a tcp share from its visit rate and the
+	 * time it takes to bring up a worker, so that the pool is refilled about
+	 * as fast as visits drain it.
+	 *
+	 * The visit rate is sampled once per tick into a fast and a slow average,
+	 * the larger one is used, so that bursts grow the pool at once while it
+	 * shrinks back slowly.
+	 */
+	struct worker_pool_sizer {
+		int min_;
+		int max_;
+		int target_;
+		int visits_ = 0;
+		ewma rate_fast_{0.5};
+		ewma rate_slow_{0.05};
+		ewma rtt_{0.2};
+		chrono::steady_clock::time_point last_tick_ = chrono::steady_clock::now();
+
+		worker_pool_sizer(int min, int max, int initial) noexcept
+			: min_(min), max_(max), target_(std::clamp(initial, min, max)) {}
+
+		void on_visit() noexcept {
+			visits_++;
+		}
+
+		void on_connected(chrono::steady_clock::duration took) noexcept {
+			rtt_.add(chrono::duration<double>(took).count());
+		}
+
+		double rate() const noexcept {
+			return std::max(rate_fast_.get(), rate_slow_.get());
+		}
+
+		double rtt() const noexcept {
+			return rtt_.primed_ ? rtt_.get() : worker_pool_rtt_initial;
+		}
+
+		int target() const noexcept {
+			return target_;
+		}
+
+		/**
+		 * Takes this tick's visit count into the averages and returns the new
+		 * target size.
+		 */
+		int tick() noexcept {
+			auto now = chrono::steady_clock::now();
+			double elapsed = chrono::duration<double>(now - last_tick_).count();
+			last_tick_ = now;
+			if (elapsed > 0) {
+				double sample = visits_ / elapsed;
+				rate_fast_.add(sample);
+				rate_slow_.add(sample);
+			}
+			visits_ = 0;
+			double want = std::ceil(worker_pool_headroom * rate() * rtt());
+			target_ = static_cast<int>(std::clamp(want, static_cast<double>(min_), static_cast<double>(max_)));
+			return target_;
+		}
+	};
+
+	inline void check_worker_pool_bounds(int min, int max) {
+		if (min < 0) {
+			throw exceptions::bad_config_value{"worker_count_min", fmt::format(FMT_COMPILE("{}"), min)};
+		}
+		if (max < 1 || max < min) {
+			throw exceptions::bad_config_value{"worker_count_max", fmt::format(FMT_COMPILE("{}"), max)};
+		}
+	}
+
+}
@@ -48,9 +48,43 @@ awaitable<void> handle_sigint(){
 	}
 }
 
+void try_enable_io_uring() {
+#ifdef ZRP_HAS_IO_URING
+	if (pipe_opts.engine != pipe_engine_t::io_uring) {
+		return;
+	}
+	auto logger = log::as(log::tag_main{});
+	uring_options opts;
+	opts.buffer_count = cfg.io_uring_buffers > 0 ? cfg.io_uring_buffers : 0;
+	opts.sqpoll = cfg.io_uring_sqpoll;
+	error_code ec;
+	if (fwd_pool.try_enable_io_uring(opts, ec)) {
+		logger.info("using io_uring pipe engine");
+	} else {
+		logger.warning("io_uring not available, using copy pipe engine instead : ").with_exception(system_error{ec});
+		pipe_opts.engine = pipe_engine_t::copy;
+	}
+#endif
+}
+
 void run() {
 	auto logger = log::as(log::tag_main{});
 	try {
+		if (cfg.log_async) {
+			log::start_writer(log_opts);
+		}
+		int n = cfg.forwarder_threads;
+		if (n <= 0) {
+			n = std::thread::hardware_concurrency();
+			if (n <= 0) {
+				n = 4;
+			}
+		}
+		if (cfg.forwarder_sharding) {
+			fwd_pool.make_shards(n);
+		}
+		fwd_pool.pin_threads(cfg.forwarder_pin_threads);
+		try_enable_io_uring();
 		{
 			auto ctrl = controller::create(ioc, fwd_pool);
 			ctrl->init();
@@ -63,13 +97,6 @@ void run() {
 			sigint_ioc.run();
 		});
 		asio::executor_work_guard<io_threadpool::executor_type> fwd_pool_guard{fwd_pool.get_executor()};
-		int n = cfg.forwarder_threads;
-		if (n <= 0) {
-			n = std::thread::hardware_concurrency();
-			if (n <= 0) {
-				n = 4;
-			}
-		}
 		fwd_pool.start_in_parallel(n, [](int thread_nr) {
 			log::thread_role::as(log::thread_role::fwd_pool_worker{thread_nr});
 		});
@@ -82,6 +109,7 @@ void run() {
 	} catch (const exception &e) {
 		logger.error("client::run() got error, exiting : ").with_exception(e);
 	}
+	log::stop_writer();
 	std::exit(exit_code);
 }
 
@@ -108,6 +136,7 @@ int main(int argc, char** argv) {
 			case zrp::program_action_t::dump_config:
 				zrp::client::dump_example_config(zrp::dump_full);
 				break;
+			case zrp::program_action_t::dump_access_log: // zclient writes none, parse_args() rejects it
 			case zrp::program_action_t::help:
 				zrp::print_usage();
 				break;
@@ -10,11 +10,12 @@
 #include "zrp/dump_config.hpp"
 #include "zrp/io_threadpool.hpp"
 #include "zrp/log.hpp"
+#include "zrp/access_log.hpp"
 
 namespace zrp {
 namespace server {
 
-asio::io_context ioc;
+io_threadpool ioc;
 io_threadpool fwd_pool;
 asio::io_context sigint_ioc;
 int exit_code = 0;
@@ -48,9 +49,54 @@ awaitable<void> handle_sigint(){
 	}
 }
 
+void try_enable_io_uring() {
+#ifdef ZRP_HAS_IO_URING
+	if (pipe_opts.engine != pipe_engine_t::io_uring) {
+		return;
+	}
+	auto logger = log::as(log::tag_main{});
+	uring_options opts;
+	opts.buffer_count = cfg.io_uring_buffers > 0 ? cfg.io_uring_buffers : 0;
+	opts.sqpoll = cfg.io_uring_sqpoll;
+	error_code ec;
+	if (fwd_pool.try_enable_io_uring(opts, ec)) {
+		logger.info("using io_uring pipe engine");
+	} else {
+		logger.warning("io_uring not available, using copy pipe engine instead : ").with_exception(system_error{ec});
+		pipe_opts.engine = pipe_engine_t::copy;
+	}
+#endif
+}
+
 void run() {
 	auto logger = log::as(log::tag_main{});
 	try {
+		if (cfg.log_async) {
+			log::start_writer(log_opts);
+		}
+		if (cfg.access_log && !cfg.access_log_file.empty()) {
+			access_sink = access_log::sink::create(access_log_opts);
+			access_sink->run();
+		}
+		int n = cfg.forwarder_threads;
+		if (n <= 0) {
+			n = std::thread::hardware_concurrency();
+			if (n <= 0) {
+				n = 4;
+			}
+		}
+		if (cfg.forwarder_sharding) {
+			fwd_pool.make_shards(n);
+		}
+		fwd_pool.pin_threads(cfg.forwarder_pin_threads);
+		try_enable_io_uring();
+		int ctrl_n = cfg.control_threads;
+		if (ctrl_n <= 0) {
+			ctrl_n = std::max(std::thread::hardware_concurrency(), 1u);
+		}
+		if (ctrl_n > 1) {
+			ioc.make_shards(ctrl_n);
+		}
 		{
 			auto serv = server::create(ioc, fwd_pool);
 			serv->run();
@@ -62,17 +108,12 @@ void run() {
 			sigint_ioc.run();
 		});
 		asio::executor_work_guard<io_threadpool::executor_type> fwd_pool_guard{fwd_pool.get_executor()};
-		int n = cfg.forwarder_threads;
-		if (n <= 0) {
-			n = std::thread::hardware_concurrency();
-			if (n <= 0) {
-				n = 4;
-			}
-		}
 		fwd_pool.start_in_parallel(n, [](int thread_nr) {
 			log::thread_role::as(log::thread_role::fwd_pool_worker{thread_nr});
 		});
-		ioc.run();
+		ioc.run_sharded([](int thread_nr) {
+			log::thread_role::as(log::thread_role::ctrl_pool_worker{thread_nr});
+		});
 		fwd_pool_guard.reset();
 		fwd_pool.join_all();
 		sigint_ioc.stop();
@@ -81,6 +122,10 @@ void run() {
 	} catch (const exception &e) {
 		logger.error("server::run() got error, exiting :").with_exception(e);
 	}
+	if (access_sink) {
+		access_sink->stop();
+	}
+	log::stop_writer();
 	std::exit(exit_code);
 }
 
@@ -89,6 +134,7 @@ void run() {
 
 int main(int argc, char** argv) {
 	zrp::parse_env();
+	zrp::with_access_log = true;
 	zrp::log::thread_role::as(zrp::log::thread_role::main{});
 	auto logger = zrp::log::as(zrp::log::tag_main{});
 	try {
@@ -107,6 +153,9 @@ int main(int argc, char** argv) {
 			case zrp::program_action_t::dump_config:
 				zrp::server::dump_example_config(zrp::dump_full);
 				break;
+			case zrp::program_action_t::dump_access_log:
+				zrp::access_log::dump(zrp::access_log_path);
+				break;
 			case zrp::program_action_t::help:
 				zrp::print_usage();
 				break;
@@ -0,0 +1,96 @@
+// SPDX-License-Identifier: BSL-1.0
+// copyleft 2021 youcai <omegacoleman@gmail.com>
+// Distributed under the Boost Software License, Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+// Checks that a binary ping/pong through msg_codec allocates nothing once
+// warmed up, by counting every global operator new.
+
+#include <cstdlib>
+#include <new>
+
+#include "zrp/msg.hpp"
+
+namespace {
+	std::atomic<long> allocs{0};
+}
+
+void* operator new(std::size_t n) {
+	allocs.fetch_add(1, std::memory_order_relaxed);
+	if (void *p = std::malloc(n ? n : 1)) {
+		return p;
+	}
+	throw std::bad_alloc{};
+}
+
+void* operator new[](std::size_t n) {
+	return ::operator new(n);
+}
+
+// out of line, or gcc warns of free() on what it takes to be the builtin new
+[[gnu::noinline]] void operator delete(void *p) noexcept {
+	std::free(p);
+}
+
+[[gnu::noinline]] void operator delete[](void *p) noexcept {
+	std::free(p);
+}
+
+[[gnu::noinline]] void operator delete(void *p, std::size_t) noexcept {
+	std::free(p);
+}
+
+[[gnu::noinline]] void operator delete[](void *p, std::size_t) noexcept {
+	std::free(p);
+}
+
+namespace zrp {
+
+const int warm_up_rounds = 100;
+const int rounds = 10000;
+
+awaitable<long> ping_pong(tcp::socket &a, tcp::socket &b) {
+	msg_codec ca, cb;
+	long before = 0;
+	for (int i = 0; i < warm_up_rounds + rounds; i++) {
+		if (i == warm_up_rounds) {
+			before = allocs.load();
+		}
+		co_await ca.send(a, marshal_msg(msg::ping{}, msg_format::binary));
+		auto in = co_await cb.recv(b);
+		unmarshal_msg<msg::ping, msg::worker_retire>(in);
+		co_await cb.send(b, marshal_msg(msg::pong{}, msg_format::binary));
+		auto back = co_await ca.recv(a);
+		unmarshal_msg<msg::pong, msg::worker_demand>(back);
+	}
+	co_return allocs.load() - before;
+}
+
+int run() {
+	asio::io_context ioc;
+	tcp::acceptor acc{ioc, tcp::endpoint{asio::ip::address_v4::loopback(), 0}};
+	tcp::socket a{ioc}, b{ioc};
+	a.connect(acc.local_endpoint());
+	acc.accept(b);
+
+	long got = -1;
+	co_spawn(ioc, ping_pong(a, b), [&](exception_ptr ep, long n) {
+		if (ep) {
+			std::rethrow_exception(ep);
+		}
+		got = n;
+	});
+	ioc.run();
+
+	if (got != 0) {
+		fmt::print(stderr, "{} allocations over {} round trips, expected none\n", got, rounds);
+		return 1;
+	}
+	fmt::print("no allocations over {} round trips\n", rounds);
+	return 0;
+}
+
+}
+
+int main() {
+	return zrp::run();
+}
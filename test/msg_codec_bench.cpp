@@ -0,0 +1,84 @@
+// SPDX-License-Identifier: BSL-1.0
+// copyleft 2021 youcai <omegacoleman@gmail.com>
+// Distributed under the Boost Software License, Version 1.0. (See accompanying file LICENSE_1_0.txt or copy at http://www.boost.org/LICENSE_1_0.txt)
+
+// Times marshalling a message into a frame and unmarshalling it back, in
+// json and in the binary form, for the messages sent most.
+//
+//     msg_codec_bench [iterations]
+
+#include <cstdlib>
+
+#include "zrp/msg.hpp"
+
+namespace zrp {
+
+using bench_clock = chrono::steady_clock;
+
+volatile size_t bench_sink; // keeps the work from being optimized out
+
+double ns_per_op(bench_clock::duration d, int iterations) {
+	return static_cast<double>(chrono::duration_cast<chrono::nanoseconds>(d).count()) / iterations;
+}
+
+template <class Message, class Touch>
+void bench(string_view name, const Message& m, msg_format f, int iterations, Touch touch) {
+	string out;
+	json::serializer sr;
+	size_t sink = 0;
+
+	auto t0 = bench_clock::now();
+	for (int i = 0; i < iterations; i++) {
+		out.clear();
+		encode_frame(marshal_msg(m, f), out, sr);
+		sink += out.size();
+	}
+	auto t1 = bench_clock::now();
+
+	msg_codec codec;
+	codec.in_ = out;
+	for (int i = 0; i < iterations; i++) {
+		msg_t in = codec.decode(out.size());
+		sink += touch(std::get<Message>(unmarshal_msg<Message>(in)));
+	}
+	auto t2 = bench_clock::now();
+
+	bench_sink = sink;
+
+	fmt::print(FMT_COMPILE("{:<16} {:<7} {:>6} {:>13.1f} {:>15.1f}\n"),
+		name, f == msg_format::json ? "json" : "binary", out.size(),
+		ns_per_op(t1 - t0, iterations), ns_per_op(t2 - t1, iterations));
+}
+
+int run(int iterations) {
+	msg::ping ping;
+	msg::visit_tcp_share visit;
+	visit.epoch = 1634400000123;
+	visit.peer.ip = "203.0.113.45";
+	visit.peer.port = 51234;
+
+	auto touch_ping = [](const msg::ping&) -> size_t {
+		return 1;
+	};
+	auto touch_visit = [](const msg::visit_tcp_share& v) -> size_t {
+		return v.peer.port + v.peer.ip.size();
+	};
+
+	fmt::print("{} iterations each\n", iterations);
+	fmt::print("{:<16} {:<7} {:>6} {:>13} {:>15}\n", "message", "format", "bytes", "marshal ns", "unmarshal ns");
+	for (auto f : {msg_format::json, msg_format::binary}) {
+		bench("ping", ping, f, iterations, touch_ping);
+		bench("visit_tcp_share", visit, f, iterations, touch_visit);
+	}
+	return 0;
+}
+
+}
+
+int main(int argc, char *argv[]) {
+	int iterations = 1000000;
+	if (argc > 1) {
+		iterations = std::max(1, std::atoi(argv[1]));
+	}
+	return zrp::run(iterations);
+}